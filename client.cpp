@@ -2,6 +2,7 @@
 #include <string>
 #include <thread>
 #include <cstring>
+#include <cstdlib>
 #include <arpa/inet.h>
 #include <unistd.h>
 
@@ -45,7 +46,14 @@ void communicateWithServer(int clientSocket) {
     close(clientSocket);
 }
 
-int main() {
+// client [PORT] — порт сервера (или маршрутизатора кластера), по умолчанию 7432
+int main(int argc, char* argv[]) {
+    int port = (argc > 1) ? atoi(argv[1]) : 7432;
+    if (port <= 0 || port > 65535) {
+        cerr << "Неверный порт.\n";
+        return 1;
+    }
+
     // Создание клиентского сокета
     int clientSocket = socket(AF_INET, SOCK_STREAM, 0);
     if (clientSocket < 0) {
@@ -56,7 +64,7 @@ int main() {
     // Настройка адреса и порта сервера
     struct sockaddr_in serverAddr;
     serverAddr.sin_family = AF_INET; // протокол IPv4
-    serverAddr.sin_port = htons(7432);  // Порт сервера 7432
+    serverAddr.sin_port = htons(port);  // Порт сервера
     serverAddr.sin_addr.s_addr = inet_addr("127.0.0.1");  // Адрес сервера (localhost)
 
     // Подключение клиента к серверу
@@ -4,662 +4,6387 @@
 #include <fstream>
 #include <sys/stat.h>       
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <unistd.h>
+#include <csignal>
 #include <stdexcept>
 #include <cstring>          
 #include <thread>           
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <coroutine>
+#include <functional>
 #include <sstream>
 #include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdint>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cerrno>
 #include "json.hpp"
 
 using namespace std;
 using json = nlohmann::json;
 
 
-// Односвязный список для хранения JSON-строк таблицы
+// Пытаемся прочитать значение как конечное десятичное число. "nan", "inf" и
+// шестнадцатеричную запись strtod тоже понимает, но это строки: NaN не
+// сравним ни с одним числом и сломал бы порядок compareValues
+bool parseNumber(const string& s, double& out){
+    size_t i = 0, n = s.size(), digits = 0;
+    if(i < n && (s[i] == '+' || s[i] == '-')) i++;
+    for(; i < n && isdigit((unsigned char)s[i]); i++) digits++;
+    if(i < n && s[i] == '.'){
+        for(i++; i < n && isdigit((unsigned char)s[i]); i++) digits++;
+    }
+    if(digits == 0) return false;
+    if(i < n && (s[i] == 'e' || s[i] == 'E')){
+        i++;
+        if(i < n && (s[i] == '+' || s[i] == '-')) i++;
+        size_t exp_digits = 0;
+        for(; i < n && isdigit((unsigned char)s[i]); i++) exp_digits++;
+        if(exp_digits == 0) return false;
+    }
+    if(i != n) return false;
+    out = strtod(s.c_str(), nullptr);
+    return isfinite(out);      // 1e999 — тоже строка
+}
 
-struct TableDataNode {
-    string record_str;
-    TableDataNode* next;
-    TableDataNode(const string& s) : record_str(s), next(nullptr) {}
-};
+// Целое, которое печатается обратно ровно той же строкой ("007" и "+5" не подходят)
+bool parseInt64Exact(const string& s, int64_t& v){
+    if(s.empty() || s.size() > 20) return false;
+    char* end = nullptr;
+    errno = 0;
+    long long r = strtoll(s.c_str(), &end, 10);
+    if(errno != 0 || *end != '\0') return false;
+    v = r;
+    return to_string(v) == s;
+}
+
+// Кратчайшая запись double, которая читается обратно без потерь
+string formatDouble(double d){
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.15g", d);
+    if(strtod(buf, nullptr) != d) snprintf(buf, sizeof(buf), "%.17g", d);
+    return buf;
+}
 
+// Сравнение значений: числа сравниваем как числа и ставим раньше строк,
+// строки — лексикографически. Порядок полный, поэтому годится и для индекса
+int compareValues(const string& a, const string& b){
+    double da, dbl;
+    bool na = parseNumber(a, da), nb = parseNumber(b, dbl);
+    if(na && nb){
+        if(da < dbl) return -1;
+        if(da > dbl) return 1;
+        return 0;
+    }
+    if(na != nb) return na ? -1 : 1;
+    int c = a.compare(b);
+    return c < 0 ? -1 : (c > 0 ? 1 : 0);
+}
 
-// Узел, описывающий одну таблицу
 
-struct Node {
-    string name;            // имя таблицы
-    TableDataNode* data;    // список JSON-строк
-    Node* next;             // следующий узел (таблица)
+// Односвязный список строк таблицы. Строка хранится в собственном
+// формате, раскладку задают колонки таблицы (см. Node::layout):
+// [маска NULL][ячейки фиксированной длины][байты строковых значений]
 
-    Node(const string& n) : name(n), data(nullptr), next(nullptr) {}
+struct TableDataNode {
+    char* buf;
+    TableDataNode* next;
+    bool owned;             // buf в куче; иначе указывает в отображённый файл
+    TableDataNode(char* b, bool own = true) : buf(b), next(nullptr), owned(own) {}
+    ~TableDataNode(){ if(owned) delete[] buf; }
 };
 
 
-// Структура базы данных
+// Файл, отображённый в память только для чтения
 
-struct dbase {
-    string schema_name;
-    Node* head;
+struct MappedFile {
+    char* base;
+    size_t len;
 
-    dbase() : head(nullptr) {}
-    ~dbase() {
-        // Удаляем список таблиц
-        while(head){
-            Node* tmp= head;
-            head= head->next;
-            // Удаляем список data
-            TableDataNode* d= tmp->data;
-            while(d){
-                TableDataNode* dn= d->next;
-                delete d;
-                d= dn;
-            }
-            delete tmp;
+    MappedFile() : base(nullptr), len(0) {}
+    ~MappedFile(){ if(base) munmap(base, len); }
+
+    bool open(const string& path){
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0) return false;
+        struct stat st;
+        if(fstat(fd, &st) != 0 || st.st_size == 0){
+            close(fd);
+            return false;
         }
+        void* m = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if(m == MAP_FAILED) return false;
+        base = (char*)m;
+        len = st.st_size;
+        return true;
     }
 
-    // Поиск таблицы
-    Node* findNode(const string& table_name){
-        Node* cur= head;
-        while(cur){
-            if(cur->name == table_name) return cur;
-            cur= cur->next;
-        }
-        return nullptr;
+    // Подсказка ОС о порядке чтения всего файла. Режим общий для всех
+    // читателей, поэтому меняем его только пока таблица ни с кем не делится
+    // (первый проход при загрузке)
+    void advise(int advice){
+        if(base) madvise(base, len, advice);
     }
 
-    // Добавить таблицу (в начало списка)
-    void addNode(const string& table_name){
-        Node* nd= new Node(table_name);
-        nd->next= head;
-        head= nd;
+    // Запросить чтение диапазона заранее. Состояние отображения не меняет —
+    // одновременные запросы друг другу не мешают
+    void willNeed(const char* from, const char* to){
+        if(!base || from < base || to > base + len || from >= to) return;
+        uintptr_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t lo = (uintptr_t)from & ~(page - 1);
+        madvise((void*)lo, (uintptr_t)to - lo, MADV_WILLNEED);
     }
 };
 
 
-// Добавление строки JSON в таблицу
-
-void addDataToTable(Node* table_node, const string& json_str){
-    if(!table_node) return;
-    TableDataNode* nd= new TableDataNode(json_str);
-    nd->next= table_node->data;
-    table_node->data= nd;
-}
+// Упорядоченный индекс по одной колонке: B+-дерево.
+// Записи (значение, строка) лежат только в листьях, листья связаны в
+// двусвязный список — диапазон читается последовательным проходом.
 
+struct IndexEntry {
+    string key;
+    TableDataNode* row;
+};
 
-// Структура и список условий WHERE
+bool indexEntryLess(const IndexEntry& a, const IndexEntry& b){
+    int c = compareValues(a.key, b.key);
+    if(c != 0) return c < 0;
+    return less<TableDataNode*>()(a.row, b.row);
+}
 
-struct Condition {
-    string column;
-    string op;      // =, !=, <, >, <=, >=
-    string value;
-};
+// Диапазон значений ключа, извлечённый из WHERE
+struct KeyRange {
+    bool has_lo, lo_incl;
+    bool has_hi, hi_incl;
+    string lo, hi;
+    KeyRange() : has_lo(false), lo_incl(true), has_hi(false), hi_incl(true) {}
 
-const int MAX_COND = 100;
-struct ConditionList {
-    Condition conds[MAX_COND];
-    int count;
-    ConditionList() : count(0) {}
+    bool aboveLo(const string& k) const {
+        if(!has_lo) return true;
+        int c = compareValues(k, lo);
+        return lo_incl ? c >= 0 : c > 0;
+    }
+    bool belowHi(const string& k) const {
+        if(!has_hi) return true;
+        int c = compareValues(k, hi);
+        return hi_incl ? c <= 0 : c < 0;
+    }
 };
 
+const int BPT_MAX_KEYS = 64;
 
+struct BPTNode {
+    bool leaf;
+    vector<IndexEntry> keys;        // в листе — записи, во внутреннем узле — разделители
+    vector<BPTNode*> children;      // только во внутреннем узле: keys.size() + 1
+    BPTNode* prev;                  // соседние листья
+    BPTNode* next;
+    BPTNode(bool l) : leaf(l), prev(nullptr), next(nullptr) {}
+};
 
-int my_mkdir(const char* path){
-    return mkdir(path, 0777);
-}
+// Курсор по листьям индекса в пределах диапазона
+struct IndexCursor {
+    BPTNode* leaf;
+    long pos;
+    bool desc;
+    KeyRange range;
+    IndexCursor() : leaf(nullptr), pos(0), desc(false) {}
 
-// Создаём директории и CSV-файлы по схеме
-void createDirectories(dbase& db, const json& structure) {
-    if(my_mkdir(db.schema_name.c_str()) && errno != EEXIST){
-        cerr << "Failed to create directory: " << db.schema_name << endl;
-    }
-    for(auto it = structure.begin(); it != structure.end(); ++it){
-        string tname = it.key();
-        string tpath = db.schema_name + "/" + tname;
-        if(my_mkdir(tpath.c_str()) && errno != EEXIST){
-            cerr << "Failed to create directory: " << tpath << endl;
+    // Текущая строка или nullptr, если диапазон исчерпан
+    TableDataNode* row(){
+        while(leaf && (pos < 0 || pos >= (long)leaf->keys.size())){
+            // Пустые листья (после удалений) просто пропускаем
+            leaf = desc ? leaf->prev : leaf->next;
+            if(leaf) pos = desc ? (long)leaf->keys.size() - 1 : 0;
         }
-        string fname = tpath + "/1.csv";
-        ifstream ck(fname.c_str());
-        if(!ck){
-            ofstream of(fname.c_str());
-            if(of.is_open()){
-                auto& cols = it.value();
-                // Пишем заголовок
-                for(size_t i = 0; i < cols.size(); i++){
-                    of << cols[i].get<string>();
-                    if(i + 1 < cols.size()) of << " ";
-                }
-                of << "\n";
-                of.close();
-            }
+        if(!leaf) return nullptr;
+        const string& k = leaf->keys[pos].key;
+        if(desc ? !range.aboveLo(k) : !range.belowHi(k)){
+            leaf = nullptr;
+            return nullptr;
         }
+        return leaf->keys[pos].row;
     }
-}
-
-// Загрузка схемы
-void loadSchema(dbase& db, const string& schema_file){
-    ifstream f(schema_file.c_str());
-    if(!f.is_open()){
-        cerr << "Failed to open schema file: " << schema_file << "\n";
-        return;
-    }
-    json j;
-    f >> j;
-    db.schema_name = j["name"];
-    createDirectories(db, j["structure"]);
-    for(auto it = j["structure"].begin(); it != j["structure"].end(); ++it){
-        db.addNode(it.key());
+    TableDataNode* advance(){
+        pos += desc ? -1 : 1;
+        return row();
     }
-    cout << "Schema loaded: " << db.schema_name << endl;
-}
+};
 
+struct OrderedIndex {
+    string column;
+    BPTNode* root;
+    size_t size;
+    OrderedIndex* next;
 
-// Загрузка CSV
+    OrderedIndex(const string& col) : column(col), root(new BPTNode(true)), size(0), next(nullptr) {}
+    ~OrderedIndex(){ destroy(root); }
 
-void loadData(dbase& db){
-    Node* cur = db.head;
-    while(cur){
-        string path = db.schema_name + "/" + cur->name + "/1.csv";
-        ifstream ifs(path.c_str());
-        if(ifs.is_open()){
-            cout << "Loading table: " << cur->name << endl;
-            bool is_header = true;
-            string line;
-            while(getline(ifs, line)){
-                if(is_header){
-                    is_header = false;
-                    continue;
-                }
-                // поля
-                string fields[10];
-                int count_fields = 0;
-                {
-                    istringstream iss(line);
-                    while(count_fields < 10){
-                        string tmp;
-                        if(!getline(iss, tmp, ' ')) break;
-                        while(!tmp.empty() && (tmp.front() == ' ' || tmp.front() == '\t')) tmp.erase(tmp.begin());
-                        while(!tmp.empty() && (tmp.back() == ' ' || tmp.back() == '\t'))   tmp.pop_back();
-                        fields[count_fields++] = tmp;
-                    }
-                }
-                json entry;
-                if(count_fields > 0) entry["name"]   = fields[0];
-                if(count_fields > 1) entry["age"]    = fields[1];
-                if(count_fields > 2) entry["adress"] = fields[2];
-                if(count_fields > 3) entry["number"] = fields[3];
+    void destroy(BPTNode* n){
+        for(size_t i = 0; i < n->children.size(); i++) destroy(n->children[i]);
+        delete n;
+    }
 
-                addDataToTable(cur, entry.dump());
-                cout << "Loaded entry: " << entry.dump() << endl;
-            }
-            ifs.close();
+    void insert(const string& key, TableDataNode* row){
+        IndexEntry e = {key, row};
+        IndexEntry sep;
+        BPTNode* right = insertInto(root, e, sep);
+        if(right){
+            BPTNode* nr = new BPTNode(false);
+            nr->keys.push_back(sep);
+            nr->children.push_back(root);
+            nr->children.push_back(right);
+            root = nr;
         }
-        cur = cur->next;
+        size++;
     }
-}
-
-
-// Сохранение одной записи в CSV
 
-void saveSingleEntryToCSV(dbase& db, const string& table, const json& entry){
-    string path = db.schema_name + "/" + table + "/1.csv";
-    ofstream of(path.c_str(), ios::app);
-    if(!of.is_open()){
-        cerr << "Failed to open " << path << endl;
-        return;
-    }
-    if(entry.contains("name") && entry.contains("age")){
-        of << entry["name"].get<string>() << " "
-           << entry["age"].get<string>() << " ";
-        if(entry.contains("adress")){
-            of << entry["adress"].get<string>() << " ";
+    // Вставка в поддерево; при переполнении узел делится, правая половина возвращается
+    BPTNode* insertInto(BPTNode* n, const IndexEntry& e, IndexEntry& sep){
+        size_t i = upper_bound(n->keys.begin(), n->keys.end(), e, indexEntryLess) - n->keys.begin();
+        if(n->leaf){
+            n->keys.insert(n->keys.begin() + i, e);
         }
         else{
-            of << "NULL ";
+            IndexEntry child_sep;
+            BPTNode* split = insertInto(n->children[i], e, child_sep);
+            if(split){
+                n->keys.insert(n->keys.begin() + i, child_sep);
+                n->children.insert(n->children.begin() + i + 1, split);
+            }
         }
-        if(entry.contains("number")){
-            of << entry["number"].get<string>();
+        if((int)n->keys.size() <= BPT_MAX_KEYS) return nullptr;
+
+        size_t mid = n->keys.size() / 2;
+        BPTNode* r = new BPTNode(n->leaf);
+        if(n->leaf){
+            r->keys.assign(n->keys.begin() + mid, n->keys.end());
+            n->keys.resize(mid);
+            sep = r->keys.front();
+            r->next = n->next;
+            if(r->next) r->next->prev = r;
+            n->next = r;
+            r->prev = n;
         }
         else{
-            of << "NULL";
+            sep = n->keys[mid];
+            r->keys.assign(n->keys.begin() + mid + 1, n->keys.end());
+            r->children.assign(n->children.begin() + mid + 1, n->children.end());
+            n->keys.resize(mid);
+            n->children.resize(mid + 1);
         }
-        of << "\n";
+        return r;
     }
-    of.close();
-}
 
-
-// INSERT
-
-void insertRecord(dbase& db, const string& table, json entry){
-    Node* tbl = db.findNode(table);
-    if(!tbl){
-        cerr << "Table not found: " << table << endl;
-        return;
+    // Удаление без слияния узлов: разделители остаются корректными,
+    // а опустевшие листья курсор пропускает
+    void erase(const string& key, TableDataNode* row){
+        IndexEntry e = {key, row};
+        BPTNode* n = root;
+        while(!n->leaf){
+            size_t i = upper_bound(n->keys.begin(), n->keys.end(), e, indexEntryLess) - n->keys.begin();
+            n = n->children[i];
+        }
+        auto it = lower_bound(n->keys.begin(), n->keys.end(), e, indexEntryLess);
+        if(it != n->keys.end() && it->row == row){
+            n->keys.erase(it);
+            size--;
+        }
     }
-    addDataToTable(tbl, entry.dump());
-    saveSingleEntryToCSV(db, table, entry);
-}
-
-
-// DELETE
 
-void deleteRow(dbase& db, const string& column, const string& value, const string& table){
-    Node* tbl = db.findNode(table);
-    if(!tbl){
-        cerr << "Table not found " << table << endl;
-        return;
-    }
-    TableDataNode dummy("");
-    dummy.next = tbl->data;
-    TableDataNode* prev = &dummy;
-    TableDataNode* cur = tbl->data;
-    bool found = false;
-    while(cur){
-        json e = json::parse(cur->record_str);
-        bool match = false;
-        if(e.contains(column)){
-            if(e[column].get<string>() == value) match = true;
+    // Курсор на первую (или, при desc, последнюю) запись диапазона
+    IndexCursor open(const KeyRange& range, bool desc){
+        IndexCursor cur;
+        cur.range = range;
+        cur.desc = desc;
+        BPTNode* n = root;
+        while(!n->leaf){
+            size_t i;
+            if(!desc){
+                // Самый левый лист, где может лежать ключ >= lo
+                i = 0;
+                if(range.has_lo){
+                    while(i < n->keys.size() && compareValues(n->keys[i].key, range.lo) < 0) i++;
+                }
+            }
+            else{
+                // Самый правый лист, где может лежать ключ <= hi
+                i = n->keys.size();
+                if(range.has_hi){
+                    i = 0;
+                    while(i < n->keys.size() && compareValues(n->keys[i].key, range.hi) <= 0) i++;
+                }
+            }
+            n = n->children[i];
         }
-        if(match){
-            found = true;
-            cout << "Deleted row: " << e.dump() << endl;
-            prev->next = cur->next;
-            delete cur;
-            cur = prev->next;
+        cur.leaf = n;
+        if(!desc){
+            cur.pos = 0;
+            while(cur.pos < (long)n->keys.size() && !range.aboveLo(n->keys[cur.pos].key)) cur.pos++;
         }
         else{
-            prev = cur;
-            cur = cur->next;
-        }
-    }
-    tbl->data = dummy.next;
-    if(found){
-        // Перезаписываем CSV
-        string path = db.schema_name + "/" + table + "/1.csv";
-        ofstream of(path.c_str());
-        if(!of.is_open()){
-            cerr << "Failed to rewrite " << path << endl;
-            return;
-        }
-        // Заголовок
-        of << "name age adress number\n";
-        TableDataNode* p = tbl->data;
-        while(p){
-            json e2 = json::parse(p->record_str);
-            if(e2.contains("name") && e2.contains("age")){
-                of << e2["name"].get<string>() << " "
-                   << e2["age"].get<string>() << " "
-                   << (e2.contains("adress") ? e2["adress"].get<string>() : "NULL") << " "
-                   << (e2.contains("number") ? e2["number"].get<string>() : "NULL") << "\n";
-            }
-            p = p->next;
+            cur.pos = (long)n->keys.size() - 1;
+            while(cur.pos >= 0 && !range.belowHi(n->keys[cur.pos].key)) cur.pos--;
         }
-        of.close();
-        cout << "CSV file rewritten: " << path << endl;
-    }
-    else{
-        cout << "Row with " << column << "=" << value << " not found in " << table << endl;
+        return cur;
     }
-}
+};
 
 
-// Парсинг WHERE
+// Фильтр Блума по колонке: быстрый ответ «такого значения точно нет».
+// Удалений не поддерживает — после DELETE фильтр перестраивается.
 
-void parseWhereClause(const string& where_clause, ConditionList& cond_list, string& logical_op){
-    cond_list.count = 0;
-    logical_op.clear();
-    size_t pos_and = where_clause.find(" AND ");
-    size_t pos_or = where_clause.find(" OR ");
-    if(pos_and != string::npos){
-        logical_op = "AND";
-    }
-    else if(pos_or != string::npos){
-        logical_op = "OR";
-    }
-    size_t start = 0;
-    while(start < where_clause.size()){
-        size_t next_pos = string::npos;
-        if(logical_op == "AND"){
-            next_pos = where_clause.find(" AND ", start);
-        }
-        else if(logical_op == "OR"){
-            next_pos = where_clause.find(" OR ", start);
-        }
-        string part;
-        if(next_pos != string::npos){
-            part = where_clause.substr(start, next_pos - start);
-            start = next_pos + 5;
-        }
-        else{
-            part = where_clause.substr(start);
-            start = where_clause.size();
-        }
-        while(!part.empty() && (part.front() == ' ' || part.front() == '\t')) part.erase(part.begin());
-        while(!part.empty() && (part.back() == ' ' || part.back() == '\t'))   part.pop_back();
+const size_t BLOOM_BITS_PER_ITEM = 10;
+const int BLOOM_HASHES = 7;
+const size_t BLOOM_MIN_ITEMS = 1024;
 
-        size_t p = part.find("!=");
-        string op;
-        if(p != string::npos) op = "!=";
-        else{
-            p = part.find('=');
-            if(p != string::npos) op = "=";
-            else{
-                p = part.find('<');
-                if(p != string::npos){
-                    if(p + 1 < part.size() && part[p+1] == '=') { op = "<="; p++; }
-                    else op = "<";
-                }
-                else{
-                    p = part.find('>');
-                    if(p != string::npos){
-                        if(p + 1 < part.size() && part[p+1] == '=') { op = ">="; p++; }
-                        else op = ">";
-                    }
-                }
-            }
-        }
+struct BloomFilter {
+    string column;
+    vector<uint64_t> bits;
+    size_t nbits;
+    size_t items;
+    BloomFilter* next;
 
-        if(p == string::npos) continue;
-        Condition c;
-        c.op = op;
-        string col = part.substr(0, p);
-        string val = part.substr(p + op.size());
-        while(!col.empty() && (col.front() == ' ' || col.front() == '\t')) col.erase(col.begin());
-        while(!col.empty() && (col.back() == ' ' || col.back() == '\t'))   col.pop_back();
-        while(!val.empty() && (val.front() == ' ' || val.front() == '\t' || val.front() == '\'')) val.erase(val.begin());
-        while(!val.empty() && (val.back() == ' ' || val.back() == '\t' || val.back() == '\''))   val.pop_back();
-        c.column = col;
-        c.value = val;
-        if(cond_list.count < MAX_COND){
-            cond_list.conds[cond_list.count++] = c;
-        }
+    BloomFilter(const string& col) : column(col), nbits(0), items(0), next(nullptr) {
+        reset(BLOOM_MIN_ITEMS);
     }
-}
 
-bool checkOneCondition(const json& entry, const Condition& c){
-    if(!entry.contains(c.column)) return false;
-    string v = entry[c.column].get<string>();
-    if(c.op == "=")   return (v == c.value);
-    if(c.op == "!=")  return (v != c.value);
-    if(c.op == "<")   return (v < c.value);
-    if(c.op == ">")   return (v > c.value);
-    if(c.op == "<=")  return (v <= c.value);
-    if(c.op == ">=")  return (v >= c.value);
-    return false;
-}
+    void reset(size_t expected_items){
+        if(expected_items < BLOOM_MIN_ITEMS) expected_items = BLOOM_MIN_ITEMS;
+        nbits = expected_items * BLOOM_BITS_PER_ITEM;
+        bits.assign((nbits + 63) / 64, 0);
+        items = 0;
+    }
 
-bool checkAllConditions(const json& entry, const ConditionList& clist, const string& logical_op){
-    if(clist.count == 0) return true;
-    if(logical_op == "AND"){
-        for(int i = 0; i < clist.count; i++){
-            if(!checkOneCondition(entry, clist.conds[i])) return false;
-        }
-        return true;
+    // Заполнен сверх расчётного — ложных срабатываний станет слишком много
+    bool overfull() const {
+        return items > nbits / BLOOM_BITS_PER_ITEM;
+    }
+
+    // Двойное хеширование: h1 + i*h2
+    static void hashes(const string& v, uint64_t& h1, uint64_t& h2){
+        h1 = std::hash<string>()(v);
+        h2 = h1 ^ (h1 >> 33);
+        h2 *= 0xff51afd7ed558ccdULL;
+        h2 ^= h2 >> 33;
+        h2 |= 1;
     }
-    else if(logical_op == "OR"){
-        for(int i = 0; i < clist.count; i++){
-            if(checkOneCondition(entry, clist.conds[i])) return true;
+
+    void add(const string& v){
+        uint64_t h1, h2;
+        hashes(v, h1, h2);
+        for(int i = 0; i < BLOOM_HASHES; i++){
+            uint64_t b = (h1 + i * h2) % nbits;
+            bits[b / 64] |= (1ULL << (b % 64));
         }
-        return false;
+        items++;
     }
-    else{
-        // нет логического оператора => AND
-        for(int i = 0; i < clist.count; i++){
-            if(!checkOneCondition(entry, clist.conds[i])) return false;
+
+    bool mayContain(const string& v) const {
+        uint64_t h1, h2;
+        hashes(v, h1, h2);
+        for(int i = 0; i < BLOOM_HASHES; i++){
+            uint64_t b = (h1 + i * h2) % nbits;
+            if(!(bits[b / 64] & (1ULL << (b % 64)))) return false;
         }
         return true;
     }
-}
+};
 
 
-// SELECT (одна таблица)
+// Блоки строк с зон-картами: для каждой колонки храним min/max значений
+// блока, чтобы скан мог пропускать блоки, заведомо не проходящие WHERE.
+// Блоки идут в том же порядке, что и строки, и целиком покрывают список.
 
-void selectFromTable(dbase& db,
-                     const string& table,
+const size_t ZONE_BLOCK_ROWS = 256;
+
+struct ZoneRange {
+    string min_v, max_v;
+};
+
+struct RowBlock {
+    TableDataNode* first;
+    TableDataNode* last;
+    size_t rows;
+    unordered_map<string, ZoneRange> zones;     // колонки, встретившиеся в блоке
+    RowBlock* next;
+    RowBlock() : first(nullptr), last(nullptr), rows(0), next(nullptr) {}
+
+    void widen(const json& e){
+        for(auto it = e.begin(); it != e.end(); ++it){
+            string v = it.value().get<string>();
+            auto z = zones.find(it.key());
+            if(z == zones.end()){
+                ZoneRange zr = {v, v};
+                zones.emplace(it.key(), zr);
+                continue;
+            }
+            if(compareValues(v, z->second.min_v) < 0) z->second.min_v = v;
+            if(compareValues(v, z->second.max_v) > 0) z->second.max_v = v;
+        }
+    }
+};
+
+
+// Файловый ввод-вывод в фоне. Потоки запросов только ставят операции в
+// очередь и на диске не ждут; ответ на запись клиент получает, когда её
+// операция уже на диске (это ждёт сессия в реакторе, см. DiskSynced).
+// Отдельный поток забирает очередь пачкой,
+// склеивает дозаписи в один файл в одну запись и отправляет их через io_uring:
+// на каждый файл запись и связанный с ней fdatasync, все файлы пачки — одним
+// вызовом. Без io_uring (старое ядро, запрет в контейнере) тот же поток
+// делает pwrite и fdatasync сам. Перезапись файла — во временный и rename
+
+// Минимальная обёртка над кольцами io_uring (без liburing)
+struct IoUring {
+    int fd;
+    unsigned entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_sqe* sqes;
+    io_uring_cqe* cqes;
+    void* sq_ptr;
+    void* cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned local_tail;    // заполненные, но ещё не отправленные SQE
+
+    IoUring() : fd(-1), entries(0), sqes(nullptr), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED), local_tail(0) {}
+    ~IoUring(){
+        if(sqes) munmap(sqes, sqes_len);
+        if(cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_len);
+        if(sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_len);
+        if(fd >= 0) close(fd);
+    }
+
+    bool init(unsigned n){
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        fd = syscall(__NR_io_uring_setup, n, &p);
+        if(fd < 0) return false;
+        entries = p.sq_entries;
+        sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = (p.features & IORING_FEAT_SINGLE_MMAP);
+        if(single) sq_len = cq_len = max(sq_len, cq_len);
+        sq_ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if(sq_ptr == MAP_FAILED) return false;
+        cq_ptr = single ? sq_ptr : mmap(nullptr, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if(cq_ptr == MAP_FAILED) return false;
+        sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+        void* s = mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if(s == MAP_FAILED) return false;
+        sqes = (io_uring_sqe*)s;
+        char* sq = (char*)sq_ptr;
+        char* cq = (char*)cq_ptr;
+        sq_head = (unsigned*)(sq + p.sq_off.head);
+        sq_tail = (unsigned*)(sq + p.sq_off.tail);
+        sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq + p.sq_off.array);
+        cq_head = (unsigned*)(cq + p.cq_off.head);
+        cq_tail = (unsigned*)(cq + p.cq_off.tail);
+        cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+        local_tail = *sq_tail;
+        return true;
+    }
+
+    // nullptr — кольцо заполнено
+    io_uring_sqe* getSqe(){
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if(local_tail - head >= entries) return nullptr;
+        unsigned idx = local_tail & *sq_mask;
+        io_uring_sqe* sqe = &sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[idx] = idx;
+        local_tail++;
+        return sqe;
+    }
+
+    // Отправляем заполненные SQE и ждём wait завершений
+    int submitAndWait(unsigned wait){
+        unsigned tail = *sq_tail;
+        unsigned submit = local_tail - tail;
+        __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+        int r;
+        do{
+            r = syscall(__NR_io_uring_enter, fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        } while(r < 0 && errno == EINTR);
+        return r;
+    }
+
+    bool popCqe(io_uring_cqe& out){
+        unsigned head = *cq_head;
+        if(head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) return false;
+        out = cqes[head & *cq_mask];
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+};
+
+// Запись всего буфера по смещению (pwrite может записать не всё)
+bool pwriteAll(int fd, const char* p, size_t len, off_t off){
+    while(len > 0){
+        ssize_t w = pwrite(fd, p, len, off);
+        if(w < 0 && errno == EINTR) continue;
+        if(w <= 0) return false;
+        p += w;
+        len -= w;
+        off += w;
+    }
+    return true;
+}
+
+enum DiskOpKind { DISK_APPEND, DISK_REPLACE };
+
+struct DiskOp {
+    DiskOpKind kind;
+    string path;
+    string data;
+    string header;      // для дозаписи: пишется первым, если файл ещё пуст
+    function<void()> done;  // для перезаписи: вызывается в потоке ввода-вывода, когда новый файл на месте
+    uint64_t seq;           // номер операции в очереди
+};
+
+// Номер последней операции, поставленной этим потоком, — по нему сессия
+// ждёт, пока записи команды окажутся на диске
+thread_local uint64_t disk_ticket = 0;
+
+const unsigned DISK_RING_ENTRIES = 64;
+
+struct DiskIO {
+    mutex m;
+    condition_variable work_cv;     // есть операции
+    deque<DiskOp> queue;
+    bool started;
+    bool stopping;
+    thread worker;
+    IoUring ring;
+    bool use_ring;
+    uint64_t queued;        // номер последней поставленной операции
+    uint64_t synced;        // операции до этого номера включительно — на диске
+    condition_variable synced_cv;
+    vector<pair<uint64_t, function<void()>>> waiters;  // ждут, пока synced дойдёт до номера
+
+    DiskIO() : started(false), stopping(false), use_ring(false), queued(0), synced(0) {}
+    ~DiskIO(){
+        if(!started) return;
+        {
+            lock_guard<mutex> guard(m);
+            stopping = true;
+        }
+        work_cv.notify_one();
+        worker.join();
+    }
+
+    void append(const string& path, string data, string header = string()){
+        DiskOp op;
+        op.kind = DISK_APPEND;
+        op.path = path;
+        op.data = move(data);
+        op.header = move(header);
+        push(move(op));
+    }
+    void replace(const string& path, string data, function<void()> done = nullptr){
+        DiskOp op;
+        op.kind = DISK_REPLACE;
+        op.path = path;
+        op.data = move(data);
+        op.done = move(done);
+        push(move(op));
+    }
+
+    // Операция seq уже на диске — false; иначе fn вызовется из потока
+    // ввода-вывода, когда она там будет
+    bool whenSynced(uint64_t seq, function<void()> fn){
+        lock_guard<mutex> guard(m);
+        if(synced >= seq) return false;
+        waiters.push_back({seq, move(fn)});
+        return true;
+    }
+
+    // Ждём, пока всё поставленное окажется на диске (остановка сервера)
+    void drain(){
+        unique_lock<mutex> lock(m);
+        synced_cv.wait(lock, [&]{ return synced >= queued; });
+    }
+
+private:
+    void push(DiskOp op){
+        {
+            lock_guard<mutex> guard(m);
+            op.seq = ++queued;
+            disk_ticket = op.seq;
+            if(!started){
+                use_ring = ring.init(DISK_RING_ENTRIES);
+                cout << "Disk I/O: " << (use_ring ? "io_uring" : "pwrite thread") << endl;
+                worker = thread(&DiskIO::run, this);
+                started = true;
+            }
+            queue.push_back(move(op));
+        }
+        work_cv.notify_one();
+    }
+
+    void run(){
+        unique_lock<mutex> lock(m);
+        while(true){
+            work_cv.wait(lock, [&]{ return !queue.empty() || stopping; });
+            if(queue.empty()) return;
+            deque<DiskOp> batch;
+            batch.swap(queue);
+            lock.unlock();
+            process(batch);
+            lock.lock();
+            // Операции ставятся по порядку номеров — вся пачка до последней на диске
+            synced = batch.back().seq;
+            vector<function<void()>> ready;
+            for(size_t i = 0; i < waiters.size();){
+                if(waiters[i].first <= synced){
+                    ready.push_back(move(waiters[i].second));
+                    waiters[i] = move(waiters.back());
+                    waiters.pop_back();
+                }
+                else i++;
+            }
+            synced_cv.notify_all();
+            lock.unlock();
+            for(size_t i = 0; i < ready.size(); i++) ready[i]();
+            lock.lock();
+        }
+    }
+
+    // Дозаписи одного файла в пределах пачки
+    struct FileWrite {
+        string path;
+        int fd;
+        off_t offset;
+        string buf;
+    };
+
+    // Дозаписи копим по файлам; перезапись файла сначала сбрасывает накопленное,
+    // чтобы порядок операций над одним файлом сохранялся
+    void process(deque<DiskOp>& batch){
+        vector<FileWrite> files;
+        for(size_t i = 0; i < batch.size(); i++){
+            DiskOp& op = batch[i];
+            if(op.kind == DISK_REPLACE){
+                writeFiles(files);
+                replaceFile(op.path, op.data);
+                if(op.done) op.done();
+                continue;
+            }
+            FileWrite* fw = nullptr;
+            for(size_t k = 0; k < files.size() && !fw; k++){
+                if(files[k].path == op.path) fw = &files[k];
+            }
+            if(!fw){
+                FileWrite nf;
+                nf.path = op.path;
+                nf.fd = ::open(op.path.c_str(), O_WRONLY | O_CREAT, 0644);
+                struct stat st;
+                nf.offset = (nf.fd >= 0 && fstat(nf.fd, &st) == 0) ? st.st_size : 0;
+                if(nf.fd < 0) cerr << "Failed to open " << op.path << endl;
+                files.push_back(move(nf));
+                fw = &files.back();
+            }
+            if(fw->offset == 0 && fw->buf.empty()) fw->buf += op.header;
+            fw->buf += op.data;
+        }
+        writeFiles(files);
+    }
+
+    void writeFiles(vector<FileWrite>& files){
+        if(files.empty()) return;
+        // Кольцо вмещает пары (запись, fdatasync) для DISK_RING_ENTRIES / 2 файлов за раз
+        size_t done = 0;
+        while(use_ring && done < files.size()){
+            size_t n = min(files.size() - done, (size_t)DISK_RING_ENTRIES / 2);
+            if(!ringWrite(files, done, n)) break;
+            done += n;
+        }
+        for(size_t k = done; k < files.size(); k++){
+            FileWrite& fw = files[k];
+            if(fw.fd < 0) continue;
+            if(!pwriteAll(fw.fd, fw.buf.data(), fw.buf.size(), fw.offset) || fdatasync(fw.fd) != 0){
+                cerr << "Failed to write " << fw.path << ": " << strerror(errno) << endl;
+            }
+        }
+        for(size_t k = 0; k < files.size(); k++){
+            if(files[k].fd >= 0) close(files[k].fd);
+        }
+        files.clear();
+    }
+
+    // false — io_uring не справился (например, ядро не знает IORING_OP_WRITE);
+    // тогда эти и все следующие файлы пишутся через pwrite
+    bool ringWrite(vector<FileWrite>& files, size_t from, size_t n){
+        unsigned expected = 0;
+        for(size_t k = from; k < from + n; k++){
+            FileWrite& fw = files[k];
+            if(fw.fd < 0) continue;
+            io_uring_sqe* w = ring.getSqe();
+            io_uring_sqe* s = ring.getSqe();
+            w->opcode = IORING_OP_WRITE;
+            w->fd = fw.fd;
+            w->addr = (uint64_t)(uintptr_t)fw.buf.data();
+            w->len = fw.buf.size();
+            w->off = fw.offset;
+            w->flags = IOSQE_IO_LINK;
+            w->user_data = k * 2;
+            s->opcode = IORING_OP_FSYNC;
+            s->fd = fw.fd;
+            s->fsync_flags = IORING_FSYNC_DATASYNC;
+            s->user_data = k * 2 + 1;
+            expected += 2;
+        }
+        if(expected == 0) return true;
+        if(ring.submitAndWait(expected) < 0){
+            use_ring = false;
+            return false;
+        }
+        // Короткая или неудачная запись — дописываем хвост через pwrite
+        vector<size_t> written(files.size(), 0);
+        vector<bool> synced(files.size(), false);
+        bool unsupported = false;
+        for(unsigned got = 0; got < expected;){
+            io_uring_cqe cqe;
+            if(!ring.popCqe(cqe)){
+                if(ring.submitAndWait(1) < 0) break;
+                continue;
+            }
+            got++;
+            size_t k = cqe.user_data / 2;
+            if(cqe.user_data % 2 == 0){
+                if(cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP) unsupported = true;
+                if(cqe.res > 0) written[k] = cqe.res;
+            }
+            else if(cqe.res == 0){
+                synced[k] = true;
+            }
+        }
+        for(size_t k = from; k < from + n; k++){
+            FileWrite& fw = files[k];
+            if(fw.fd < 0 || synced[k]) continue;
+            size_t w = written[k];
+            if(!pwriteAll(fw.fd, fw.buf.data() + w, fw.buf.size() - w, fw.offset + w) || fdatasync(fw.fd) != 0){
+                cerr << "Failed to write " << fw.path << ": " << strerror(errno) << endl;
+            }
+        }
+        if(unsupported) use_ring = false;
+        return true;
+    }
+
+    void replaceFile(const string& path, string& data){
+        string tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0){
+            cerr << "Failed to rewrite " << path << endl;
+            return;
+        }
+        vector<FileWrite> one(1);
+        one[0].path = tmp;
+        one[0].fd = fd;
+        one[0].offset = 0;
+        one[0].buf.swap(data);
+        writeFiles(one);
+        if(rename(tmp.c_str(), path.c_str()) != 0){
+            cerr << "Failed to replace " << path << endl;
+        }
+    }
+};
+
+DiskIO disk_io;
+
+
+// Словарное кодирование колонок с небольшим числом различных значений:
+// каждое значение хранится один раз в словаре, строка хранит только код.
+// На диске словарь лежит в <table>/<column>.dict (значение на строку,
+// номер строки — код), а в CSV для такой колонки пишется код.
+
+const uint32_t NO_CODE = 0xFFFFFFFFu;
+
+struct ColumnDict {
+    string column;
+    string path;
+    bool persist;           // дописывать новые значения в файл словаря
+    vector<string> values;
+    unordered_map<string, uint32_t> codes;
+    ColumnDict* next;
+
+    ColumnDict(const string& col, const string& p) : column(col), path(p), persist(false), next(nullptr) {}
+
+    uint32_t lookup(const string& v) const {
+        auto it = codes.find(v);
+        return it == codes.end() ? NO_CODE : it->second;
+    }
+
+    uint32_t encode(const string& v){
+        uint32_t c = lookup(v);
+        if(c != NO_CODE) return c;
+        c = values.size();
+        values.push_back(v);
+        codes.emplace(v, c);
+        if(persist) disk_io.append(path, v + "\n");
+        return c;
+    }
+
+    void load(){
+        ifstream ifs(path.c_str());
+        string v;
+        while(getline(ifs, v)){
+            codes.emplace(v, values.size());
+            values.push_back(v);
+        }
+    }
+
+    void save(){
+        string out;
+        for(size_t i = 0; i < values.size(); i++){
+            out += values[i];
+            out += '\n';
+        }
+        disk_io.replace(path, move(out));
+    }
+};
+
+
+// Колонка таблицы. В schema.json задаётся строкой "имя" или "имя:тип",
+// тип — string (по умолчанию), int64, double или char(N)
+
+enum ColType { COL_STRING, COL_INT64, COL_DOUBLE, COL_CHAR };
+
+struct ColumnDef {
+    string name;
+    ColType type;
+    size_t width;       // N для char(N)
+    size_t offset;      // смещение ячейки в строке
+    ColumnDict* dict;   // словарная колонка: в ячейке хранится код
+
+    ColumnDef() : type(COL_STRING), width(0), offset(0), dict(nullptr) {}
+};
+
+string columnTypeName(const ColumnDef& c){
+    switch(c.type){
+        case COL_INT64:  return "int64";
+        case COL_DOUBLE: return "double";
+        case COL_CHAR:   return "char(" + to_string(c.width) + ")";
+        default:         return "string";
+    }
+}
+
+bool parseColumnDef(const string& spec, ColumnDef& col, string& err){
+    size_t colon = spec.find(':');
+    col.name = spec.substr(0, colon);
+    string type = (colon == string::npos) ? "string" : spec.substr(colon + 1);
+    if(col.name.empty()){
+        err = "Empty column name in \"" + spec + "\"";
+        return false;
+    }
+    if(type == "string") col.type = COL_STRING;
+    else if(type == "int64") col.type = COL_INT64;
+    else if(type == "double") col.type = COL_DOUBLE;
+    else if(type.size() > 6 && type.compare(0, 5, "char(") == 0 && type.back() == ')'){
+        col.type = COL_CHAR;
+        col.width = strtoul(type.c_str() + 5, nullptr, 10);
+        if(col.width == 0){
+            err = "Bad width in " + spec;
+            return false;
+        }
+    }
+    else{
+        err = "Unknown type " + type + " of column " + col.name;
+        return false;
+    }
+    return true;
+}
+
+// Значение в каноническом виде для типа колонки; false — не подходит по типу
+bool canonicalCell(const ColumnDef& c, const string& in, string& out, string& err){
+    switch(c.type){
+        case COL_INT64: {
+            char* end = nullptr;
+            errno = 0;
+            long long v = strtoll(in.c_str(), &end, 10);
+            if(in.empty() || errno != 0 || *end != '\0') break;
+            out = to_string(v);
+            return true;
+        }
+        case COL_DOUBLE: {
+            double v;
+            if(!parseNumber(in, v)) break;
+            out = formatDouble(v);
+            return true;
+        }
+        case COL_CHAR:
+            if(in.size() > c.width || in.find('\0') != string::npos) break;
+            out = in;
+            return true;
+        default:
+            out = in;
+            return true;
+    }
+    err = "Column " + c.name + " expects " + columnTypeName(c) + ", got \"" + in + "\"";
+    return false;
+}
+
+// Размер ячейки: словарная — 4 байта кода, char(N) — N байт,
+// остальные — 8 байт (число либо смещение и длина строки в хвосте)
+size_t cellSize(const ColumnDef& c){
+    if(c.dict) return sizeof(uint32_t);
+    if(c.type == COL_CHAR) return c.width;
+    return 8;
+}
+
+
+// Узел, описывающий одну таблицу
+
+struct MatView;
+
+struct Node {
+    string name;            // имя таблицы
+    TableDataNode* data;    // список строк
+    Node* next;             // следующий узел (таблица)
+
+    OrderedIndex* indexes;  // упорядоченные индексы по колонкам
+    BloomFilter* blooms;    // фильтры Блума по колонкам
+    RowBlock* blocks;       // блоки строк с зон-картами (первый — самые новые строки)
+    ColumnDict* dicts;      // словари (владение; ячейки ссылаются через ColumnDef::dict)
+    MatView* views;         // материализованные представления над таблицей
+    size_t row_count;
+    bool columnar;          // на диске — колоночный формат (data.col) вместо CSV
+    string damaged_blocks;  // блоки data.col с неверной контрольной суммой — байты как есть, при перезаписи сохраняются
+    bool damaged_layout;    // такие блоки записаны под другой набор колонок: файл не переписываем
+    bool mapped;            // на диске — rows.bin, строки читаются прямо из отображения
+    MappedFile* map;
+    uint64_t rewrites;      // номер последней перезаписи rows.bin: отображение берём только от неё
+    atomic<bool> loaded;    // данные прочитаны с диска
+    mutex load_mutex;       // первое обращение из нескольких потоков — одна загрузка
+    shared_mutex rw;        // чтение строк — разделяемая блокировка, изменение — исключительная
+    atomic<uint64_t> version; // растёт при каждом изменении данных (кэш результатов)
+    vector<ColumnDef> cols; // колонки из схемы
+    size_t fixed_size;      // маска NULL + ячейки фиксированной длины
+    string shard_key;       // колонка, по хешу которой маршрутизатор раскладывает строки по шардам
+
+    Node(const string& n) : name(n), data(nullptr), next(nullptr), indexes(nullptr), blooms(nullptr), blocks(nullptr),
+                            dicts(nullptr), views(nullptr), row_count(0), columnar(false), damaged_layout(false), mapped(false), map(nullptr), rewrites(0), loaded(false),
+                            version(0), fixed_size(0) {}
+
+    int findColumn(const string& column) const {
+        for(size_t i = 0; i < cols.size(); i++){
+            if(cols[i].name == column) return i;
+        }
+        return -1;
+    }
+
+    // Смещения ячеек; вызывается после загрузки схемы, до первой строки
+    void layout(){
+        fixed_size = (cols.size() + 7) / 8;
+        for(size_t i = 0; i < cols.size(); i++){
+            cols[i].offset = fixed_size;
+            fixed_size += cellSize(cols[i]);
+        }
+    }
+
+    OrderedIndex* findIndex(const string& column){
+        for(OrderedIndex* ix = indexes; ix; ix = ix->next){
+            if(ix->column == column) return ix;
+        }
+        return nullptr;
+    }
+
+    BloomFilter* findBloom(const string& column){
+        for(BloomFilter* bf = blooms; bf; bf = bf->next){
+            if(bf->column == column) return bf;
+        }
+        return nullptr;
+    }
+
+    // Номер словарной колонки или -1
+    int findDict(const string& column) const {
+        int i = findColumn(column);
+        return (i >= 0 && cols[i].dict) ? i : -1;
+    }
+};
+
+// Разделяемые блокировки нескольких таблиц запроса. Берутся в порядке
+// адресов, каждая таблица один раз (FROM t t), — так два запроса над одними
+// таблицами не ждут друг друга по кругу
+struct TableReadLock {
+    vector<Node*> held;
+
+    TableReadLock() {}
+    TableReadLock(const vector<Node*>& tables){ lock(tables); }
+    ~TableReadLock(){ unlock(); }
+
+    void lock(vector<Node*> tables){
+        unlock();
+        sort(tables.begin(), tables.end());
+        tables.erase(unique(tables.begin(), tables.end()), tables.end());
+        for(Node* t : tables) t->rw.lock_shared();
+        held.swap(tables);
+    }
+    void unlock(){
+        for(Node* t : held) t->rw.unlock_shared();
+        held.clear();
+    }
+};
+
+
+// Упаковка строки в собственный формат: cells[i] — значение i-й колонки
+// таблицы, nullptr — NULL. nullptr и текст ошибки, если значение не подходит по типу
+
+char* encodeCells(Node* tbl, const vector<const string*>& cells, string& err){
+    size_t n = tbl->cols.size();
+    vector<string> vals(n);
+    vector<bool> present(n, false);
+    size_t tail = 0;
+    for(size_t i = 0; i < n; i++){
+        const ColumnDef& c = tbl->cols[i];
+        if(!cells[i]) continue;
+        if(!canonicalCell(c, *cells[i], vals[i], err)) return nullptr;
+        present[i] = true;
+        if(!c.dict && c.type == COL_STRING) tail += vals[i].size();
+    }
+    char* buf = new char[tbl->fixed_size + tail];
+    memset(buf, 0, tbl->fixed_size);
+    size_t pos = tbl->fixed_size;
+    for(size_t i = 0; i < n; i++){
+        const ColumnDef& c = tbl->cols[i];
+        char* cell = buf + c.offset;
+        if(!present[i]){
+            buf[i / 8] |= (char)(1 << (i % 8));
+            continue;
+        }
+        if(c.dict){
+            uint32_t code = c.dict->encode(vals[i]);
+            memcpy(cell, &code, sizeof(code));
+            continue;
+        }
+        switch(c.type){
+            case COL_INT64: {
+                int64_t v = strtoll(vals[i].c_str(), nullptr, 10);
+                memcpy(cell, &v, sizeof(v));
+                break;
+            }
+            case COL_DOUBLE: {
+                double v = strtod(vals[i].c_str(), nullptr);
+                memcpy(cell, &v, sizeof(v));
+                break;
+            }
+            case COL_CHAR:
+                memcpy(cell, vals[i].data(), vals[i].size());
+                break;
+            default: {
+                uint32_t ref[2] = {(uint32_t)pos, (uint32_t)vals[i].size()};
+                memcpy(cell, ref, sizeof(ref));
+                memcpy(buf + pos, vals[i].data(), vals[i].size());
+                pos += vals[i].size();
+            }
+        }
+    }
+    return buf;
+}
+
+// То же для строки-объекта; колонок, которых нет в схеме, не храним
+char* encodeRow(Node* tbl, const json& entry, string& err){
+    vector<const string*> cells(tbl->cols.size(), nullptr);
+    for(size_t i = 0; i < cells.size(); i++){
+        auto it = entry.find(tbl->cols[i].name);
+        if(it != entry.end()) cells[i] = &it->get_ref<const string&>();
+    }
+    return encodeCells(tbl, cells, err);
+}
+
+bool rowIsNull(const TableDataNode* p, size_t c){
+    return (p->buf[c / 8] >> (c % 8)) & 1;
+}
+
+// Код словарной колонки c (NO_CODE для NULL)
+uint32_t rowCode(const Node* tbl, const TableDataNode* p, size_t c){
+    if(rowIsNull(p, c)) return NO_CODE;
+    uint32_t code;
+    memcpy(&code, p->buf + tbl->cols[c].offset, sizeof(code));
+    return code;
+}
+
+// Текст ячейки c; false — NULL
+bool cellText(const Node* tbl, const TableDataNode* p, size_t c, string& out){
+    if(rowIsNull(p, c)) return false;
+    const ColumnDef& col = tbl->cols[c];
+    const char* cell = p->buf + col.offset;
+    if(col.dict){
+        out = col.dict->values[rowCode(tbl, p, c)];
+        return true;
+    }
+    switch(col.type){
+        case COL_INT64: {
+            int64_t v;
+            memcpy(&v, cell, sizeof(v));
+            out = to_string(v);
+            break;
+        }
+        case COL_DOUBLE: {
+            double v;
+            memcpy(&v, cell, sizeof(v));
+            out = formatDouble(v);
+            break;
+        }
+        case COL_CHAR:
+            out.assign(cell, strnlen(cell, col.width));
+            break;
+        default: {
+            uint32_t ref[2];
+            memcpy(ref, cell, sizeof(ref));
+            out.assign(p->buf + ref[0], ref[1]);
+        }
+    }
+    return true;
+}
+
+// Строка таблицы в виде JSON (все значения — строки, NULL-колонок нет)
+
+json decodeRow(const Node* tbl, const TableDataNode* p){
+    json e = json::object();
+    string v;
+    for(size_t c = 0; c < tbl->cols.size(); c++){
+        if(cellText(tbl, p, c, v)) e[tbl->cols[c].name] = v;
+    }
+    return e;
+}
+
+
+// Кэш результатов SELECT. Ключ — запрос с нормализованными пробелами;
+// запись помнит версии таблиц, из которых собран результат, и годна,
+// пока ни одна из них не изменилась. Вытеснение — LRU в пределах бюджета байт
+
+const size_t CACHE_DEFAULT_BYTES = 64 * 1024 * 1024;
+
+struct CacheEntry {
+    string key;
+    string result;
+    vector<pair<Node*, uint64_t>> deps;   // таблица и её версия на момент запроса
+    CacheEntry* prev;                     // список LRU: в начале — недавно использованные
+    CacheEntry* next;
+
+    CacheEntry() : prev(nullptr), next(nullptr) {}
+
+    size_t bytes() const {
+        return sizeof(CacheEntry) + key.size() * 2 + result.size() + deps.size() * sizeof(deps[0]);
+    }
+    bool fresh() const {
+        for(const auto& d : deps){
+            if(d.first->version.load(memory_order_acquire) != d.second) return false;
+        }
+        return true;
+    }
+};
+
+struct QueryCache {
+    mutex m;
+    unordered_map<string, CacheEntry*> entries;
+    CacheEntry* head;
+    CacheEntry* tail;
+    size_t used;
+    size_t budget;          // 0 — кэш выключен
+    uint64_t hits, misses;
+
+    QueryCache() : head(nullptr), tail(nullptr), used(0), budget(CACHE_DEFAULT_BYTES), hits(0), misses(0) {}
+    ~QueryCache() {
+        while(head){
+            CacheEntry* e = head;
+            head = head->next;
+            delete e;
+        }
+    }
+
+    // Пробелы схлопываем, края обрезаем: "SELECT  a FROM t" и "SELECT a FROM t" — один ключ
+    static string normalize(const string& query){
+        string key;
+        bool space = false;
+        for(char ch : query){
+            if(ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n'){
+                space = !key.empty();
+                continue;
+            }
+            if(space) key += ' ';
+            space = false;
+            key += ch;
+        }
+        return key;
+    }
+
+    bool get(const string& key, string& result){
+        lock_guard<mutex> guard(m);
+        if(budget == 0) return false;
+        auto it = entries.find(key);
+        if(it == entries.end()){
+            misses++;
+            return false;
+        }
+        CacheEntry* e = it->second;
+        // Таблица изменилась после того, как результат был собран
+        if(!e->fresh()){
+            drop(e);
+            misses++;
+            return false;
+        }
+        unlink(e);
+        pushFront(e);
+        result = e->result;
+        hits++;
+        return true;
+    }
+
+    // Версии deps снимаются до выполнения запроса: запись, пришедшая во время
+    // выполнения, сделает результат устаревшим, а не закрепит его
+    void put(const string& key, const string& result, const vector<pair<Node*, uint64_t>>& deps){
+        lock_guard<mutex> guard(m);
+        if(budget == 0) return;
+        CacheEntry* e = new CacheEntry;
+        e->key = key;
+        e->result = result;
+        e->deps = deps;
+        if(e->bytes() > budget || !e->fresh()){
+            delete e;
+            return;
+        }
+        auto it = entries.find(key);
+        if(it != entries.end()) drop(it->second);
+        while(tail && used + e->bytes() > budget) drop(tail);
+        entries[key] = e;
+        pushFront(e);
+        used += e->bytes();
+    }
+
+private:
+    void unlink(CacheEntry* e){
+        if(e->prev) e->prev->next = e->next; else head = e->next;
+        if(e->next) e->next->prev = e->prev; else tail = e->prev;
+        e->prev = e->next = nullptr;
+    }
+    void pushFront(CacheEntry* e){
+        e->next = head;
+        if(head) head->prev = e; else tail = e;
+        head = e;
+    }
+    void drop(CacheEntry* e){
+        unlink(e);
+        entries.erase(e->key);
+        used -= e->bytes();
+        delete e;
+    }
+};
+
+
+// Ограничения сервера (раздел "limits" в schema.json)
+
+// Сколько байт строк ORDER BY держим в памяти, прежде чем сбросить прогон на диск
+const size_t SORT_MEMORY_BUDGET = 64 * 1024 * 1024;
+
+struct ServerLimits {
+    int max_connections;    // сверх этого новое соединение сразу закрывается
+    int backlog;            // очередь listen()
+    int max_running;        // потоков пула команд (по умолчанию — по числу ядер)
+    int max_queue;          // команд, ждущих своей очереди; остальные получают отказ
+    long queue_wait_ms;     // сколько команда может ждать в очереди
+    long query_timeout_ms;  // 0 — без ограничения
+    long max_rows_scanned;  // 0 — без ограничения
+    long idle_timeout_ms;   // молчащее столько соединение закрывается; 0 — никогда
+    int io_threads;         // потоков-реакторов, обслуживающих сокеты
+    size_t sort_memory;     // память сортировки одного запроса
+
+    ServerLimits() : max_connections(256), backlog(SOMAXCONN), max_running(max(1u, thread::hardware_concurrency())),
+                     max_queue(256), queue_wait_ms(1000), query_timeout_ms(10000), max_rows_scanned(0),
+                     idle_timeout_ms(300000), io_threads(min(4u, max(1u, thread::hardware_concurrency()))),
+                     sort_memory(SORT_MEMORY_BUDGET) {}
+};
+
+// Пул выполнения команд с перехватом работы (work stealing), поток на ядро.
+// Команды от сетевых потоков попадают в общую очередь: ждать в ней могут не
+// больше max_queue, а прождавшие дольше queue_wait_ms получают отказ сразу,
+// не копя задержку у всех остальных. Команда может дробить свою работу на
+// задачи (TaskGroup): они кладутся в очередь своего потока, а свободные потоки
+// забирают их с другого конца. Задачи мелкие, поэтому между ними рабочий поток
+// успевает взять новую команду и тяжёлый запрос не задерживает дешёвые
+struct PoolJob {
+    function<void()> run;
+    function<void(bool)> done;      // false — команда отброшена, не выполнялась
+    chrono::steady_clock::time_point queued;
+};
+
+struct QueryPool {
+    struct Worker {
+        mutex m;
+        deque<function<void()>> tasks;  // свои задачи берём с конца, чужие — с начала
+    };
+
+    mutex m;
+    condition_variable cv;
+    deque<PoolJob> jobs;
+    vector<Worker*> local;
+    vector<thread> workers;
+    atomic<long> spawned;               // задач в локальных очередях
+    const ServerLimits* limits;
+    long shed;
+
+    static thread_local int self;       // номер рабочего потока; -1 — чужой поток
+
+    QueryPool() : spawned(0), limits(nullptr), shed(0) {}
+
+    void start(const ServerLimits& lim){
+        limits = &lim;
+        for(int i = 0; i < lim.max_running; i++) local.push_back(new Worker());
+        for(int i = 0; i < lim.max_running; i++) workers.emplace_back(&QueryPool::work, this, i);
+    }
+
+    size_t size() const { return local.size(); }
+
+    // Команда от сетевого потока; false — очередь полна
+    bool submit(PoolJob job){
+        {
+            lock_guard<mutex> guard(m);
+            if((int)jobs.size() >= limits->max_queue){
+                shed++;
+                return false;
+            }
+            job.queued = chrono::steady_clock::now();
+            jobs.push_back(move(job));
+        }
+        cv.notify_one();
+        return true;
+    }
+
+    // Задача внутри команды. Вне рабочих потоков выполняется сразу
+    void spawn(function<void()> fn){
+        if(self < 0 || local.empty()){
+            fn();
+            return;
+        }
+        {
+            lock_guard<mutex> guard(local[self]->m);
+            local[self]->tasks.push_back(move(fn));
+        }
+        spawned++;
+        // Пустая секция под m: спящий поток либо уже увидит spawned, либо получит notify
+        { lock_guard<mutex> guard(m); }
+        cv.notify_one();
+    }
+
+    // Выполнить одну задачу: свою, новую команду (take_jobs), чужую.
+    // false — делать нечего
+    bool runOne(bool take_jobs){
+        function<void()> fn;
+        if(self >= 0 && popLocal(self, fn, true)){
+            fn();
+            return true;
+        }
+        if(take_jobs){
+            PoolJob job;
+            bool got = false;
+            {
+                lock_guard<mutex> guard(m);
+                if(!jobs.empty()){
+                    job = move(jobs.front());
+                    jobs.pop_front();
+                    got = true;
+                }
+            }
+            if(got){
+                runJob(job);
+                return true;
+            }
+        }
+        for(size_t k = 1; k <= local.size(); k++){
+            int victim = (max(self, 0) + k) % local.size();
+            if(victim != self && popLocal(victim, fn, false)){
+                fn();
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    bool popLocal(int i, function<void()>& fn, bool back){
+        Worker* w = local[i];
+        lock_guard<mutex> guard(w->m);
+        if(w->tasks.empty()) return false;
+        if(back){
+            fn = move(w->tasks.back());
+            w->tasks.pop_back();
+        }
+        else{
+            fn = move(w->tasks.front());
+            w->tasks.pop_front();
+        }
+        spawned--;
+        return true;
+    }
+
+    void runJob(PoolJob& job){
+        if(chrono::steady_clock::now() - job.queued > chrono::milliseconds(limits->queue_wait_ms)){
+            {
+                lock_guard<mutex> guard(m);
+                shed++;
+            }
+            job.done(false);
+            return;
+        }
+        job.run();
+        job.done(true);
+    }
+
+    void work(int i){
+        self = i;
+        while(true){
+            if(runOne(true)) continue;
+            unique_lock<mutex> lock(m);
+            cv.wait(lock, [&]{ return !jobs.empty() || spawned.load() > 0; });
+        }
+    }
+};
+
+thread_local int QueryPool::self = -1;
+
+// Группа задач одной команды: spawn раздаёт, wait ждёт всех. Пока в
+// очередях есть задачи, ждущий поток выполняет их сам (свои и чужие); когда
+// их нет, оставшиеся задачи группы уже выполняются — спим до последней
+struct TaskGroup {
+    QueryPool& pool;
+    mutex m;
+    condition_variable cv;
+    int left;
+
+    TaskGroup(QueryPool& p) : pool(p), left(0) {}
+
+    void spawn(function<void()> fn){
+        {
+            lock_guard<mutex> guard(m);
+            left++;
+        }
+        pool.spawn([this, fn]{
+            fn();
+            // Под m: после уведомления группу можно уничтожать
+            lock_guard<mutex> guard(m);
+            if(--left == 0) cv.notify_all();
+        });
+    }
+    void wait(){
+        while(true){
+            {
+                lock_guard<mutex> guard(m);
+                if(left == 0) return;
+            }
+            if(!pool.runOne(false)) break;
+        }
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [&]{ return left == 0; });
+    }
+};
+
+
+// Журнал репликации: каждое изменение данных — строка-команда со своим
+// номером. Реплики читают его потоком; в памяти держим последние
+// REPL_LOG_KEEP записей, отставшая сильнее реплика получает снимок заново
+
+const size_t REPL_LOG_KEEP = 100000;
+
+struct ReplicationLog {
+    mutex m;                    // изменения данных применяются и пишутся в журнал под ним
+    condition_variable cv;
+    uint64_t epoch;             // номер запуска: после перезапуска старые номера записей не годятся
+    uint64_t base;              // номер первой записи в records
+    deque<string> records;
+
+    ReplicationLog() : base(1) {
+        epoch = (uint64_t)chrono::system_clock::now().time_since_epoch().count() ^ ((uint64_t)getpid() << 32);
+    }
+
+    // Номер следующей записи
+    uint64_t next() const { return base + records.size(); }
+
+    void append(string rec){
+        records.push_back(move(rec));
+        if(records.size() > REPL_LOG_KEEP){
+            records.pop_front();
+            base++;
+        }
+        cv.notify_all();
+    }
+};
+
+
+// Структура базы данных
+
+void freeViews(Node* tbl);
+struct ShardRouter;
+
+struct dbase {
+    string schema_name;
+    string schema_file;
+    json schema;                // содержимое schema_file: в "views" дописываются представления, созданные командой
+    Node* head;
+    QueryCache cache;
+    ServerLimits limits;
+    QueryPool pool;
+    atomic<int> connections;
+    ReplicationLog repl;
+    bool persist;               // false — реплика: данные только в памяти, файлы таблиц не трогаем
+    bool read_only;             // реплика принимает только чтение
+    ShardRouter* router;        // маршрутизатор кластера: данные на шардах, здесь только схема
+
+    dbase() : head(nullptr), connections(0), persist(true), read_only(false), router(nullptr), loader(nullptr) {}
+    ~dbase() {
+        // Удаляем список таблиц
+        while(head){
+            Node* tmp= head;
+            head= head->next;
+            // Удаляем список data
+            TableDataNode* d= tmp->data;
+            while(d){
+                TableDataNode* dn= d->next;
+                delete d;
+                d= dn;
+            }
+            delete tmp->map;
+            while(tmp->indexes){
+                OrderedIndex* ix= tmp->indexes;
+                tmp->indexes= ix->next;
+                delete ix;
+            }
+            while(tmp->blooms){
+                BloomFilter* bf= tmp->blooms;
+                tmp->blooms= bf->next;
+                delete bf;
+            }
+            while(tmp->blocks){
+                RowBlock* b= tmp->blocks;
+                tmp->blocks= b->next;
+                delete b;
+            }
+            freeViews(tmp);
+            while(tmp->dicts){
+                ColumnDict* dc= tmp->dicts;
+                tmp->dicts= dc->next;
+                delete dc;
+            }
+            delete tmp;
+        }
+    }
+
+    // Загрузчик данных таблицы; пока не задан (разбор схемы), таблицы не читаются
+    void (*loader)(dbase&, Node*);
+
+    // Поиск таблицы; при первом обращении к ней читаем её данные
+    Node* findNode(const string& table_name){
+        Node* cur= head;
+        while(cur){
+            if(cur->name == table_name){
+                ensureLoaded(cur);
+                return cur;
+            }
+            cur= cur->next;
+        }
+        return nullptr;
+    }
+
+    // Загрузка ровно один раз: одновременные первые обращения ждут её окончания
+    void ensureLoaded(Node* tbl){
+        if(!loader || tbl->loaded.load(memory_order_acquire)) return;
+        lock_guard<mutex> guard(tbl->load_mutex);
+        if(tbl->loaded.load(memory_order_relaxed)) return;
+        loader(*this, tbl);
+        tbl->loaded.store(true, memory_order_release);
+    }
+
+    // Добавить таблицу (в начало списка)
+    void addNode(const string& table_name){
+        Node* nd= new Node(table_name);
+        nd->next= head;
+        head= nd;
+    }
+};
+
+
+// Добавление строки JSON в таблицу
+
+// Значение колонки строки как ключ индекса
+string indexKey(const json& e, const string& column){
+    if(!e.contains(column)) return "NULL";
+    return e[column].get<string>();
+}
+
+// Поддержка индексов таблицы при вставке/удалении строки
+void indexInsertRow(Node* tbl, TableDataNode* row, const json& e){
+    for(OrderedIndex* ix = tbl->indexes; ix; ix = ix->next){
+        ix->insert(indexKey(e, ix->column), row);
+    }
+}
+
+void indexEraseRow(Node* tbl, TableDataNode* row, const json& e){
+    for(OrderedIndex* ix = tbl->indexes; ix; ix = ix->next){
+        ix->erase(indexKey(e, ix->column), row);
+    }
+}
+
+// Пересобираем фильтры Блума таблицы по текущим строкам
+void rebuildBlooms(Node* tbl){
+    for(BloomFilter* bf = tbl->blooms; bf; bf = bf->next) bf->reset(tbl->row_count * 2);
+    if(!tbl->blooms) return;
+    for(TableDataNode* p = tbl->data; p; p = p->next){
+        json e = decodeRow(tbl, p);
+        for(BloomFilter* bf = tbl->blooms; bf; bf = bf->next){
+            if(e.contains(bf->column)) bf->add(e[bf->column].get<string>());
+        }
+    }
+}
+
+void bloomAddRow(Node* tbl, const json& e){
+    bool overfull = false;
+    for(BloomFilter* bf = tbl->blooms; bf; bf = bf->next){
+        if(e.contains(bf->column)) bf->add(e[bf->column].get<string>());
+        if(bf->overfull()) overfull = true;
+    }
+    // Таблица выросла — удваиваем фильтры (амортизированно O(1) на вставку)
+    if(overfull) rebuildBlooms(tbl);
+}
+
+// false — в таблице точно нет строки с column = value. В фильтре значения
+// в канонической записи ("7", а не "007"); значение не того типа не отсекаем
+bool bloomMayContain(Node* tbl, const string& column, const string& value){
+    BloomFilter* bf = tbl->findBloom(column);
+    if(!bf) return true;
+    int c = tbl->findColumn(column);
+    if(c < 0) return bf->mayContain(value);
+    string canon, err;
+    return !canonicalCell(tbl->cols[c], value, canon, err) || bf->mayContain(canon);
+}
+
+// Подключаем готовую строку: список, блоки с зон-картами, индексы и фильтры Блума
+void linkRow(Node* table_node, TableDataNode* nd){
+    // Дальше — значения в том виде, в каком они хранятся
+    json stored = decodeRow(table_node, nd);
+    nd->next= table_node->data;
+    table_node->data= nd;
+    table_node->row_count++;
+
+    // Строка попадает в первый блок, пока он не заполнен
+    RowBlock* blk = table_node->blocks;
+    if(!blk || blk->rows >= ZONE_BLOCK_ROWS){
+        blk = new RowBlock();
+        blk->last = nd;
+        blk->next = table_node->blocks;
+        table_node->blocks = blk;
+    }
+    blk->first = nd;
+    blk->rows++;
+    blk->widen(stored);
+
+    indexInsertRow(table_node, nd, stored);
+    bloomAddRow(table_node, stored);
+}
+
+bool addDataToTable(Node* table_node, const json& entry, string& err){
+    if(!table_node) return false;
+    char* buf = encodeRow(table_node, entry, err);
+    if(!buf) return false;
+    linkRow(table_node, new TableDataNode(buf));
+    return true;
+}
+
+// Фильтр Блума по колонке (заполняется по уже загруженным строкам)
+bool createBloom(dbase& db, const string& table, const string& column, string& err){
+    Node* tbl = db.findNode(table);
+    if(!tbl){
+        err = "Table not found: " + table;
+        return false;
+    }
+    lock_guard<shared_mutex> guard(tbl->rw);
+    if(tbl->findBloom(column)){
+        err = "Bloom filter on " + table + "." + column + " already exists";
+        return false;
+    }
+    BloomFilter* bf = new BloomFilter(column);
+    bf->next = tbl->blooms;
+    tbl->blooms = bf;
+    rebuildBlooms(tbl);
+    return true;
+}
+
+// Создание индекса по колонке (строится по уже загруженным строкам)
+bool createIndex(dbase& db, const string& table, const string& column, string& err){
+    Node* tbl = db.findNode(table);
+    if(!tbl){
+        err = "Table not found: " + table;
+        return false;
+    }
+    lock_guard<shared_mutex> guard(tbl->rw);
+    if(tbl->findIndex(column)){
+        err = "Index on " + table + "." + column + " already exists";
+        return false;
+    }
+    OrderedIndex* ix = new OrderedIndex(column);
+    for(TableDataNode* p = tbl->data; p; p = p->next){
+        ix->insert(indexKey(decodeRow(tbl, p), column), p);
+    }
+    ix->next = tbl->indexes;
+    tbl->indexes = ix;
+    return true;
+}
+
+
+// Структура и список условий WHERE
+
+struct Condition {
+    string column;
+    string op;      // =, !=, <, >, <=, >=
+    string value;
+};
+
+const int MAX_COND = 100;
+struct ConditionList {
+    Condition conds[MAX_COND];
+    int count;
+    ConditionList() : count(0) {}
+};
+
+
+// Условия WHERE над упакованными строками. Значение условия приводится к
+// типу колонки один раз (canonicalCell), дальше ячейка сравнивается прямо
+// в буфере строки: числа — как числа, словарные колонки — по коду.
+// Порядок тот же, что у compareValues: числа раньше текста
+
+enum CondOp { OP_EQ, OP_NE, OP_LT, OP_GT, OP_LE, OP_GE };
+
+struct CellCondition {
+    int side;           // CROSS JOIN: 0 — ячейка из левой строки, 1 — из правой
+    const Node* tbl;
+    int col;            // -1 — колонки нет: условие не выполняется
+    CondOp op;
+    bool typed;         // значение подошло по типу колонки: int64 в iv, double в dv
+    int64_t iv;
+    double dv;
+    bool num;           // значение — число (dv), для сравнения с текстом
+    string text;        // значение в канонической записи
+    uint32_t code;      // словарная колонка: код значения (NO_CODE — такого нет)
+
+    CellCondition() : side(0), tbl(nullptr), col(-1), op(OP_EQ), typed(false), iv(0), dv(0), num(false), code(NO_CODE) {}
+
+    void bind(const Node* t, int side_, const Condition& c){
+        side = side_;
+        tbl = t;
+        col = t ? t->findColumn(c.column) : -1;
+        op = c.op == "=" ? OP_EQ : c.op == "!=" ? OP_NE : c.op == "<" ? OP_LT :
+             c.op == ">" ? OP_GT : c.op == "<=" ? OP_LE : OP_GE;
+        text = c.value;
+        num = parseNumber(c.value, dv);
+        if(col < 0) return;
+        const ColumnDef& cd = tbl->cols[col];
+        string canon, err;
+        typed = canonicalCell(cd, c.value, canon, err);
+        if(!typed) return;
+        text = canon;
+        if(cd.type == COL_INT64) iv = strtoll(canon.c_str(), nullptr, 10);
+        if(cd.dict) code = cd.dict->lookup(canon);
+    }
+
+    // Текст против значения — как compareValues
+    int compareText(const string& v) const {
+        double d;
+        bool n = parseNumber(v, d);
+        if(n && num) return d < dv ? -1 : (d > dv ? 1 : 0);
+        if(n != num) return n ? -1 : 1;
+        int c = v.compare(text);
+        return c < 0 ? -1 : (c > 0 ? 1 : 0);
+    }
+
+    bool test(const TableDataNode* p) const {
+        if(col < 0 || rowIsNull(p, col)) return false;
+        const ColumnDef& cd = tbl->cols[col];
+        const char* cell = p->buf + cd.offset;
+        int cmp;
+        if(cd.dict){
+            uint32_t rc;
+            memcpy(&rc, cell, sizeof(rc));
+            if(op == OP_EQ) return rc == code;
+            if(op == OP_NE) return rc != code;
+            cmp = compareText(cd.dict->values[rc]);
+        }
+        else if(cd.type == COL_INT64){
+            int64_t v;
+            memcpy(&v, cell, sizeof(v));
+            if(typed) cmp = v < iv ? -1 : (v > iv ? 1 : 0);
+            else if(num) cmp = (double)v < dv ? -1 : ((double)v > dv ? 1 : 0);
+            else cmp = -1;
+        }
+        else if(cd.type == COL_DOUBLE){
+            double v;
+            memcpy(&v, cell, sizeof(v));
+            cmp = !num ? -1 : (v < dv ? -1 : (v > dv ? 1 : 0));
+        }
+        else{
+            string v;
+            cellText(tbl, p, col, v);
+            if(op == OP_EQ) return v == text;
+            if(op == OP_NE) return v != text;
+            cmp = compareText(v);
+        }
+        switch(op){
+            case OP_EQ: return cmp == 0;
+            case OP_NE: return cmp != 0;
+            case OP_LT: return cmp < 0;
+            case OP_GT: return cmp > 0;
+            case OP_LE: return cmp <= 0;
+            default:    return cmp >= 0;
+        }
+    }
+};
+
+struct RowFilter {
+    vector<CellCondition> conds;
+    bool is_or;
+
+    RowFilter() : is_or(false) {}
+
+    // Все условия — к колонкам одной таблицы
+    RowFilter(const Node* tbl, const ConditionList& cl, const string& logical_op) : is_or(logical_op == "OR") {
+        conds.resize(cl.count);
+        for(int i = 0; i < cl.count; i++) conds[i].bind(tbl, 0, cl.conds[i]);
+    }
+
+    // Проход pass CROSS JOIN: колонка columns[c] берётся из таблицы (c % 2) ^ pass,
+    // при повторах — последняя; колонки, которой нет в выводе, нет и в строке
+    RowFilter(const Node* t1, const Node* t2, const ConditionList& cl, const string& logical_op,
+              const string* columns, int col_count, int pass) : is_or(logical_op == "OR") {
+        conds.resize(cl.count);
+        for(int i = 0; i < cl.count; i++){
+            int last = -1;
+            for(int c = 0; c < col_count; c++){
+                if(columns[c] == cl.conds[i].column) last = c;
+            }
+            int side = ((last % 2) ^ pass) & 1;
+            conds[i].bind(last < 0 ? nullptr : side ? t2 : t1, side, cl.conds[i]);
+        }
+    }
+
+    bool matches(const TableDataNode* p, const TableDataNode* p2 = nullptr) const {
+        if(conds.empty()) return true;
+        for(const CellCondition& c : conds){
+            bool ok = c.test(c.side ? p2 : p);
+            if(is_or && ok) return true;
+            if(!is_or && !ok) return false;
+        }
+        return !is_or;
+    }
+};
+
+
+// Бюджет одного запроса: сколько строк он может прочитать и сколько идти.
+// Часы смотрим раз в 1024 строки — на каждой строке это заметно дороже
+
+struct QueryBudget {
+    long max_rows;          // 0 — без ограничения
+    long rows;
+    bool has_deadline;
+    chrono::steady_clock::time_point deadline;
+    const char* exceeded;   // причина остановки или nullptr
+    size_t sort_memory;     // сколько байт ORDER BY держит в памяти
+
+    QueryBudget(long rows_limit, long timeout_ms, size_t sort_bytes = SORT_MEMORY_BUDGET)
+        : max_rows(rows_limit), rows(0), has_deadline(timeout_ms > 0), exceeded(nullptr), sort_memory(sort_bytes) {
+        if(has_deadline) deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+    }
+
+    bool charge(){
+        if(exceeded) return false;
+        rows++;
+        if(max_rows > 0 && rows > max_rows) exceeded = "row budget exceeded";
+        else if(has_deadline && (rows & 1023) == 0 && chrono::steady_clock::now() > deadline) exceeded = "timeout";
+        return !exceeded;
+    }
+};
+
+
+// LIMIT/OFFSET: сколько строк пропустить и сколько выдать
+
+struct RowLimit {
+    long limit;     // -1 — без ограничения
+    long offset;
+    long seen;      // сколько подходящих строк уже встретилось
+    QueryBudget* budget;
+    RowLimit() : limit(-1), offset(0), seen(0), budget(nullptr) {}
+
+    // Очередная прочитанная строка (подходит она или нет); false — бюджет запроса исчерпан
+    bool charge(){
+        return !budget || budget->charge();
+    }
+
+    // Очередная подходящая строка: true — её нужно вывести
+    bool take(){
+        seen++;
+        return seen > offset;
+    }
+    // Сколько подходящих строк нужно встретить: offset + limit с насыщением
+    // (LIMIT 9223372036854775807 OFFSET 1 не переполняется); LONG_MAX — без ограничения
+    long end() const {
+        if(limit < 0 || limit > LONG_MAX - offset) return LONG_MAX;
+        return offset + limit;
+    }
+    // Набрали нужное количество — скан можно прекращать
+    bool done() const {
+        return limit >= 0 && seen >= end();
+    }
+};
+
+
+
+// Пометка словарной колонки в заголовке CSV; отсутствующее значение пишется как NULL
+
+const char* const DICT_MARK = ":dict";
+const size_t DICT_MARK_LEN = 5;
+
+// Поля заголовка CSV: имена колонок, словарные — с пометкой
+vector<string> csvHeader(const Node* tbl){
+    vector<string> fields;
+    for(size_t c = 0; c < tbl->cols.size(); c++){
+        fields.push_back(tbl->cols[c].dict ? tbl->cols[c].name + DICT_MARK : tbl->cols[c].name);
+    }
+    return fields;
+}
+
+// Значение ячейки для файла: для словарной колонки — её код
+string fileCell(Node* tbl, const json& e, const string& column){
+    if(!e.contains(column)) return "NULL";
+    string v = e[column].get<string>();
+    int c = tbl->findDict(column);
+    if(c >= 0) return to_string(tbl->cols[c].dict->lookup(v));
+    return v;
+}
+
+
+// Колоночный формат хранения таблицы: <table>/data.col
+//
+//   "DBC1" | varint число колонок | имена колонок (varint длина + байты)
+//   далее блоки: varint число строк, затем по каждой колонке
+//   u8 кодировка | varint длина данных | u32 контрольная сумма | данные
+//
+// Кодировка каждой колонки блока выбирается по наименьшему размеру:
+// как есть, RLE, словарь, дельты или frame-of-reference (для целых).
+
+const char COL_MAGIC[4] = {'D', 'B', 'C', '1'};
+const size_t COL_CHUNK_ROWS = 4096;
+
+enum ColEncoding { ENC_PLAIN = 0, ENC_RLE = 1, ENC_DICT = 2, ENC_DELTA = 3, ENC_FOR = 4 };
+
+void putVarint(string& out, uint64_t v){
+    while(v >= 0x80){
+        out.push_back((char)((v & 0x7f) | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+bool getVarint(const string& in, size_t& pos, uint64_t& v){
+    v = 0;
+    for(int shift = 0; shift < 64; shift += 7){
+        if(pos >= in.size()) return false;
+        unsigned char ch = in[pos++];
+        v |= (uint64_t)(ch & 0x7f) << shift;
+        if(!(ch & 0x80)) return true;
+    }
+    return false;
+}
+
+void putString(string& out, const string& v){
+    putVarint(out, v.size());
+    out += v;
+}
+
+bool getString(const string& in, size_t& pos, string& v){
+    uint64_t len;
+    if(!getVarint(in, pos, len) || len > in.size() - pos) return false;
+    v.assign(in, pos, len);
+    pos += len;
+    return true;
+}
+
+uint64_t zigzag(int64_t v){ return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+int64_t unzigzag(uint64_t v){ return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+uint32_t fnv1a(const string& data){
+    uint32_t h = 2166136261u;
+    for(size_t i = 0; i < data.size(); i++){
+        h ^= (unsigned char)data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int bitWidth(uint64_t v){
+    int w = 0;
+    while(v){
+        w++;
+        v >>= 1;
+    }
+    return w;
+}
+
+void packBits(string& out, const vector<uint64_t>& vals, int width){
+    uint64_t acc = 0;
+    int acc_bits = 0;
+    for(size_t i = 0; i < vals.size(); i++){
+        for(int b = 0; b < width;){
+            int take = min(width - b, 64 - acc_bits);
+            uint64_t mask = (take == 64) ? ~0ULL : ((1ULL << take) - 1);
+            acc |= ((vals[i] >> b) & mask) << acc_bits;
+            acc_bits += take;
+            b += take;
+            if(acc_bits == 64){
+                out.append((const char*)&acc, 8);
+                acc = 0;
+                acc_bits = 0;
+            }
+        }
+    }
+    out.append((const char*)&acc, (acc_bits + 7) / 8);
+}
+
+bool unpackBits(const string& in, size_t pos, size_t count, int width, vector<uint64_t>& vals){
+    if(width > 64) return false;
+    vals.assign(count, 0);
+    size_t bit = pos * 8;
+    for(size_t i = 0; i < count; i++){
+        uint64_t v = 0;
+        for(int b = 0; b < width;){
+            size_t byte = bit / 8;
+            if(byte >= in.size()) return false;
+            int off = bit % 8;
+            int take = min(8 - off, width - b);
+            uint64_t bits = ((unsigned char)in[byte] >> off) & ((1u << take) - 1);
+            v |= bits << b;
+            b += take;
+            bit += take;
+        }
+        vals[i] = v;
+    }
+    return true;
+}
+
+string encodePlain(const vector<string>& vals){
+    string out;
+    for(size_t i = 0; i < vals.size(); i++) putString(out, vals[i]);
+    return out;
+}
+
+string encodeRle(const vector<string>& vals){
+    string out;
+    for(size_t i = 0; i < vals.size();){
+        size_t j = i;
+        while(j < vals.size() && vals[j] == vals[i]) j++;
+        putVarint(out, j - i);
+        putString(out, vals[i]);
+        i = j;
+    }
+    return out;
+}
+
+string encodeDict(const vector<string>& vals){
+    unordered_map<string, uint64_t> codes;
+    vector<const string*> order;
+    vector<uint64_t> seq(vals.size());
+    for(size_t i = 0; i < vals.size(); i++){
+        auto it = codes.find(vals[i]);
+        if(it == codes.end()){
+            it = codes.emplace(vals[i], order.size()).first;
+            order.push_back(&vals[i]);
+        }
+        seq[i] = it->second;
+    }
+    string out;
+    putVarint(out, order.size());
+    for(size_t i = 0; i < order.size(); i++) putString(out, *order[i]);
+    int width = bitWidth(order.empty() ? 0 : order.size() - 1);
+    out.push_back((char)width);
+    packBits(out, seq, width);
+    return out;
+}
+
+string encodeDelta(const vector<int64_t>& ints){
+    string out;
+    for(size_t i = 0; i < ints.size(); i++){
+        uint64_t diff = (uint64_t)ints[i] - (i > 0 ? (uint64_t)ints[i - 1] : 0);
+        putVarint(out, zigzag((int64_t)diff));
+    }
+    return out;
+}
+
+string encodeFor(const vector<int64_t>& ints){
+    int64_t mn = ints.empty() ? 0 : ints[0];
+    for(size_t i = 1; i < ints.size(); i++) mn = min(mn, ints[i]);
+    vector<uint64_t> offs(ints.size());
+    uint64_t mx = 0;
+    for(size_t i = 0; i < ints.size(); i++){
+        offs[i] = (uint64_t)ints[i] - (uint64_t)mn;
+        mx = max(mx, offs[i]);
+    }
+    string out;
+    putVarint(out, zigzag(mn));
+    int width = bitWidth(mx);
+    out.push_back((char)width);
+    packBits(out, offs, width);
+    return out;
+}
+
+// Кодируем колонку блока самым компактным из подходящих способов
+void encodeColumn(const vector<string>& vals, uint8_t& enc, string& payload){
+    enc = ENC_PLAIN;
+    payload = encodePlain(vals);
+    string cand = encodeRle(vals);
+    if(cand.size() < payload.size()){ enc = ENC_RLE; payload.swap(cand); }
+    cand = encodeDict(vals);
+    if(cand.size() < payload.size()){ enc = ENC_DICT; payload.swap(cand); }
+
+    vector<int64_t> ints(vals.size());
+    for(size_t i = 0; i < vals.size(); i++){
+        if(!parseInt64Exact(vals[i], ints[i])) return;
+    }
+    cand = encodeDelta(ints);
+    if(cand.size() < payload.size()){ enc = ENC_DELTA; payload.swap(cand); }
+    cand = encodeFor(ints);
+    if(cand.size() < payload.size()){ enc = ENC_FOR; payload.swap(cand); }
+}
+
+bool decodeColumn(uint8_t enc, const string& in, size_t rows, vector<string>& out){
+    out.clear();
+    out.reserve(rows);
+    size_t pos = 0;
+    string v;
+    uint64_t n;
+    switch(enc){
+        case ENC_PLAIN:
+            for(size_t i = 0; i < rows; i++){
+                if(!getString(in, pos, v)) return false;
+                out.push_back(v);
+            }
+            return true;
+        case ENC_RLE:
+            while(out.size() < rows){
+                if(!getVarint(in, pos, n) || !getString(in, pos, v) || n > rows - out.size()) return false;
+                out.insert(out.end(), n, v);
+            }
+            return true;
+        case ENC_DICT: {
+            if(!getVarint(in, pos, n) || n > in.size()) return false;
+            vector<string> dict(n);
+            for(uint64_t i = 0; i < n; i++){
+                if(!getString(in, pos, dict[i])) return false;
+            }
+            if(pos >= in.size()) return false;
+            int width = (unsigned char)in[pos++];
+            vector<uint64_t> seq;
+            if(!unpackBits(in, pos, rows, width, seq)) return false;
+            for(size_t i = 0; i < rows; i++){
+                if(seq[i] >= dict.size()) return false;
+                out.push_back(dict[seq[i]]);
+            }
+            return true;
+        }
+        case ENC_DELTA: {
+            uint64_t prev = 0;
+            for(size_t i = 0; i < rows; i++){
+                if(!getVarint(in, pos, n)) return false;
+                prev += (uint64_t)unzigzag(n);
+                out.push_back(to_string((int64_t)prev));
+            }
+            return true;
+        }
+        case ENC_FOR: {
+            if(!getVarint(in, pos, n) || pos >= in.size()) return false;
+            int64_t mn = unzigzag(n);
+            int width = (unsigned char)in[pos++];
+            vector<uint64_t> offs;
+            if(!unpackBits(in, pos, rows, width, offs)) return false;
+            for(size_t i = 0; i < rows; i++){
+                out.push_back(to_string((int64_t)((uint64_t)mn + offs[i])));
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void writeColumnarHeader(ostream& of, const Node* tbl){
+    string hdr(COL_MAGIC, 4);
+    putVarint(hdr, tbl->cols.size());
+    for(size_t c = 0; c < tbl->cols.size(); c++) putString(hdr, tbl->cols[c].name);
+    of.write(hdr.data(), hdr.size());
+}
+
+// Блок из rows строк; cols[c] — значения c-й колонки таблицы
+void writeColumnarChunk(ostream& of, const vector<vector<string>>& cols, size_t rows){
+    string buf;
+    putVarint(buf, rows);
+    for(size_t c = 0; c < cols.size(); c++){
+        uint8_t enc;
+        string payload;
+        encodeColumn(cols[c], enc, payload);
+        buf.push_back((char)enc);
+        putVarint(buf, payload.size());
+        uint32_t sum = fnv1a(payload);
+        buf.append((const char*)&sum, sizeof(sum));
+        buf += payload;
+    }
+    of.write(buf.data(), buf.size());
+}
+
+// Значения строки по колонкам файла (отсутствующие — "NULL")
+void fileRowValues(const Node* tbl, const json& e, vector<vector<string>>& cols){
+    for(size_t c = 0; c < tbl->cols.size(); c++){
+        const string& name = tbl->cols[c].name;
+        cols[c].push_back(e.contains(name) ? e[name].get<string>() : "NULL");
+    }
+}
+
+// Добавление одной строки отдельным блоком; мелкие блоки сливаются
+// при следующей перезаписи файла (DELETE или загрузка)
+void appendColumnarRow(const Node* tbl, const string& path, const json& entry){
+    ostringstream hdr, of;
+    writeColumnarHeader(hdr, tbl);
+    vector<vector<string>> cols(tbl->cols.size());
+    fileRowValues(tbl, entry, cols);
+    writeColumnarChunk(of, cols, 1);
+    disk_io.append(path, of.str(), hdr.str());
+}
+
+// Загрузка колоночного файла. Файл читается целиком, и все длины из него
+// проверяются по оставшимся байтам. Значения блока упаковываются в строки
+// таблицы прямо из векторов колонок. Блок с неверной контрольной суммой
+// не теряется: его байты остаются в tbl->damaged_blocks и при перезаписи
+// файла переносятся как есть. Возвращает число блоков или -1, если файла нет
+long loadColumnarTable(const string& path, Node* tbl){
+    ifstream ifs(path.c_str(), ios::binary);
+    if(!ifs.is_open()) return -1;
+    string in((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+    size_t pos = 4;
+    uint64_t ncols;
+    if(in.size() < 4 || memcmp(in.data(), COL_MAGIC, 4) != 0 || !getVarint(in, pos, ncols) || ncols > in.size() - pos){
+        cerr << "Bad columnar file: " << path << endl;
+        return 0;
+    }
+    // Колонка таблицы для каждой колонки файла (-1 — в схеме её больше нет)
+    vector<int> target(ncols);
+    bool same_layout = (ncols == tbl->cols.size());
+    for(uint64_t c = 0; c < ncols; c++){
+        string name;
+        if(!getString(in, pos, name)){
+            cerr << "Bad columnar file: " << path << endl;
+            return 0;
+        }
+        target[c] = tbl->findColumn(name);
+        if(target[c] != (int)c) same_layout = false;
+    }
+    long chunks = 0;
+    uint64_t rows;
+    vector<vector<string>> cols(ncols);
+    vector<const string*> cells(tbl->cols.size());
+    while(pos < in.size()){
+        size_t start = pos;
+        if(!getVarint(in, pos, rows) || rows > COL_CHUNK_ROWS){
+            cerr << "Truncated columnar file: " << path << endl;
+            return chunks;
+        }
+        bool ok = true;
+        for(uint64_t c = 0; c < ncols; c++){
+            uint64_t len;
+            uint32_t sum;
+            if(pos >= in.size()){
+                cerr << "Truncated columnar file: " << path << endl;
+                return chunks;
+            }
+            uint8_t enc = (uint8_t)in[pos++];
+            if(!getVarint(in, pos, len) || sizeof(sum) > in.size() - pos || len > in.size() - pos - sizeof(sum)){
+                cerr << "Truncated columnar file: " << path << endl;
+                return chunks;
+            }
+            memcpy(&sum, in.data() + pos, sizeof(sum));
+            pos += sizeof(sum);
+            string payload = in.substr(pos, len);
+            pos += len;
+            if(ok && (fnv1a(payload) != sum || !decodeColumn(enc, payload, rows, cols[c]))){
+                ok = false;
+            }
+        }
+        chunks++;
+        if(!ok){
+            if(same_layout){
+                cerr << "Checksum mismatch, block " << chunks << " kept as is: " << path << endl;
+                tbl->damaged_blocks.append(in, start, pos - start);
+            }
+            else{
+                cerr << "Checksum mismatch, block " << chunks << " (old layout), file will not be rewritten: " << path << endl;
+                tbl->damaged_layout = true;
+            }
+            continue;
+        }
+        for(uint64_t r = 0; r < rows; r++){
+            fill(cells.begin(), cells.end(), nullptr);
+            for(uint64_t c = 0; c < ncols; c++){
+                if(target[c] >= 0 && cols[c][r] != "NULL") cells[target[c]] = &cols[c][r];
+            }
+            string err;
+            char* buf = encodeCells(tbl, cells, err);
+            if(buf) linkRow(tbl, new TableDataNode(buf));
+            else cerr << "Row skipped (" << err << "): " << path << endl;
+        }
+    }
+    return chunks;
+}
+
+
+// Хранение в отображаемом файле: <table>/rows.bin
+//
+//   "DBR1" | varint число колонок | по колонке "имя:тип" (varint длина + байты)
+//   и байт словарного флага | далее записи: u32 длина + строка (см. encodeRow)
+//
+// На диске строка лежит в том же виде, что и в памяти, поэтому TableDataNode
+// указывает прямо в отображение, а какие страницы держать в памяти, решает ОС.
+// Строки, вставленные после загрузки, до ближайшей перезаписи файла живут в куче.
+
+const char ROWS_MAGIC[4] = {'D', 'B', 'R', '1'};
+
+string rowsHeader(const Node* tbl){
+    string hdr(ROWS_MAGIC, 4);
+    putVarint(hdr, tbl->cols.size());
+    for(size_t c = 0; c < tbl->cols.size(); c++){
+        putString(hdr, tbl->cols[c].name + ":" + columnTypeName(tbl->cols[c]));
+        hdr.push_back(tbl->cols[c].dict ? 1 : 0);
+    }
+    return hdr;
+}
+
+// Длина строки: фиксированная часть и байты строковых значений
+size_t rowSize(const Node* tbl, const TableDataNode* p){
+    size_t size = tbl->fixed_size;
+    for(size_t c = 0; c < tbl->cols.size(); c++){
+        const ColumnDef& col = tbl->cols[c];
+        if(col.dict || col.type != COL_STRING || rowIsNull(p, c)) continue;
+        uint32_t ref[2];
+        memcpy(ref, p->buf + col.offset, sizeof(ref));
+        size += ref[1];
+    }
+    return size;
+}
+
+void putRowRecord(string& out, const Node* tbl, const TableDataNode* p){
+    uint32_t len = rowSize(tbl, p);
+    out.append((const char*)&len, sizeof(len));
+    out.append(p->buf, len);
+}
+
+// Дозапись одной строки (INSERT)
+void appendMappedRow(const string& path, const Node* tbl, const TableDataNode* p){
+    string rec;
+    putRowRecord(rec, tbl, p);
+    disk_io.append(path, move(rec), rowsHeader(tbl));
+}
+
+// После перезаписи файла строки переводятся на новое отображение,
+// старое снимается. rows и offsets — строки, записанные в файл, и их позиции.
+// Вызывается под исключительной блокировкой таблицы: читателей со
+// старыми указателями на строки нет
+void remapTable(Node* tbl, const string& path, const vector<TableDataNode*>& rows, const vector<size_t>& offsets){
+    MappedFile* mf = new MappedFile();
+    if(!mf->open(path)){
+        cerr << "Failed to map " << path << endl;
+        delete mf;
+        return;
+    }
+    for(size_t i = 0; i < rows.size(); i++){
+        TableDataNode* p = rows[i];
+        if(p->owned) delete[] p->buf;
+        p->buf = mf->base + offsets[i];
+        p->owned = false;
+    }
+    delete tbl->map;
+    tbl->map = mf;
+}
+
+void rewriteTableFile(dbase& db, Node* tbl);
+
+// Разбор заголовка rows.bin в раскладку old (с колонками и словарями);
+// словари колонок, которых в текущей схеме нет, читаются с диска в old.dicts
+bool parseRowsHeader(const string& head, const string& dir, Node* tbl, Node& old, size_t& pos){
+    uint64_t ncols;
+    pos = 4;
+    if(!getVarint(head, pos, ncols)) return false;
+    for(uint64_t c = 0; c < ncols; c++){
+        string spec, err;
+        ColumnDef col;
+        if(!getString(head, pos, spec) || pos >= head.size() || !parseColumnDef(spec, col, err)) return false;
+        if(head[pos++]){
+            int cur = tbl->findDict(col.name);
+            if(cur >= 0) col.dict = tbl->cols[cur].dict;
+            else{
+                col.dict = new ColumnDict(col.name, dir + "/" + col.name + ".dict");
+                col.dict->load();
+                col.dict->next = old.dicts;
+                old.dicts = col.dict;
+            }
+        }
+        old.cols.push_back(col);
+    }
+    old.layout();
+    return true;
+}
+
+// Загрузка таблицы из rows.bin. -1 — файла нет; иначе число строк.
+// Если схема с тех пор изменилась, строки разбираются по раскладке из
+// заголовка и файл переписывается в текущей
+long loadMappedTable(dbase& db, Node* tbl){
+    string dir = db.schema_name + "/" + tbl->name;
+    string path = dir + "/rows.bin";
+    MappedFile* mf = new MappedFile();
+    if(!mf->open(path)){
+        delete mf;
+        return -1;
+    }
+    string hdr = rowsHeader(tbl);
+    bool same_layout = mf->len >= hdr.size() && memcmp(mf->base, hdr.data(), hdr.size()) == 0;
+    Node old(tbl->name);
+    size_t pos = hdr.size();
+    if(!same_layout){
+        string head(mf->base, min(mf->len, (size_t)1 << 20));
+        if(head.size() < 4 || memcmp(mf->base, ROWS_MAGIC, 4) != 0 || !parseRowsHeader(head, dir, tbl, old, pos)){
+            cerr << "Bad rows file: " << path << endl;
+            delete mf;
+            return 0;
+        }
+        cout << "Layout of " << tbl->name << " changed, converting " << path << endl;
+    }
+    // Первый проход по файлу — последовательный
+    mf->advise(MADV_SEQUENTIAL);
+    bool damaged = false;
+    long rows = 0;
+    while(pos < mf->len){
+        uint32_t len;
+        if(mf->len - pos < sizeof(len)){
+            damaged = true;
+            break;
+        }
+        memcpy(&len, mf->base + pos, sizeof(len));
+        pos += sizeof(len);
+        if(len > mf->len - pos || len < (same_layout ? tbl->fixed_size : old.fixed_size)){
+            damaged = true;
+            break;
+        }
+        if(same_layout){
+            linkRow(tbl, new TableDataNode(mf->base + pos, false));
+        }
+        else{
+            TableDataNode tmp(mf->base + pos, false);
+            string err;
+            if(!addDataToTable(tbl, decodeRow(&old, &tmp), err)) cerr << "Row skipped (" << err << "): " << path << endl;
+        }
+        pos += len;
+        rows++;
+    }
+    mf->advise(MADV_NORMAL);
+    while(old.dicts){
+        ColumnDict* d = old.dicts;
+        old.dicts = d->next;
+        delete d;
+    }
+    tbl->map = mf;
+    if(damaged) cerr << "Truncated record at the end of " << path << ", dropped" << endl;
+    if(!same_layout){
+        for(ColumnDict* d = tbl->dicts; d; d = d->next) d->save();
+    }
+    if(damaged || !same_layout) rewriteTableFile(db, tbl);
+    return rows;
+}
+
+
+int my_mkdir(const char* path){
+    return mkdir(path, 0777);
+}
+
+// Создаём директории и CSV-файлы по схеме
+void createDirectories(dbase& db, const json& structure) {
+    if(my_mkdir(db.schema_name.c_str()) && errno != EEXIST){
+        cerr << "Failed to create directory: " << db.schema_name << endl;
+    }
+    for(auto it = structure.begin(); it != structure.end(); ++it){
+        string tname = it.key();
+        string tpath = db.schema_name + "/" + tname;
+        if(my_mkdir(tpath.c_str()) && errno != EEXIST){
+            cerr << "Failed to create directory: " << tpath << endl;
+        }
+        string fname = tpath + "/1.csv";
+        ifstream ck(fname.c_str());
+        if(!ck){
+            ofstream of(fname.c_str());
+            if(of.is_open()){
+                auto& cols = it.value();
+                // Пишем заголовок
+                for(size_t i = 0; i < cols.size(); i++){
+                    string spec = cols[i].get<string>();
+                    of << spec.substr(0, spec.find(':'));
+                    if(i + 1 < cols.size()) of << " ";
+                }
+                of << "\n";
+                of.close();
+            }
+        }
+    }
+}
+
+bool createView(dbase& db, const string& name, const string& query, string& err);
+
+// Загрузка схемы
+void loadSchema(dbase& db, const string& schema_file){
+    ifstream f(schema_file.c_str());
+    if(!f.is_open()){
+        cerr << "Failed to open schema file: " << schema_file << "\n";
+        return;
+    }
+    json j;
+    f >> j;
+    db.schema_file = schema_file;
+    db.schema = j;
+    db.schema_name = j["name"];
+    createDirectories(db, j["structure"]);
+    for(auto it = j["structure"].begin(); it != j["structure"].end(); ++it){
+        db.addNode(it.key());
+        Node* tbl = db.findNode(it.key());
+        for(const auto& spec : it.value()){
+            ColumnDef col;
+            string err;
+            if(!parseColumnDef(spec.get<string>(), col, err)) cerr << err << endl;
+            else if(tbl->findColumn(col.name) >= 0) cerr << "Duplicate column " << col.name << " in " << tbl->name << endl;
+            else tbl->cols.push_back(col);
+        }
+        if(!tbl->cols.empty()) tbl->shard_key = tbl->cols[0].name;
+    }
+    // Необязательный раздел "sharding": {"table": "column"} — ключ шардирования
+    // для маршрутизатора кластера (по умолчанию первая колонка)
+    if(j.contains("sharding")){
+        for(auto it = j["sharding"].begin(); it != j["sharding"].end(); ++it){
+            Node* tbl = db.findNode(it.key());
+            string column = it.value().get<string>();
+            if(!tbl) cerr << "Table not found: " << it.key() << endl;
+            else if(tbl->findColumn(column) < 0) cerr << "Column not found: " << tbl->name << "." << column << endl;
+            else tbl->shard_key = column;
+        }
+    }
+    // Необязательный раздел "dictionary": {"table": ["column", ...]} — словарное кодирование
+    if(j.contains("dictionary")){
+        for(auto it = j["dictionary"].begin(); it != j["dictionary"].end(); ++it){
+            Node* tbl = db.findNode(it.key());
+            if(!tbl){
+                cerr << "Table not found: " << it.key() << endl;
+                continue;
+            }
+            for(const auto& col : it.value()){
+                string column = col.get<string>();
+                int c = tbl->findColumn(column);
+                if(c < 0){
+                    cerr << "Column not found: " << tbl->name << "." << column << endl;
+                    continue;
+                }
+                if(tbl->cols[c].dict) continue;
+                ColumnDict* d = new ColumnDict(column, db.schema_name + "/" + tbl->name + "/" + column + ".dict");
+                d->load();
+                d->next = tbl->dicts;
+                tbl->dicts = d;
+                tbl->cols[c].dict = d;
+            }
+        }
+    }
+    for(Node* tbl = db.head; tbl; tbl = tbl->next) tbl->layout();
+    // Необязательный раздел "storage": {"table": "columnar" | "mmap"} — формат хранения на диске
+    if(j.contains("storage")){
+        for(auto it = j["storage"].begin(); it != j["storage"].end(); ++it){
+            Node* tbl = db.findNode(it.key());
+            if(!tbl){
+                cerr << "Table not found: " << it.key() << endl;
+                continue;
+            }
+            tbl->columnar = (it.value().get<string>() == "columnar");
+            tbl->mapped = (it.value().get<string>() == "mmap");
+        }
+    }
+    // Необязательный раздел "indexes": {"table": ["column", ...]}
+    if(j.contains("indexes")){
+        for(auto it = j["indexes"].begin(); it != j["indexes"].end(); ++it){
+            for(const auto& col : it.value()){
+                string err;
+                if(!createIndex(db, it.key(), col.get<string>(), err)) cerr << err << endl;
+            }
+        }
+    }
+    // Необязательный раздел "bloom": {"table": ["column", ...]}
+    if(j.contains("bloom")){
+        for(auto it = j["bloom"].begin(); it != j["bloom"].end(); ++it){
+            for(const auto& col : it.value()){
+                string err;
+                if(!createBloom(db, it.key(), col.get<string>(), err)) cerr << err << endl;
+            }
+        }
+    }
+    // Необязательный раздел "views": {"view": "SELECT ... FROM table ..."}
+    if(j.contains("views")){
+        for(auto it = j["views"].begin(); it != j["views"].end(); ++it){
+            string err;
+            if(!createView(db, it.key(), it.value().get<string>(), err)) cerr << err << endl;
+        }
+    }
+    // Необязательный раздел "limits": {"max_connections": N, "max_running": N, "max_queue": N,
+    // "queue_wait_ms": N, "query_timeout_ms": N, "max_rows_scanned": N, "idle_timeout_ms": N, "backlog": N,
+    // "io_threads": N, "sort_memory": N}
+    if(j.contains("limits")){
+        const json& l = j["limits"];
+        ServerLimits& sl = db.limits;
+        if(l.contains("max_connections"))  sl.max_connections = l["max_connections"].get<int>();
+        if(l.contains("backlog"))          sl.backlog = l["backlog"].get<int>();
+        if(l.contains("max_running"))      sl.max_running = max(1, l["max_running"].get<int>());
+        if(l.contains("max_queue"))        sl.max_queue = l["max_queue"].get<int>();
+        if(l.contains("queue_wait_ms"))    sl.queue_wait_ms = l["queue_wait_ms"].get<long>();
+        if(l.contains("query_timeout_ms")) sl.query_timeout_ms = l["query_timeout_ms"].get<long>();
+        if(l.contains("max_rows_scanned")) sl.max_rows_scanned = l["max_rows_scanned"].get<long>();
+        if(l.contains("idle_timeout_ms"))  sl.idle_timeout_ms = l["idle_timeout_ms"].get<long>();
+        if(l.contains("io_threads"))       sl.io_threads = max(1, l["io_threads"].get<int>());
+        if(l.contains("sort_memory"))      sl.sort_memory = l["sort_memory"].get<size_t>();
+    }
+    // Необязательный раздел "cache": {"max_bytes": N} — бюджет кэша результатов, 0 выключает
+    if(j.contains("cache") && j["cache"].contains("max_bytes")){
+        db.cache.budget = j["cache"]["max_bytes"].get<size_t>();
+    }
+    cout << "Schema loaded: " << db.schema_name << endl;
+}
+
+
+// Загрузка CSV
+
+void rewriteTableFile(dbase& db, Node* tbl);
+
+// Данные одной таблицы: колоночный файл или CSV
+void loadTableData(dbase& db, Node* cur){
+    if(cur->mapped){
+        long rows = loadMappedTable(db, cur);
+        if(rows >= 0){
+            cout << "Mapped table: " << cur->name << " (" << rows << " rows)" << endl;
+            for(ColumnDict* d = cur->dicts; d; d = d->next) d->persist = true;
+            return;
+        }
+    }
+    if(cur->columnar){
+        string col_path = db.schema_name + "/" + cur->name + "/data.col";
+        long chunks = loadColumnarTable(col_path, cur);
+        if(chunks >= 0){
+            cout << "Loaded columnar table: " << cur->name << " (" << cur->row_count << " rows)" << endl;
+            // Много мелких блоков от одиночных INSERT — сливаем
+            if((size_t)chunks > cur->row_count / COL_CHUNK_ROWS + 16) rewriteTableFile(db, cur);
+            for(ColumnDict* d = cur->dicts; d; d = d->next) d->persist = true;
+            return;
+        }
+    }
+    string path = db.schema_name + "/" + cur->name + "/1.csv";
+    ifstream ifs(path.c_str());
+    if(ifs.is_open()){
+        cout << "Loading table: " << cur->name << endl;
+        bool is_header = true;
+        // Имя колонки для каждой позиции файла и словарь, если она записана кодами
+        vector<string> names;
+        vector<ColumnDict*> coded;
+        // Заголовок файла совпадает с тем, что пишется сейчас: те же колонки
+        // и те же словарные пометки. Иначе файл переписывается — дописывать
+        // коды в колонку без пометки (словарь добавлен в схему позже) нельзя
+        bool header_current = false;
+        string line;
+        while(getline(ifs, line)){
+            if(is_header){
+                is_header = false;
+                istringstream hiss(line);
+                string h;
+                vector<string> fields;
+                while(hiss >> h){
+                    fields.push_back(h);
+                    ColumnDict* d = nullptr;
+                    if(h.size() > DICT_MARK_LEN && h.compare(h.size() - DICT_MARK_LEN, DICT_MARK_LEN, DICT_MARK) == 0){
+                        h.erase(h.size() - DICT_MARK_LEN);
+                        int c = cur->findDict(h);
+                        if(c >= 0) d = cur->cols[c].dict;
+                    }
+                    names.push_back(h);
+                    coded.push_back(d);
+                }
+                header_current = (fields == csvHeader(cur));
+                continue;
+            }
+            if(line.empty()) continue;
+            // поля
+            json entry;
+            istringstream iss(line);
+            string tmp;
+            size_t c = 0;
+            for(; c < names.size() && getline(iss, tmp, ' '); c++){
+                while(!tmp.empty() && (tmp.front() == ' ' || tmp.front() == '\t')) tmp.erase(tmp.begin());
+                while(!tmp.empty() && (tmp.back() == ' ' || tmp.back() == '\t'))   tmp.pop_back();
+                if(tmp == "NULL") continue;
+                // Коды словарных колонок переводим обратно в значения
+                if(coded[c]){
+                    char* end = nullptr;
+                    unsigned long code = strtoul(tmp.c_str(), &end, 10);
+                    if(*end == '\0' && code < coded[c]->values.size()) tmp = coded[c]->values[code];
+                }
+                entry[names[c]] = tmp;
+            }
+            // Пустые значения в конце строки getline не возвращает
+            for(; c < names.size(); c++) entry[names[c]] = "";
+            string err;
+            if(addDataToTable(cur, entry, err)) cout << "Loaded entry: " << entry.dump() << endl;
+            else cerr << "Row skipped (" << err << "): " << line << endl;
+        }
+        ifs.close();
+        // Заголовок устарел (другой набор колонок или словарей) или таблица
+        // переведена в колоночный формат — переписываем в новом формате.
+        // В rows.bin словарные колонки тоже хранятся кодами
+        if(cur->dicts && (!header_current || cur->mapped)){
+            for(ColumnDict* d = cur->dicts; d; d = d->next) d->save();
+        }
+        if(cur->columnar || cur->mapped || !header_current){
+            rewriteTableFile(db, cur);
+        }
+    }
+    for(ColumnDict* d = cur->dicts; d; d = d->next) d->persist = true;
+}
+
+
+// Сохранение одной записи в CSV
+
+void saveSingleEntryToCSV(dbase& db, const string& table, const json& entry){
+    Node* tbl = db.findNode(table);
+    if(tbl && tbl->columnar){
+        appendColumnarRow(tbl, db.schema_name + "/" + table + "/data.col", entry);
+        return;
+    }
+    string path = db.schema_name + "/" + table + "/1.csv";
+    if(tbl){
+        ostringstream of;
+        for(size_t c = 0; c < tbl->cols.size(); c++){
+            if(c > 0) of << " ";
+            of << fileCell(tbl, entry, tbl->cols[c].name);
+        }
+        of << "\n";
+        disk_io.append(path, of.str());
+    }
+}
+
+
+// INSERT
+
+void viewsInsertRow(Node* tbl, TableDataNode* p);
+void viewsDeleteRow(Node* tbl, TableDataNode* p, const json& e);
+
+bool insertRecord(dbase& db, const string& table, json entry, string& err){
+    Node* tbl = db.findNode(table);
+    if(!tbl){
+        err = "Table not found: " + table;
+        return false;
+    }
+    // Применение и запись в журнал — под одной блокировкой, чтобы реплики
+    // видели изменения в том же порядке. Порядок блокировок везде один:
+    // таблица, затем журнал
+    lock_guard<shared_mutex> tbl_guard(tbl->rw);
+    lock_guard<mutex> guard(db.repl.m);
+    if(!addDataToTable(tbl, entry, err)) return false;
+    tbl->version.fetch_add(1, memory_order_release);
+    viewsInsertRow(tbl, tbl->data);
+    json row = decodeRow(tbl, tbl->data);
+    db.repl.append("INSERT " + table + " " + row.dump());
+    if(!db.persist) return true;
+    if(tbl->mapped){
+        appendMappedRow(db.schema_name + "/" + table + "/rows.bin", tbl, tbl->data);
+        return true;
+    }
+    // В файл — значения в каноническом виде, как они хранятся
+    saveSingleEntryToCSV(db, table, row);
+    return true;
+}
+
+
+// Полная перезапись CSV таблицы. Заодно по оставшимся строкам заново
+// заполняются фильтры Блума и зон-карты (после удаления они устарели).
+// Вызывающий держит таблицу исключительно (или она ещё загружается)
+
+void rewriteTableFile(dbase& db, Node* tbl){
+    // Файл собираем в памяти и отдаём фоновому вводу-выводу: тот пишет
+    // во временный файл и подменяет им старый
+    string path = db.schema_name + "/" + tbl->name + (tbl->columnar ? "/data.col" : tbl->mapped ? "/rows.bin" : "/1.csv");
+    ostringstream of;
+    // Заголовок
+    size_t ncols = tbl->cols.size();
+    // Строки rows.bin и их позиции — для перевода на новое отображение
+    vector<TableDataNode*> mapped_rows;
+    vector<size_t> offsets;
+    size_t offset = 0;
+    if(tbl->columnar){
+        if(tbl->damaged_layout){
+            cerr << "Damaged blocks in an old layout, file not rewritten: " << path << endl;
+            return;
+        }
+        writeColumnarHeader(of, tbl);
+        of.write(tbl->damaged_blocks.data(), tbl->damaged_blocks.size());
+    }
+    else if(tbl->mapped){
+        string hdr = rowsHeader(tbl);
+        of.write(hdr.data(), hdr.size());
+        offset = hdr.size();
+    }
+    else{
+        vector<string> hdr = csvHeader(tbl);
+        for(size_t c = 0; c < hdr.size(); c++){
+            if(c > 0) of << " ";
+            of << hdr[c];
+        }
+        of << "\n";
+    }
+    vector<vector<string>> chunk(ncols);
+    size_t chunk_rows = 0;
+    for(BloomFilter* bf = tbl->blooms; bf; bf = bf->next) bf->reset(tbl->row_count * 2);
+    for(RowBlock* b = tbl->blocks; b; b = b->next) b->zones.clear();
+    RowBlock* zb = tbl->blocks;
+    TableDataNode* p = tbl->data;
+    while(p){
+        json e2 = decodeRow(tbl, p);
+        for(BloomFilter* bf = tbl->blooms; bf; bf = bf->next){
+            if(e2.contains(bf->column)) bf->add(e2[bf->column].get<string>());
+        }
+        zb->widen(e2);
+        if(p == zb->last) zb = zb->next;
+        if(tbl->columnar){
+            fileRowValues(tbl, e2, chunk);
+            if(++chunk_rows == COL_CHUNK_ROWS){
+                writeColumnarChunk(of, chunk, chunk_rows);
+                for(size_t c = 0; c < ncols; c++) chunk[c].clear();
+                chunk_rows = 0;
+            }
+        }
+        else if(tbl->mapped){
+            string rec;
+            putRowRecord(rec, tbl, p);
+            of.write(rec.data(), rec.size());
+            mapped_rows.push_back(p);
+            offsets.push_back(offset + sizeof(uint32_t));
+            offset += rec.size();
+        }
+        else{
+            for(size_t c = 0; c < ncols; c++){
+                if(c > 0) of << " ";
+                of << fileCell(tbl, e2, tbl->cols[c].name);
+            }
+            of << "\n";
+        }
+        p = p->next;
+    }
+    if(chunk_rows > 0) writeColumnarChunk(of, chunk, chunk_rows);
+    if(tbl->mapped){
+        // Отображать можно только уже записанный файл: строки переводятся на
+        // него из потока ввода-вывода, когда файл на месте. Если к тому времени
+        // таблицу переписали снова (например, удалили строки), ждём ту запись
+        uint64_t seq = ++tbl->rewrites;
+        disk_io.replace(path, of.str(), [tbl, path, seq, rows = move(mapped_rows), offs = move(offsets)]{
+            lock_guard<shared_mutex> guard(tbl->rw);
+            if(tbl->rewrites == seq) remapTable(tbl, path, rows, offs);
+        });
+    }
+    else disk_io.replace(path, of.str());
+    cout << "Table file rewritten: " << path << endl;
+}
+
+
+// DELETE
+
+// false — удаление не выполнено, причина в err (строки без совпадений — не ошибка)
+bool deleteRow(dbase& db, const string& column, const string& value, const string& table, string& err){
+    Node* tbl = db.findNode(table);
+    if(!tbl){
+        err = "Table not found: " + table;
+        return false;
+    }
+    lock_guard<shared_mutex> tbl_guard(tbl->rw);
+    lock_guard<mutex> guard(db.repl.m);
+    // Файл нельзя переписать без потери повреждённых блоков — строки не удаляем,
+    // иначе после перезапуска они вернулись бы
+    if(db.persist && tbl->columnar && tbl->damaged_layout){
+        err = "table " + table + " has damaged blocks, DELETE refused.";
+        return false;
+    }
+    // Значения точно нет — не сканируем и не переписываем файл
+    if(!bloomMayContain(tbl, column, value)){
+        cout << "Row with " << column << "=" << value << " not found in " << table << endl;
+        return true;
+    }
+    TableDataNode dummy(nullptr);
+    dummy.next = tbl->data;
+    TableDataNode* prev = &dummy;
+    TableDataNode* cur = tbl->data;
+    // Блок, которому принадлежит cur, и предыдущий блок
+    RowBlock* blk = tbl->blocks;
+    RowBlock* prev_blk = nullptr;
+    bool found = false;
+    // Сравниваем ячейку в буфере (по значению нужного типа, словарную — по коду)
+    // и разбираем только совпавшие строки
+    Condition eq;
+    eq.column = column;
+    eq.op = "=";
+    eq.value = value;
+    CellCondition match;
+    match.bind(tbl, 0, eq);
+    while(cur){
+        bool block_end = (cur == blk->last);
+        if(match.test(cur)){
+            json e = decodeRow(tbl, cur);
+            found = true;
+            cout << "Deleted row: " << e.dump() << endl;
+            indexEraseRow(tbl, cur, e);
+            viewsDeleteRow(tbl, cur, e);
+            // Границы блока сдвигаем, опустевший блок убираем
+            blk->rows--;
+            if(blk->rows == 0){
+                RowBlock* dead = blk;
+                if(prev_blk) prev_blk->next = blk->next; else tbl->blocks = blk->next;
+                blk = prev_blk;
+                delete dead;
+            }
+            else if(cur == blk->first){
+                blk->first = cur->next;
+            }
+            else if(cur == blk->last){
+                blk->last = prev;
+            }
+            prev->next = cur->next;
+            delete cur;
+            tbl->row_count--;
+            cur = prev->next;
+        }
+        else{
+            prev = cur;
+            cur = cur->next;
+        }
+        if(block_end){
+            prev_blk = blk;
+            blk = blk ? blk->next : tbl->blocks;
+        }
+    }
+    tbl->data = dummy.next;
+    if(found){
+        tbl->version.fetch_add(1, memory_order_release);
+        db.repl.append("DELETE " + table + " " + column + " " + value);
+        if(db.persist) rewriteTableFile(db, tbl);
+    }
+    else{
+        cout << "Row with " << column << "=" << value << " not found in " << table << endl;
+    }
+    return true;
+}
+
+
+// Парсинг WHERE
+
+void parseWhereClause(const string& where_clause, ConditionList& cond_list, string& logical_op){
+    cond_list.count = 0;
+    logical_op.clear();
+    size_t pos_and = where_clause.find(" AND ");
+    size_t pos_or = where_clause.find(" OR ");
+    if(pos_and != string::npos){
+        logical_op = "AND";
+    }
+    else if(pos_or != string::npos){
+        logical_op = "OR";
+    }
+    size_t start = 0;
+    while(start < where_clause.size()){
+        size_t next_pos = string::npos;
+        if(logical_op == "AND"){
+            next_pos = where_clause.find(" AND ", start);
+        }
+        else if(logical_op == "OR"){
+            next_pos = where_clause.find(" OR ", start);
+        }
+        string part;
+        if(next_pos != string::npos){
+            part = where_clause.substr(start, next_pos - start);
+            start = next_pos + logical_op.size() + 2;
+        }
+        else{
+            part = where_clause.substr(start);
+            start = where_clause.size();
+        }
+        while(!part.empty() && (part.front() == ' ' || part.front() == '\t')) part.erase(part.begin());
+        while(!part.empty() && (part.back() == ' ' || part.back() == '\t'))   part.pop_back();
+
+        // Двухсимвольные операторы ищем раньше '=', иначе ">=" разберётся как "="
+        const char* ops[] = {"!=", "<=", ">=", "=", "<", ">"};
+        size_t p = string::npos;
+        string op;
+        for(int k = 0; k < 6 && p == string::npos; k++){
+            p = part.find(ops[k]);
+            if(p != string::npos) op = ops[k];
+        }
+
+        if(p == string::npos) continue;
+        Condition c;
+        c.op = op;
+        string col = part.substr(0, p);
+        string val = part.substr(p + op.size());
+        while(!col.empty() && (col.front() == ' ' || col.front() == '\t')) col.erase(col.begin());
+        while(!col.empty() && (col.back() == ' ' || col.back() == '\t'))   col.pop_back();
+        while(!val.empty() && (val.front() == ' ' || val.front() == '\t' || val.front() == '\'')) val.erase(val.begin());
+        while(!val.empty() && (val.back() == ' ' || val.back() == '\t' || val.back() == '\''))   val.pop_back();
+        c.column = col;
+        c.value = val;
+        if(cond_list.count < MAX_COND){
+            cond_list.conds[cond_list.count++] = c;
+        }
+    }
+}
+
+
+// ORDER BY: top-k куча при LIMIT, внешняя сортировка слиянием без него
+
+struct OrderBy {
+    string column;  // пусто — без сортировки
+    bool desc;
+    OrderBy() : desc(false) {}
+};
+
+// Каталог для прогонов: $TMPDIR, иначе /tmp (не каталог схемы с данными)
+string sortTempDir(){
+    const char* dir = getenv("TMPDIR");
+    return (dir && *dir) ? dir : "/tmp";
+}
+
+struct SortItem {
+    string key;
+    string line;
+    uint64_t seq;   // порядок появления — для устойчивости сортировки
+};
+
+void writeSortItem(ofstream& of, const SortItem& it){
+    uint32_t klen = it.key.size(), llen = it.line.size();
+    of.write((const char*)&klen, sizeof(klen));
+    of.write(it.key.data(), klen);
+    of.write((const char*)&llen, sizeof(llen));
+    of.write(it.line.data(), llen);
+    of.write((const char*)&it.seq, sizeof(it.seq));
+}
+
+bool readSortItem(ifstream& in, SortItem& it){
+    uint32_t klen, llen;
+    if(!in.read((char*)&klen, sizeof(klen))) return false;
+    it.key.resize(klen);
+    in.read(&it.key[0], klen);
+    in.read((char*)&llen, sizeof(llen));
+    it.line.resize(llen);
+    in.read(&it.line[0], llen);
+    in.read((char*)&it.seq, sizeof(it.seq));
+    return (bool)in;
+}
+
+struct RowSorter {
+    OrderBy order;
+    RowLimit& lim;
+    string tmp_dir;             // куда сбрасываются прогоны
+    bool can_spill;             // false — прогон не удалось создать, сортируем в памяти
+    bool bounded;               // есть LIMIT => держим только top-k
+    size_t k;
+    uint64_t seq;
+    size_t mem_bytes;
+    size_t mem_limit;           // бюджет памяти запроса (limits.sort_memory)
+    vector<SortItem> items;     // куча top-k либо текущий прогон
+    vector<string> runs;        // файлы отсортированных прогонов
+
+    RowSorter(const OrderBy& o, RowLimit& l)
+        : order(o), lim(l), tmp_dir(sortTempDir()), can_spill(true), seq(0), mem_bytes(0),
+          mem_limit(l.budget ? l.budget->sort_memory : SORT_MEMORY_BUDGET)
+    {
+        bounded = (lim.limit >= 0);
+        k = bounded ? (size_t)lim.end() : 0;
+    }
+    ~RowSorter(){
+        for(size_t i = 0; i < runs.size(); i++) unlink(runs[i].c_str());
+    }
+
+    bool active() const { return !order.column.empty(); }
+
+    bool less(const SortItem& a, const SortItem& b) const {
+        int c = compareValues(a.key, b.key);
+        if(order.desc) c = -c;
+        if(c != 0) return c < 0;
+        return a.seq < b.seq;
+    }
+
+    struct Less {
+        const RowSorter* s;
+        bool operator()(const SortItem& a, const SortItem& b) const { return s->less(a, b); }
+    };
+
+    static size_t itemBytes(const SortItem& it){
+        return it.key.size() + it.line.size() + sizeof(SortItem);
+    }
+
+    void add(const string& key, const string& line){
+        SortItem it;
+        it.key = key;
+        it.line = line;
+        it.seq = seq++;
+        Less cmp = {this};
+        if(bounded){
+            // Max-куча: на вершине худшая из k лучших строк
+            if(items.size() < k){
+                mem_bytes += itemBytes(it);
+                items.push_back(move(it));
+                push_heap(items.begin(), items.end(), cmp);
+            }
+            else if(k > 0 && less(it, items.front())){
+                pop_heap(items.begin(), items.end(), cmp);
+                mem_bytes += itemBytes(it) - itemBytes(items.back());
+                items.back() = move(it);
+                push_heap(items.begin(), items.end(), cmp);
+            }
+            // k строк не помещаются в бюджет — дальше как без LIMIT: куча
+            // становится первым прогоном, выбывшие из неё строки в ответ не попали бы
+            if(mem_bytes > mem_limit && can_spill){
+                spillRun();
+                if(can_spill) bounded = false;
+                else make_heap(items.begin(), items.end(), cmp);
+            }
+            return;
+        }
+        mem_bytes += itemBytes(it);
+        items.push_back(move(it));
+        if(mem_bytes > mem_limit && can_spill) spillRun();
+    }
+
+    // Сортируем накопленное и сбрасываем как прогон на диск
+    void spillRun(){
+        Less cmp = {this};
+        sort(items.begin(), items.end(), cmp);
+        string tmpl = tmp_dir + "/sort_run_XXXXXX";
+        vector<char> path(tmpl.begin(), tmpl.end());
+        path.push_back('\0');
+        int fd = mkstemp(path.data());
+        if(fd < 0){
+            cerr << "Failed to create sort run in " << tmp_dir << endl;
+            can_spill = false;  // дальше сортируем в памяти, не пытаясь на каждой строке
+            return;
+        }
+        close(fd);
+        ofstream of(path.data(), ios::binary | ios::trunc);
+        for(size_t i = 0; i < items.size(); i++) writeSortItem(of, items[i]);
+        of.close();
+        runs.push_back(path.data());
+        items.clear();
+        mem_bytes = 0;
+    }
+
+    bool emit(const SortItem& it, ostream& out){
+        if(!lim.take()) return false;
+        out << it.line << "\n";
+        return true;
+    }
+
+    // Выводим строки в нужном порядке; true — что-то вывели
+    bool finish(ostream& out){
+        bool found = false;
+        Less cmp = {this};
+        if(bounded || runs.empty()){
+            if(bounded) sort_heap(items.begin(), items.end(), cmp);
+            else sort(items.begin(), items.end(), cmp);
+            for(size_t i = 0; i < items.size() && !lim.done(); i++){
+                if(emit(items[i], out)) found = true;
+            }
+            return found;
+        }
+
+        // k-путевое слияние прогонов и остатка в памяти
+        sort(items.begin(), items.end(), cmp);
+        size_t n = runs.size();
+        vector<ifstream> in(n);
+        vector<SortItem> cur(n + 1);
+        vector<bool> alive(n + 1, false);
+        size_t mem_pos = 0;
+        for(size_t i = 0; i < n; i++){
+            in[i].open(runs[i].c_str(), ios::binary);
+            alive[i] = readSortItem(in[i], cur[i]);
+        }
+        if(mem_pos < items.size()){
+            cur[n] = items[mem_pos++];
+            alive[n] = true;
+        }
+        while(!lim.done()){
+            size_t best = n + 1;
+            for(size_t i = 0; i <= n; i++){
+                if(alive[i] && (best > n || less(cur[i], cur[best]))) best = i;
+            }
+            if(best > n) break;
+            if(emit(cur[best], out)) found = true;
+            if(best < n){
+                alive[best] = readSortItem(in[best], cur[best]);
+            }
+            else if(mem_pos < items.size()){
+                cur[n] = items[mem_pos++];
+            }
+            else{
+                alive[n] = false;
+            }
+        }
+        return found;
+    }
+};
+
+
+// Вывод одной строки результата
+
+void formatRow(ostream& out, json& e, const string* columns, int col_count){
+    for(int c = 0; c < col_count; c++){
+        if(c > 0) out << " ";
+        if(columns[c] == "*"){
+            bool first = true;
+            for(auto it = e.begin(); it != e.end(); ++it){
+                if(!first) out << " ";
+                out << it.key() << "=" << it.value().get<string>();
+                first = false;
+            }
+            break;
+        }
+        else{
+            if(e.contains(columns[c])){
+                out << e[columns[c]].get<string>();
+            }
+            else{
+                out << "NULL";
+            }
+        }
+    }
+}
+
+// Ключ сортировки строки
+string sortKey(const json& e, const OrderBy& order){
+    if(!e.contains(order.column)) return "NULL";
+    return e[order.column].get<string>();
+}
+
+
+// Фильтры Блума для SELECT: true — ни одна строка таблицы не пройдёт WHERE
+bool bloomExcludes(Node* tbl, const ConditionList& cond_list, const string& logical_op){
+    if(!tbl->blooms || cond_list.count == 0) return false;
+    bool is_or = (logical_op == "OR");
+    for(int i = 0; i < cond_list.count; i++){
+        const Condition& c = cond_list.conds[i];
+        bool excluded = (c.op == "=" && !bloomMayContain(tbl, c.column, c.value));
+        if(!is_or && excluded) return true;     // AND: достаточно одного
+        if(is_or && !excluded) return false;    // OR: нужны все
+    }
+    return is_or;
+}
+
+
+// Зон-карты для SELECT
+
+// true — ни одно значение из [min, max] не удовлетворяет условию
+bool zoneExcludesCondition(const RowBlock* blk, const Condition& c){
+    auto z = blk->zones.find(c.column);
+    if(z == blk->zones.end()) return true;      // колонки нет ни в одной строке блока
+    const ZoneRange& zr = z->second;
+    if(c.op == "=")  return compareValues(c.value, zr.min_v) < 0 || compareValues(c.value, zr.max_v) > 0;
+    if(c.op == "<")  return compareValues(zr.min_v, c.value) >= 0;
+    if(c.op == "<=") return compareValues(zr.min_v, c.value) > 0;
+    if(c.op == ">")  return compareValues(zr.max_v, c.value) <= 0;
+    if(c.op == ">=") return compareValues(zr.max_v, c.value) < 0;
+    return false;
+}
+
+// Отсечение блоков по условиям WHERE. Для CROSS JOIN условие относится к
+// таблице лишь в тех проходах, где его колонка берётся из неё, поэтому
+// для каждого прохода хранится маска применимых условий.
+struct ZoneFilter {
+    const ConditionList* cond_list;
+    bool is_or;
+    vector<vector<bool>> passes;
+
+    ZoneFilter(const ConditionList& cl, const string& logical_op)
+        : cond_list(&cl), is_or(logical_op == "OR") {}
+
+    // Все условия относятся к таблице (обычный SELECT)
+    void addFullPass(){
+        passes.push_back(vector<bool>(cond_list->count, true));
+    }
+
+    // Проходы CROSS JOIN для таблицы side (0 — левая, 1 — правая): в проходе k
+    // колонка columns[c] берётся из таблицы (c % 2) ^ k, при повторах — последняя
+    void addJoinPasses(const string* columns, int col_count, int side){
+        for(int k = 0; k < 2; k++){
+            vector<bool> applies(cond_list->count, false);
+            for(int i = 0; i < cond_list->count; i++){
+                int last = -1;
+                for(int c = 0; c < col_count; c++){
+                    if(columns[c] == cond_list->conds[i].column) last = c;
+                }
+                if(last >= 0) applies[i] = (((last % 2) ^ k) == side);
+            }
+            passes.push_back(applies);
+        }
+    }
+
+    bool excludesPass(const RowBlock* blk, const vector<bool>& applies) const {
+        for(int i = 0; i < cond_list->count; i++){
+            bool excluded = applies[i] && zoneExcludesCondition(blk, cond_list->conds[i]);
+            if(!is_or && excluded) return true;     // AND: достаточно одного
+            if(is_or && !excluded) return false;    // OR: нужны все
+        }
+        return is_or;
+    }
+
+    // Блок можно пропустить, только если он отсекается во всех проходах
+    bool excludes(const RowBlock* blk) const {
+        if(cond_list->count == 0 || passes.empty()) return false;
+        for(size_t k = 0; k < passes.size(); k++){
+            if(!excludesPass(blk, passes[k])) return false;
+        }
+        return true;
+    }
+};
+
+// Проход по строкам таблицы с пропуском отсечённых блоков
+struct BlockScan {
+    const ZoneFilter* filter;
+    Node* tbl;
+    RowBlock* blk;
+
+    BlockScan(const ZoneFilter& f) : filter(&f), tbl(nullptr), blk(nullptr) {}
+
+    TableDataNode* start(Node* t){
+        tbl = t;
+        blk = tbl->blocks;
+        return enter();
+    }
+    TableDataNode* enter(){
+        while(blk && filter->excludes(blk)) blk = blk->next;
+        if(!blk) return nullptr;
+        // Строки блока в rows.bin лежат подряд: просим ОС прочитать их заранее
+        if(tbl->map && !blk->first->owned && !blk->last->owned){
+            TableDataNode* lo = blk->first->buf < blk->last->buf ? blk->first : blk->last;
+            TableDataNode* hi = (lo == blk->first) ? blk->last : blk->first;
+            tbl->map->willNeed(lo->buf, hi->buf + rowSize(tbl, hi));
+        }
+        return blk->first;
+    }
+    TableDataNode* next(TableDataNode* p){
+        if(p != blk->last) return p->next;
+        blk = blk->next;
+        return enter();
+    }
+};
+
+
+// Выбор индекса для SELECT
+
+// Сужаем диапазон по условиям на колонку; true — хотя бы одно условие подошло
+bool rangeFromConditions(const string& column, const ConditionList& cond_list,
+                         const string& logical_op, KeyRange& r)
+{
+    // При OR диапазон одного условия не ограничивает результат
+    if(logical_op == "OR" && cond_list.count > 1) return false;
+    bool used = false;
+    for(int i = 0; i < cond_list.count; i++){
+        const Condition& c = cond_list.conds[i];
+        if(c.column != column) continue;
+        bool lo = (c.op == "=" || c.op == ">" || c.op == ">=");
+        bool hi = (c.op == "=" || c.op == "<" || c.op == "<=");
+        if(!lo && !hi) continue;
+        bool incl = (c.op == "=" || c.op == ">=" || c.op == "<=");
+        if(lo){
+            int cmp = r.has_lo ? compareValues(c.value, r.lo) : 1;
+            if(cmp > 0 || (cmp == 0 && !incl)){
+                r.lo = c.value;
+                r.lo_incl = incl;
+            }
+            r.has_lo = true;
+        }
+        if(hi){
+            int cmp = r.has_hi ? compareValues(c.value, r.hi) : -1;
+            if(cmp < 0 || (cmp == 0 && !incl)){
+                r.hi = c.value;
+                r.hi_incl = incl;
+            }
+            r.has_hi = true;
+        }
+        used = true;
+    }
+    return used;
+}
+
+// Индекс, покрывающий диапазон WHERE или колонку ORDER BY; nullptr — полный скан
+OrderedIndex* chooseIndex(Node* tbl, const ConditionList& cond_list, const string& logical_op,
+                          const OrderBy& order, KeyRange& range)
+{
+    OrderedIndex* by_order = nullptr;
+    for(OrderedIndex* ix = tbl->indexes; ix; ix = ix->next){
+        KeyRange r;
+        if(rangeFromConditions(ix->column, cond_list, logical_op, r)){
+            range = r;
+            return ix;
+        }
+        if(ix->column == order.column) by_order = ix;
+    }
+    range = KeyRange();
+    return by_order;
+}
+
+
+// SELECT (одна таблица)
+
+void selectFromTable(dbase& db,
+                     const string& table,
+                     const string* columns, int col_count,
+                     const ConditionList& cond_list,
+                     const string& logical_op,
+                     const OrderBy& order,
+                     RowLimit& lim,
+                     ostream& out)
+{
+    Node* tbl = db.findNode(table);
+    if(!tbl){
+        out << "Table not found: " << table << "\n";
+        return;
+    }
+    shared_lock<shared_mutex> guard(tbl->rw);
+    // Заголовок
+    for(int i = 0; i < col_count; i++){
+        if(i > 0) out << " ";
+        out << columns[i];
+    }
+    out << "\n";
+
+    bool data_found = false;
+
+    // Индекс читает только нужный диапазон ключей; если он построен по колонке
+    // ORDER BY, строки уже идут в нужном порядке и сортировка не нужна
+    KeyRange range;
+    OrderedIndex* ix = chooseIndex(tbl, cond_list, logical_op, order, range);
+    IndexCursor cursor;
+    OrderBy sort_order = order;
+    if(ix){
+        bool ordered = (ix->column == order.column);
+        cursor = ix->open(range, ordered && order.desc);
+        if(ordered) sort_order = OrderBy();
+    }
+
+    // Без индекса читаем блоками, пропуская отсечённые зон-картами
+    ZoneFilter zf(cond_list, logical_op);
+    zf.addFullPass();
+    BlockScan scan(zf);
+
+    RowSorter sorter(sort_order, lim);
+    RowFilter rf(tbl, cond_list, logical_op);
+    TableDataNode* p = ix ? cursor.row() : scan.start(tbl);
+    if(bloomExcludes(tbl, cond_list, logical_op)) p = nullptr;
+    while(p && !lim.done() && lim.charge()){
+        // JSON собираем только для строк, прошедших WHERE
+        if(rf.matches(p)){
+            json e = decodeRow(tbl, p);
+            if(sorter.active()){
+                ostringstream row;
+                formatRow(row, e, columns, col_count);
+                sorter.add(sortKey(e, order), row.str());
+            }
+            else if(lim.take()){
+                data_found = true;
+                formatRow(out, e, columns, col_count);
+                out << "\n";
+            }
+        }
+        p = ix ? cursor.advance() : scan.next(p);
+    }
+    if(sorter.active()) data_found = sorter.finish(out);
+    if(!data_found){
+        out << "No data found in " << table << ".\n";
+    }
+}
+
+
+// SELECT (несколько таблиц)
+
+void selectFromMultipleTables(dbase& db,
+                              const string* columns, int col_count,
+                              const string* tables, int tab_count,
+                              const ConditionList& cond_list,
+                              const string& logical_op,
+                              const OrderBy& order,
+                              RowLimit& lim,
+                              ostream& out)
+{
+    if(tab_count <= 0){
+        out << "No tables specified.\n";
+        return;
+    }
+    // Заголовок
+    for(int i = 0; i < col_count; i++){
+        if(i > 0) out << " ";
+        out << columns[i];
+    }
+    out << "\n";
+
+    bool data_found = false;
+    RowSorter sorter(order, lim);
+    ZoneFilter zf(cond_list, logical_op);
+    zf.addFullPass();
+    BlockScan scan(zf);
+    for(int t = 0; t < tab_count && !lim.done(); t++){
+        Node* tbl = db.findNode(tables[t]);
+        if(!tbl){
+            out << "Table not found: " << tables[t] << "\n";
+            continue;
+        }
+        shared_lock<shared_mutex> guard(tbl->rw);
+        RowFilter rf(tbl, cond_list, logical_op);
+        TableDataNode* p = scan.start(tbl);
+        if(bloomExcludes(tbl, cond_list, logical_op)) p = nullptr;
+        while(p && !lim.done() && lim.charge()){
+            if(rf.matches(p)){
+                json e = decodeRow(tbl, p);
+                if(sorter.active()){
+                    ostringstream row;
+                    formatRow(row, e, columns, col_count);
+                    sorter.add(sortKey(e, order), row.str());
+                }
+                else if(lim.take()){
+                    data_found = true;
+                    formatRow(out, e, columns, col_count);
+                    out << "\n";
+                }
+            }
+            p = scan.next(p);
+        }
+    }
+    if(sorter.active()) data_found = sorter.finish(out);
+    if(!data_found){
+        out << "No data found in the specified tables.\n";
+    }
+}
+
+
+// CROSS JOIN 
+
+// Строка соединения для прохода pass: колонка columns[c] берётся из
+// table1, если (c % 2) ^ pass == 0, иначе из table2; нет значения — "NULL"
+json joinRow(const Node* t1, const TableDataNode* p1, const Node* t2, const TableDataNode* p2,
+             const string* columns, int col_count, int pass)
+{
+    json comb;
+    string v;
+    for(int c = 0; c < col_count; c++){
+        bool right = ((c % 2) ^ pass) != 0;
+        const Node* t = right ? t2 : t1;
+        int k = t->findColumn(columns[c]);
+        comb[columns[c]] = (k >= 0 && cellText(t, right ? p2 : p1, k, v)) ? v : string("NULL");
+    }
+    return comb;
+}
+
+// Пар строк на одну задачу соединения: задачи мелкие, и пул между ними
+// успевает выполнять другие команды
+const size_t JOIN_TASK_PAIRS = 16384;
+
+// Строки соединения, найденные одной задачей: ключ сортировки и текст
+struct JoinPart {
+    vector<pair<string, string>> rows;
+};
+
+// Соединение строк outer[from, to) со всеми строками inner в part. Без
+// сортировки больше cap строк задаче не нужно — их не выведут
+void joinRange(const Node* t1, const Node* t2,
+               TableDataNode* const* outer, size_t from, size_t to,
+               const vector<TableDataNode*>& inner,
+               const string* columns, int col_count,
+               const RowFilter& rf1, const RowFilter& rf2,
+               const OrderBy& order, bool sorting, long cap, JoinPart& part)
+{
+    for(size_t i = from; i < to; i++){
+        TableDataNode* p1 = outer[i];
+        for(size_t j = 0; j < inner.size(); j++){
+            TableDataNode* p2 = inner[j];
+            for(int pass = 0; pass < 2; pass++){
+                if(!sorting && (long)part.rows.size() >= cap) return;
+                if(!(pass == 0 ? rf1 : rf2).matches(p1, p2)) continue;
+                json comb = joinRow(t1, p1, t2, p2, columns, col_count, pass);
+                string line;
+                for(int c = 0; c < col_count; c++){
+                    if(c > 0) line += " ";
+                    line += comb[columns[c]].get<string>();
+                }
+                part.rows.emplace_back(sorting ? sortKey(comb, order) : string(), move(line));
+            }
+        }
+    }
+}
+
+void crossJoinTables(dbase& db,
+                     const string& table1,
+                     const string& table2,
+                     const string* columns, int col_count,
+                     const ConditionList& cond_list,
+                     const string& logical_op,
+                     const OrderBy& order,
+                     RowLimit& lim,
+                     ostream& out)
+{
+    Node* t1 = db.findNode(table1);
+    Node* t2 = db.findNode(table2);
+    if(!t1){
+        out << "Table not found: " << table1 << "\n";
+        return;
+    }
+    if(!t2){
+        out << "Table not found: " << table2 << "\n";
+        return;
+    }
+    TableReadLock guard({t1, t2});
+
+    // Выводим «заголовок» (просто перечислим columns)
+    for(int i = 0; i < col_count; i++){
+        if(i > 0) out << " ";
+        out << columns[i];
+    }
+    out << "\n";
+
+    bool data_found = false;
+    RowSorter sorter(order, lim);
+
+    // Для каждой пары (row1, row2) из (table1 × table2) делаем ДВА прохода:
+    // pass=1 => столбцы с чётным индексом берем из table1, с нечётным => из table2
+    // pass=2 => наоборот
+    // Блоки, отсечённые зон-картами в обоих проходах, не читаем вовсе.
+    // WHERE проверяется по ячейкам обеих строк, строка результата
+    // собирается только для прошедших пар
+    ZoneFilter zf1(cond_list, logical_op), zf2(cond_list, logical_op);
+    zf1.addJoinPasses(columns, col_count, 0);
+    zf2.addJoinPasses(columns, col_count, 1);
+    BlockScan scan1(zf1), scan2(zf2);
+    RowFilter rf1(t1, t2, cond_list, logical_op, columns, col_count, 0);
+    RowFilter rf2(t1, t2, cond_list, logical_op, columns, col_count, 1);
+    vector<TableDataNode*> outer, inner;
+    for(TableDataNode* p = scan1.start(t1); p; p = scan1.next(p)) outer.push_back(p);
+    for(TableDataNode* p = scan2.start(t2); p; p = scan2.next(p)) inner.push_back(p);
+
+    // Внешний цикл режем на отрезки строк table1 — задачи пула. Задачи идут
+    // волнами: результаты волны сливаются по порядку отрезков (порядок строк
+    // тот же, что при последовательном проходе), в памяти — не больше одной
+    // волны, а набранный LIMIT останавливает следующие волны
+    size_t per_task = max((size_t)1, JOIN_TASK_PAIRS / max((size_t)1, inner.size()));
+    size_t wave_tasks = 4 * max((size_t)1, db.pool.size());
+    bool sorting = sorter.active();
+    bool stopped = false;
+    size_t next = 0;
+    while(next < outer.size() && !stopped && (sorting || !lim.done())){
+        // Бюджет запроса списываем здесь: строка table1 и её пары
+        vector<pair<size_t, size_t>> ranges;
+        size_t from = next;
+        while(ranges.size() < wave_tasks && next < outer.size()){
+            bool ok = lim.charge();
+            for(size_t j = 0; ok && j < inner.size(); j++) ok = lim.charge();
+            if(!ok){
+                stopped = true;
+                break;
+            }
+            next++;
+            if(next - from == per_task){
+                ranges.push_back({from, next});
+                from = next;
+            }
+        }
+        if(next > from) ranges.push_back({from, next});
+
+        vector<JoinPart> parts(ranges.size());
+        long cap = lim.end();
+        if(ranges.size() == 1){
+            joinRange(t1, t2, outer.data(), ranges[0].first, ranges[0].second, inner,
+                      columns, col_count, rf1, rf2, order, sorting, cap, parts[0]);
+        }
+        else{
+            TaskGroup tg(db.pool);
+            for(size_t w = 0; w < ranges.size(); w++){
+                size_t a = ranges[w].first, b = ranges[w].second;
+                JoinPart* part = &parts[w];
+                tg.spawn([&, a, b, part]{
+                    joinRange(t1, t2, outer.data(), a, b, inner,
+                              columns, col_count, rf1, rf2, order, sorting, cap, *part);
+                });
+            }
+            tg.wait();
+        }
+        for(size_t w = 0; w < parts.size() && (sorting || !lim.done()); w++){
+            for(auto& r : parts[w].rows){
+                if(sorting){
+                    sorter.add(r.first, r.second);
+                    continue;
+                }
+                if(lim.done()) break;
+                if(lim.take()){
+                    out << r.second << "\n";
+                    data_found = true;
+                }
+            }
+        }
+    }
+    if(sorter.active()) data_found = sorter.finish(out);
+
+    if(!data_found){
+        out << "No data found after CROSS JOIN.\n";
+    }
+}
+
+
+// Агрегаты (COUNT, SUM, MIN, MAX, AVG) и GROUP BY
+
+enum AggFunc { AGG_NONE, AGG_COUNT, AGG_SUM, AGG_MIN, AGG_MAX, AGG_AVG };
+
+// Колонка результата: либо агрегат, либо колонка группировки
+struct AggColumn {
+    AggFunc func;
+    string arg;     // колонка-аргумент ("*" для COUNT(*))
+};
+
+// Состояние одного агрегата внутри группы
+struct AggState {
+    long long count;
+    long long numeric;  // сколько из count значений — числа (для SUM и AVG)
+    double sum;
+    long long ints;     // сколько из numeric — целые; пока все, сумма точная
+    __int128 int_sum;   // сумма int64 в int64 не помещается уже на двух строках
+    bool has_value;
+    string min_v, max_v;
+    AggState() : count(0), numeric(0), sum(0), ints(0), int_sum(0), has_value(false) {}
+};
+
+// Группа: значения колонок GROUP BY и состояния агрегатов
+struct AggGroup {
+    vector<string> keys;
+    vector<AggState> states;
+    long long rows;     // строк в группе (нужно представлениям, чтобы убирать опустевшие группы)
+    AggGroup() : rows(0) {}
+};
+
+typedef unordered_map<string, AggGroup> AggTable;
+
+// Разбор "SUM(age)" -> {AGG_SUM, "age"}; обычная колонка -> AGG_NONE
+AggColumn parseAggColumn(const string& col){
+    AggColumn ac;
+    ac.func = AGG_NONE;
+    ac.arg = col;
+    size_t lp = col.find('(');
+    if(lp == string::npos || col.back() != ')') return ac;
+    string fn = col.substr(0, lp);
+    for(size_t i = 0; i < fn.size(); i++) fn[i] = toupper(fn[i]);
+    if(fn == "COUNT")    ac.func = AGG_COUNT;
+    else if(fn == "SUM") ac.func = AGG_SUM;
+    else if(fn == "MIN") ac.func = AGG_MIN;
+    else if(fn == "MAX") ac.func = AGG_MAX;
+    else if(fn == "AVG") ac.func = AGG_AVG;
+    else return ac;
+    ac.arg = col.substr(lp + 1, col.size() - lp - 2);
+    return ac;
+}
+
+bool hasAggregates(const string* columns, int col_count){
+    for(int i = 0; i < col_count; i++){
+        if(parseAggColumn(columns[i]).func != AGG_NONE) return true;
+    }
+    return false;
+}
+
+// Число в SUM/AVG (dir = -1 — убираем его): целые складываем ещё и точно,
+// double теряет младшие разряды уже после 2^53
+void addAggNumber(AggState& st, const string& v, double d, int dir){
+    st.sum += dir * d;
+    st.numeric += dir;
+    int64_t i;
+    if(!parseInt64Exact(v, i)) return;
+    st.int_sum += dir * (__int128)i;
+    st.ints += dir;
+}
+
+void updateAggState(AggState& st, const AggColumn& ac, const json& e){
+    if(ac.func == AGG_COUNT && ac.arg == "*"){
+        st.count++;
+        return;
+    }
+    if(!e.contains(ac.arg)) return;
+    string v = e[ac.arg].get<string>();
+    if(v.empty() || v == "NULL") return;
+    st.count++;
+    double d;
+    if(parseNumber(v, d)) addAggNumber(st, v, d, 1);
+    if(!st.has_value || compareValues(v, st.min_v) < 0) st.min_v = v;
+    if(!st.has_value || compareValues(v, st.max_v) > 0) st.max_v = v;
+    st.has_value = true;
+}
+
+void mergeAggState(AggState& dst, const AggState& src){
+    dst.count += src.count;
+    dst.numeric += src.numeric;
+    dst.sum += src.sum;
+    dst.ints += src.ints;
+    dst.int_sum += src.int_sum;
+    if(src.has_value){
+        if(!dst.has_value || compareValues(src.min_v, dst.min_v) < 0) dst.min_v = src.min_v;
+        if(!dst.has_value || compareValues(src.max_v, dst.max_v) > 0) dst.max_v = src.max_v;
+        dst.has_value = true;
+    }
+}
+
+// Сумма одних целых печатается точно (если помещается в int64), иначе —
+// кратчайший double, который читается обратно без потерь
+string formatAggState(const AggState& st, AggFunc func){
+    bool exact = (st.ints == st.numeric);
+    switch(func){
+        case AGG_COUNT: return to_string(st.count);
+        case AGG_SUM:
+            if(st.numeric == 0) return "NULL";
+            if(exact && st.int_sum >= INT64_MIN && st.int_sum <= INT64_MAX) return to_string((long long)st.int_sum);
+            return formatDouble(exact ? (double)st.int_sum : st.sum);
+        case AGG_MIN:   return st.has_value ? st.min_v : "NULL";
+        case AGG_MAX:   return st.has_value ? st.max_v : "NULL";
+        case AGG_AVG:
+            if(st.numeric == 0) return "NULL";
+            return formatDouble((exact ? (double)st.int_sum : st.sum) / st.numeric);
+        default: return "";
+    }
+}
+
+// Частичная агрегация по отрезку строк [from, to) — выполняется в своём потоке
+// Строка вместе с таблицей (нужна для раскодирования словарных колонок)
+// Строка для агрегации: WHERE проверяется уже в потоке пула, по фильтру её таблицы
+struct ScanRow {
+    const RowFilter* filter;
+    const Node* tbl;
+    TableDataNode* row;
+};
+
+void aggregateRange(const ScanRow* rows, size_t from, size_t to,
+                    const AggColumn* aggs, int col_count,
+                    const string* group_cols, int group_count,
+                    AggTable& local)
+{
+    for(size_t i = from; i < to; i++){
+        if(!rows[i].filter->matches(rows[i].row)) continue;
+        json e = decodeRow(rows[i].tbl, rows[i].row);
+        string key;
+        vector<string> keys(group_count);
+        for(int g = 0; g < group_count; g++){
+            keys[g] = e.contains(group_cols[g]) ? e[group_cols[g]].get<string>() : "NULL";
+            key += keys[g];
+            key += '\x1f';
+        }
+        auto it = local.find(key);
+        if(it == local.end()){
+            AggGroup grp;
+            grp.keys = keys;
+            grp.states.resize(col_count);
+            it = local.emplace(key, grp).first;
+        }
+        for(int c = 0; c < col_count; c++){
+            if(aggs[c].func != AGG_NONE) updateAggState(it->second.states[c], aggs[c], e);
+        }
+    }
+}
+
+const size_t AGG_PARALLEL_MIN_ROWS = 4096;
+
+void writeAggResult(const string* columns, int col_count,
+                    const AggColumn* aggs,
+                    const string* group_cols, int group_count,
+                    const AggTable& result,
+                    const OrderBy& order,
+                    RowLimit& lim,
+                    ostream& out);
+
+// Разбор колонок результата; false — обычная колонка не из GROUP BY
+bool parseAggColumns(const string* columns, int col_count,
+                     const string* group_cols, int group_count,
+                     vector<AggColumn>& aggs, ostream& out)
+{
+    aggs.resize(col_count);
+    for(int c = 0; c < col_count; c++){
+        aggs[c] = parseAggColumn(columns[c]);
+        if(aggs[c].func == AGG_NONE){
+            bool grouped = false;
+            for(int g = 0; g < group_count; g++){
+                if(group_cols[g] == columns[c]) grouped = true;
+            }
+            if(!grouped){
+                out << "Error: column " << columns[c] << " must appear in GROUP BY.\n";
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Хеш-агрегация строк таблиц в result, при большом объёме — параллельно
+// по потокам. false — таблицы нет или кончился бюджет запроса
+bool collectAggregates(dbase& db,
+                       const AggColumn* aggs, int col_count,
+                       const string* tables, int tab_count,
+                       const string* group_cols, int group_count,
+                       const ConditionList& cond_list,
+                       const string& logical_op,
+                       RowLimit& lim,
+                       AggTable& result,
+                       ostream& out)
+{
+
+    // Собираем указатели на строки всех таблиц, чтобы делить их между потоками;
+    // блоки, отсечённые зон-картами, сразу пропускаем
+    ZoneFilter zf(cond_list, logical_op);
+    zf.addFullPass();
+    vector<Node*> nodes;
+    for(int t = 0; t < tab_count; t++){
+        Node* tbl = db.findNode(tables[t]);
+        if(!tbl){
+            out << "Table not found: " << tables[t] << "\n";
+            return false;
+        }
+        nodes.push_back(tbl);
+    }
+    // Указатели на строки живут до конца агрегации — таблицы держим до выхода
+    TableReadLock guard(nodes);
+    vector<RowFilter> filters(nodes.size());
+    vector<ScanRow> rows;
+    for(size_t t = 0; t < nodes.size(); t++){
+        Node* tbl = nodes[t];
+        if(bloomExcludes(tbl, cond_list, logical_op)) continue;
+        filters[t] = RowFilter(tbl, cond_list, logical_op);
+        BlockScan scan(zf);
+        for(TableDataNode* p = scan.start(tbl); p && lim.charge(); p = scan.next(p)){
+            ScanRow r = {&filters[t], tbl, p};
+            rows.push_back(r);
+        }
+    }
+    // Бюджет запроса кончился на сборе строк — неполный агрегат не выводим
+    if(lim.budget && lim.budget->exceeded) return false;
+
+    // Строки режем на куски по нескольку на поток пула: свободные потоки
+    // разбирают куски, а между ними пул успевает выполнять другие команды
+    size_t parts = 4 * max((size_t)1, db.pool.size());
+    if(rows.size() < AGG_PARALLEL_MIN_ROWS) parts = 1;
+
+    vector<AggTable> partial(parts);
+    size_t chunk = (rows.size() + parts - 1) / parts;
+    if(parts == 1){
+        aggregateRange(rows.data(), 0, rows.size(), aggs, col_count,
+                       group_cols, group_count, partial[0]);
+    }
+    else{
+        TaskGroup tg(db.pool);
+        for(size_t w = 0; w < parts; w++){
+            size_t from = w * chunk;
+            size_t to = min(rows.size(), from + chunk);
+            if(from >= to) break;
+            AggTable* out_part = &partial[w];
+            tg.spawn([&rows, from, to, aggs, col_count, group_cols, group_count, out_part]{
+                aggregateRange(rows.data(), from, to, aggs, col_count,
+                               group_cols, group_count, *out_part);
+            });
+        }
+        tg.wait();
+    }
+
+    // Сливаем частичные результаты
+    result.swap(partial[0]);
+    for(size_t w = 1; w < partial.size(); w++){
+        for(auto& kv : partial[w]){
+            auto it = result.find(kv.first);
+            if(it == result.end()){
+                result.emplace(kv.first, kv.second);
+                continue;
+            }
+            for(int c = 0; c < col_count; c++){
+                mergeAggState(it->second.states[c], kv.second.states[c]);
+            }
+        }
+    }
+    return true;
+}
+
+// SELECT с агрегатами
+void aggregateTables(dbase& db,
                      const string* columns, int col_count,
+                     const string* tables, int tab_count,
+                     const string* group_cols, int group_count,
                      const ConditionList& cond_list,
                      const string& logical_op,
-                     ostringstream& out)
+                     const OrderBy& order,
+                     RowLimit& lim,
+                     ostream& out)
+{
+    vector<AggColumn> aggs;
+    if(!parseAggColumns(columns, col_count, group_cols, group_count, aggs, out)) return;
+    AggTable result;
+    if(!collectAggregates(db, aggs.data(), col_count, tables, tab_count, group_cols, group_count,
+                          cond_list, logical_op, lim, result, out)) return;
+    // Без GROUP BY агрегат возвращает одну строку даже на пустой таблице
+    if(group_count == 0 && result.empty()){
+        AggGroup grp;
+        grp.states.resize(col_count);
+        result.emplace("", grp);
+    }
+    writeAggResult(columns, col_count, aggs.data(), group_cols, group_count, result, order, lim, out);
+}
+
+// Вывод готовых групп: заголовок, строки, ORDER BY и LIMIT
+void writeAggResult(const string* columns, int col_count,
+                    const AggColumn* aggs,
+                    const string* group_cols, int group_count,
+                    const AggTable& result,
+                    const OrderBy& order,
+                    RowLimit& lim,
+                    ostream& out)
+{
+    // Заголовок
+    for(int i = 0; i < col_count; i++){
+        if(i > 0) out << " ";
+        out << columns[i];
+    }
+    out << "\n";
+
+    RowSorter sorter(order, lim);
+    for(const auto& kv : result){
+        if(lim.done()) break;
+        if(!sorter.active() && !lim.take()) continue;
+        const AggGroup& grp = kv.second;
+        ostringstream row;
+        string key = "NULL";
+        for(int c = 0; c < col_count; c++){
+            if(c > 0) row << " ";
+            string v;
+            if(aggs[c].func == AGG_NONE){
+                for(int g = 0; g < group_count; g++){
+                    if(group_cols[g] == columns[c]){
+                        v = grp.keys[g];
+                        break;
+                    }
+                }
+            }
+            else{
+                v = formatAggState(grp.states[c], aggs[c].func);
+            }
+            if(columns[c] == order.column) key = v;
+            row << v;
+        }
+        if(sorter.active()) sorter.add(key, row.str());
+        else out << row.str() << "\n";
+    }
+    if(sorter.active()) sorter.finish(out);
+    if(result.empty()){
+        out << "No data found in the specified tables.\n";
+    }
+}
+
+
+// Отрезаем хвостовое предложение запроса ("GROUP BY ...") и возвращаем его текст.
+// Ключевое слово внутри кавычек ('a LIMIT b', "x ORDER BY y") — часть значения
+
+string cutTailClause(string& cmd, const string& keyword){
+    string needle = " " + keyword + " ";
+    size_t pos = string::npos;
+    char quote = 0;
+    for(size_t i = 0; i < cmd.size(); i++){
+        if(quote){
+            if(cmd[i] == quote) quote = 0;
+        }
+        else if(cmd[i] == '\'' || cmd[i] == '"'){
+            quote = cmd[i];
+        }
+        else if(cmd.compare(i, needle.size(), needle) == 0){
+            pos = i;
+            break;
+        }
+    }
+    if(pos == string::npos) return "";
+    string rest = cmd.substr(pos + keyword.size() + 2);
+    cmd = cmd.substr(0, pos);
+    while(!rest.empty() && (rest.front() == ' ' || rest.front() == '\t')) rest.erase(rest.begin());
+    while(!rest.empty() && (rest.back() == ' ' || rest.back() == '\t'))   rest.pop_back();
+    return rest;
+}
+
+
+// Разбор LIMIT/OFFSET; false — значение не является неотрицательным числом
+
+bool parseRowLimit(const string& limit_str, const string& offset_str, RowLimit& lim){
+    char* end = nullptr;
+    if(!limit_str.empty()){
+        lim.limit = strtol(limit_str.c_str(), &end, 10);
+        if(*end != '\0' || lim.limit < 0) return false;
+    }
+    if(!offset_str.empty()){
+        lim.offset = strtol(offset_str.c_str(), &end, 10);
+        if(*end != '\0' || lim.offset < 0) return false;
+    }
+    return true;
+}
+
+
+// Материализованные представления: CREATE MATERIALIZED VIEW <имя> AS SELECT ... FROM <таблица>
+// [WHERE ...] [GROUP BY ...]. Результат хранится готовым и поддерживается из insertRecord
+// и deleteRow, поэтому чтение представления — O(результата), а не O(таблицы)
+
+// Строка представления-фильтра; порядок списка — порядок строк в таблице.
+// В e — только колонки представления
+struct ViewRow {
+    TableDataNode* src;
+    json e;
+    ViewRow* prev;
+    ViewRow* next;
+    ViewRow() : src(nullptr), prev(nullptr), next(nullptr) {}
+};
+
+struct MatView {
+    string name;
+    string query;               // текст SELECT из определения
+    Node* tbl;                  // базовая таблица
+    MatView* next;              // следующее представление той же таблицы
+    mutex m;
+    bool dirty;                 // результат нужно собрать заново при следующем чтении
+
+    ConditionList cond_list;
+    string logical_op;
+    RowFilter filter;           // WHERE определения над строками tbl
+    vector<string> columns;
+    vector<AggColumn> aggs;
+    vector<string> group_cols;
+    bool aggregate;
+    bool all_columns;           // SELECT * — строки хранятся целиком
+
+    AggTable groups;            // агрегатное представление
+    ViewRow* head;              // представление-фильтр
+    ViewRow* tail;
+    unordered_map<TableDataNode*, ViewRow*> by_row;
+
+    MatView() : tbl(nullptr), next(nullptr), dirty(true), aggregate(false), all_columns(false), head(nullptr), tail(nullptr) {}
+    ~MatView() { clear(); }
+
+    void clear(){
+        while(head){
+            ViewRow* r = head;
+            head = head->next;
+            delete r;
+        }
+        tail = nullptr;
+        by_row.clear();
+        groups.clear();
+    }
+
+    bool hasColumn(const string& column) const {
+        return all_columns || find(columns.begin(), columns.end(), column) != columns.end();
+    }
+
+    string groupKey(const json& e, vector<string>& keys) const {
+        string key;
+        keys.resize(group_cols.size());
+        for(size_t g = 0; g < group_cols.size(); g++){
+            keys[g] = e.contains(group_cols[g]) ? e[group_cols[g]].get<string>() : "NULL";
+            key += keys[g];
+            key += '\x1f';
+        }
+        return key;
+    }
+
+    // Новая строка таблицы; at_front — как INSERT (новые строки в начале списка)
+    void add(TableDataNode* p, const json& e, bool at_front){
+        if(!filter.matches(p)) return;
+        if(aggregate){
+            vector<string> keys;
+            string key = groupKey(e, keys);
+            auto it = groups.find(key);
+            if(it == groups.end()){
+                AggGroup grp;
+                grp.keys = keys;
+                grp.states.resize(columns.size());
+                it = groups.emplace(key, grp).first;
+            }
+            it->second.rows++;
+            for(size_t c = 0; c < aggs.size(); c++){
+                if(aggs[c].func != AGG_NONE) updateAggState(it->second.states[c], aggs[c], e);
+            }
+            return;
+        }
+        ViewRow* r = new ViewRow;
+        r->src = p;
+        if(all_columns) r->e = e;
+        else{
+            for(const string& c : columns){
+                if(e.contains(c)) r->e[c] = e[c];
+            }
+        }
+        if(at_front){
+            r->next = head;
+            if(head) head->prev = r; else tail = r;
+            head = r;
+        }
+        else{
+            r->prev = tail;
+            if(tail) tail->next = r; else head = r;
+            tail = r;
+        }
+        by_row[p] = r;
+    }
+
+    // Строка удаляется из таблицы. MIN/MAX по удалённому крайнему значению
+    // вычесть нельзя — тогда представление пересобирается при следующем чтении
+    void remove(TableDataNode* p, const json& e){
+        if(!aggregate){
+            auto it = by_row.find(p);
+            if(it == by_row.end()) return;
+            ViewRow* r = it->second;
+            if(r->prev) r->prev->next = r->next; else head = r->next;
+            if(r->next) r->next->prev = r->prev; else tail = r->prev;
+            by_row.erase(it);
+            delete r;
+            return;
+        }
+        if(!filter.matches(p)) return;
+        vector<string> keys;
+        auto it = groups.find(groupKey(e, keys));
+        if(it == groups.end()) return;
+        AggGroup& grp = it->second;
+        for(size_t c = 0; c < aggs.size(); c++){
+            const AggColumn& ac = aggs[c];
+            if(ac.func == AGG_NONE) continue;
+            AggState& st = grp.states[c];
+            if(ac.func == AGG_COUNT && ac.arg == "*"){
+                st.count--;
+                continue;
+            }
+            if(!e.contains(ac.arg)) continue;
+            string v = e[ac.arg].get<string>();
+            if(v.empty() || v == "NULL") continue;
+            st.count--;
+            double d;
+            if(parseNumber(v, d)) addAggNumber(st, v, d, -1);
+            if(st.count == 0){
+                st.has_value = false;
+                st.numeric = 0;
+                st.sum = 0;
+                st.ints = 0;
+                st.int_sum = 0;
+                st.min_v.clear();
+                st.max_v.clear();
+            }
+            else if((ac.func == AGG_MIN && compareValues(v, st.min_v) == 0) ||
+                    (ac.func == AGG_MAX && compareValues(v, st.max_v) == 0)){
+                dirty = true;
+            }
+        }
+        // Опустевшая группа пропадает из результата (кроме агрегата без GROUP BY)
+        if(--grp.rows == 0 && !group_cols.empty()) groups.erase(it);
+    }
+
+    // Полная сборка по текущим строкам таблицы
+    void rebuild(){
+        clear();
+        for(TableDataNode* p = tbl->data; p; p = p->next){
+            add(p, decodeRow(tbl, p), false);
+        }
+        if(aggregate && group_cols.empty() && groups.empty()){
+            AggGroup grp;
+            grp.states.resize(columns.size());
+            groups.emplace("", grp);
+        }
+        dirty = false;
+    }
+};
+
+MatView* findView(dbase& db, const string& name){
+    for(Node* tbl = db.head; tbl; tbl = tbl->next){
+        shared_lock<shared_mutex> guard(tbl->rw);
+        for(MatView* v = tbl->views; v; v = v->next){
+            if(v->name == name) return v;
+        }
+    }
+    return nullptr;
+}
+
+void freeViews(Node* tbl){
+    while(tbl->views){
+        MatView* v = tbl->views;
+        tbl->views = v->next;
+        delete v;
+    }
+}
+
+// Вызовы из insertRecord и deleteRow: строка уже в таблице / ещё в таблице
+void viewsInsertRow(Node* tbl, TableDataNode* p){
+    if(!tbl->views) return;
+    json e = decodeRow(tbl, p);
+    for(MatView* v = tbl->views; v; v = v->next){
+        lock_guard<mutex> guard(v->m);
+        if(!v->dirty) v->add(p, e, true);
+    }
+}
+
+void viewsDeleteRow(Node* tbl, TableDataNode* p, const json& e){
+    for(MatView* v = tbl->views; v; v = v->next){
+        lock_guard<mutex> guard(v->m);
+        if(!v->dirty) v->remove(p, e);
+    }
+}
+
+// Разбор определения. Представление строится лениво, при первом чтении:
+// так представления из schema.json не заставляют читать таблицу при старте
+bool createView(dbase& db, const string& name, const string& query, string& err){
+    if(findView(db, name) || db.findNode(name)){
+        err = "Name already in use: " + name;
+        return false;
+    }
+    string cmd = query;
+    if(!cutTailClause(cmd, "OFFSET").empty() || !cutTailClause(cmd, "LIMIT").empty() ||
+       !cutTailClause(cmd, "ORDER BY").empty()){
+        err = "ORDER BY and LIMIT belong to the query that reads the view";
+        return false;
+    }
+    string group_str = cutTailClause(cmd, "GROUP BY");
+    size_t select_pos = cmd.find("SELECT");
+    size_t from_pos = cmd.find("FROM");
+    size_t where_pos = cmd.find("WHERE");
+    if(select_pos == string::npos || from_pos == string::npos || from_pos < select_pos ||
+       cmd.find("CROSS JOIN") != string::npos){
+        err = "View must be SELECT <columns> FROM <table> [WHERE ...] [GROUP BY ...]";
+        return false;
+    }
+    MatView* v = new MatView;
+    v->name = name;
+    v->query = query;
+    istringstream ciss(cmd.substr(select_pos + 6, from_pos - (select_pos + 6)));
+    string col;
+    while(ciss >> col) v->columns.push_back(col);
+    istringstream giss(group_str);
+    while(giss >> col) v->group_cols.push_back(col);
+    string tables_str = (where_pos != string::npos) ? cmd.substr(from_pos + 4, where_pos - (from_pos + 4))
+                                                    : cmd.substr(from_pos + 4);
+    istringstream tiss(tables_str);
+    string table, extra;
+    tiss >> table >> extra;
+    if(where_pos != string::npos) parseWhereClause(cmd.substr(where_pos + 5), v->cond_list, v->logical_op);
+    for(size_t c = 0; c < v->columns.size(); c++) v->aggs.push_back(parseAggColumn(v->columns[c]));
+    v->aggregate = !v->group_cols.empty() || hasAggregates(v->columns.data(), v->columns.size());
+    v->all_columns = find(v->columns.begin(), v->columns.end(), "*") != v->columns.end();
+    if(v->columns.empty() || table.empty() || !extra.empty()){
+        err = "View must read exactly one table and at least one column";
+    }
+    for(size_t c = 0; err.empty() && v->aggregate && c < v->columns.size(); c++){
+        if(v->aggs[c].func == AGG_NONE &&
+           find(v->group_cols.begin(), v->group_cols.end(), v->columns[c]) == v->group_cols.end()){
+            err = "Column " + v->columns[c] + " must appear in GROUP BY";
+        }
+    }
+    Node* tbl = err.empty() ? db.findNode(table) : nullptr;
+    if(err.empty() && !tbl) err = "Table not found: " + table;
+    if(!err.empty()){
+        delete v;
+        return false;
+    }
+    lock_guard<shared_mutex> guard(tbl->rw);
+    v->tbl = tbl;
+    v->filter = RowFilter(tbl, v->cond_list, v->logical_op);
+    v->next = tbl->views;
+    tbl->views = v;
+    return true;
+}
+
+// CREATE MATERIALIZED VIEW: представление создаётся, попадает в журнал
+// репликации и дописывается в раздел "views" schema.json — после перезапуска
+// оно объявлено так же, как заданные там вручную. Реплика файлов не трогает:
+// представления ведущего она получает вместе со снимком
+bool defineView(dbase& db, const string& name, const string& query, string& err){
+    if(!createView(db, name, query, err)) return false;
+    lock_guard<mutex> guard(db.repl.m);
+    db.repl.append("VIEW " + name + " " + query);
+    if(!db.read_only && !db.schema_file.empty()){
+        db.schema["views"][name] = query;
+        disk_io.replace(db.schema_file, db.schema.dump(4) + "\n");
+    }
+    return true;
+}
+
+// Читателю доступны только колонки из определения: у агрегатного
+// представления — * или ровно его список, у фильтра — любые из объявленных
+// (и сортировка по ним). false — ошибка уже в out
+bool checkViewColumns(const MatView* v, const string* columns, int col_count,
+                      const string& order_column, ostream& out)
+{
+    if(v->aggregate){
+        bool same = ((size_t)col_count == v->columns.size());
+        for(int c = 0; same && c < col_count; c++) same = (columns[c] == v->columns[c]);
+        if(!same && !(col_count == 1 && columns[0] == "*")){
+            out << "Error: select * or the view's own columns from " << v->name << ".\n";
+            return false;
+        }
+        return true;
+    }
+    for(int c = 0; c <= col_count; c++){
+        const string& col = (c < col_count) ? columns[c] : order_column;
+        if(col.empty() || col == "*" || v->hasColumn(col)) continue;
+        out << "Error: column " << col << " is not in view " << v->name << ".\n";
+        return false;
+    }
+    return true;
+}
+
+// Результат чтения представления: проекция, ORDER BY и LIMIT поверх
+// готового результата. Вызывается под блокировкой представления
+void writeViewResult(MatView* v,
+                     const string* columns, int col_count,
+                     const OrderBy& order,
+                     RowLimit& lim,
+                     ostream& out)
+{
+    if(!checkViewColumns(v, columns, col_count, order.column, out)) return;
+    if(v->aggregate){
+        writeAggResult(v->columns.data(), v->columns.size(), v->aggs.data(),
+                       v->group_cols.data(), v->group_cols.size(), v->groups, order, lim, out);
+        return;
+    }
+    for(int i = 0; i < col_count; i++){
+        if(i > 0) out << " ";
+        out << columns[i];
+    }
+    out << "\n";
+    bool data_found = false;
+    RowSorter sorter(order, lim);
+    for(ViewRow* r = v->head; r && !lim.done(); r = r->next){
+        if(sorter.active()){
+            ostringstream row;
+            formatRow(row, r->e, columns, col_count);
+            sorter.add(sortKey(r->e, order), row.str());
+        }
+        else if(lim.take()){
+            data_found = true;
+            formatRow(out, r->e, columns, col_count);
+            out << "\n";
+        }
+    }
+    if(sorter.active()) data_found = sorter.finish(out);
+    if(!data_found){
+        out << "No data found in " << v->name << ".\n";
+    }
+}
+
+// SELECT из представления. Результат собирается под блокировками, а клиенту
+// уходит уже без них: INSERT и DELETE по таблице обновляют представление под
+// той же блокировкой и не должны ждать медленного читателя
+void selectFromView(dbase& db, MatView* v,
+                    const string* columns, int col_count,
+                    const OrderBy& order,
+                    RowLimit& lim,
+                    ostream& out)
 {
+    db.findNode(v->tbl->name);
+    ostringstream res;
+    {
+        shared_lock<shared_mutex> tbl_guard(v->tbl->rw);
+        lock_guard<mutex> guard(v->m);
+        if(v->dirty) v->rebuild();
+        writeViewResult(v, columns, col_count, order, lim, res);
+    }
+    out << res.str();
+}
+
+
+// Буфер ответа соединения. Запрос пишет результат в поток поверх буфера,
+// буфер уходит в сокет через sendmsg с несколькими кусками за вызов (как writev).
+// Сокет неблокирующий, и поток пула на нём не ждёт: выше верхней отметки
+// запрос лишь пробует отправить то, что сокет примет сразу, а остаток ответа
+// пишет в безымянный временный файл. Недописанное (память, затем файл)
+// дописывает реактор соединения, когда сокет готов к записи (EPOLLOUT),
+// так что большой результат не копится в памяти и не держит поток пула
+
+const size_t OUT_CHUNK = 64 * 1024;
+const size_t OUT_HIGH_WATER = 1024 * 1024;
+const size_t OUT_LOW_WATER = 256 * 1024;
+const int OUT_MAX_IOV = 64;
+const int OUT_STALL_MS = 30000;     // столько ждём клиента, который не читает ответ
+
+struct ResponseWriter : public streambuf {
+    int fd;
+    deque<string> chunks;
+    size_t head_off;        // сколько байт первого куска уже отправлено
+    size_t pending;         // не отправлено всего: куски в памяти и хвост файла
+    int spill_fd;           // временный файл с продолжением ответа; -1 — нет
+    size_t spill_read;      // сколько байт файла уже перенесено в куски
+    size_t spill_size;
+    size_t spill_tried;     // spill_size при последней попытке отправить из put
+    bool failed;            // клиент ушёл или не читает — дальше ответ отбрасывается
+    bool capturing;         // копия ответа для кэша результатов
+    size_t capture_limit;
+    string captured;
+
+    ResponseWriter(int f) : fd(f), head_off(0), pending(0), spill_fd(-1), spill_read(0), spill_size(0), spill_tried(0),
+                            failed(false), capturing(false), capture_limit(0) {}
+    ~ResponseWriter(){ closeSpill(); }
+
+    void put(const char* s, size_t n){
+        if(capturing){
+            if(captured.size() + n > capture_limit){
+                capturing = false;
+                captured.clear();
+            }
+            else captured.append(s, n);
+        }
+        if(failed || n == 0) return;
+        // Выше верхней отметки — отправляем, сколько сокет примет без ожидания,
+        // а если он занят, продолжаем ответ во временном файле
+        if(spill_fd < 0 && pending + n > OUT_HIGH_WATER){
+            if(sendPending(OUT_LOW_WATER) < 0) return;
+            if(pending + n > OUT_HIGH_WATER) openSpill();
+        }
+        if(spill_fd >= 0){
+            if(pwriteAll(spill_fd, s, n, spill_size)){
+                spill_size += n;
+                pending += n;
+                // Клиент мог уже забрать часть — пробуем раз на кусок, не на каждую запись
+                if(spill_size - spill_tried >= OUT_CHUNK){
+                    spill_tried = spill_size;
+                    sendPending(OUT_LOW_WATER);
+                }
+                return;
+            }
+            cerr << "Response spill write failed, keeping the response in memory" << endl;
+            closeSpill();
+        }
+        pending += n;
+        while(n > 0){
+            if(chunks.empty() || chunks.back().size() >= OUT_CHUNK){
+                chunks.push_back(string());
+                chunks.back().reserve(OUT_CHUNK);
+            }
+            string& last = chunks.back();
+            size_t k = min(n, OUT_CHUNK - last.size());
+            last.append(s, k);
+            s += k;
+            n -= k;
+        }
+    }
+    void put(const string& s){ put(s.data(), s.size()); }
+
+    // Отправляем, пока в буфере больше target байт: 1 — отправлено,
+    // 0 — сокет пока не принимает, -1 — соединение потеряно
+    int sendPending(size_t target = 0){
+        while(!failed && pending > target){
+            if(chunks.empty() && !loadSpill()){
+                fail();
+                break;
+            }
+            iovec iov[OUT_MAX_IOV];
+            int cnt = 0;
+            for(size_t i = 0; i < chunks.size() && cnt < OUT_MAX_IOV; i++, cnt++){
+                size_t off = (i == 0) ? head_off : 0;
+                iov[cnt].iov_base = (void*)(chunks[i].data() + off);
+                iov[cnt].iov_len = chunks[i].size() - off;
+            }
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = cnt;
+            // MSG_NOSIGNAL: закрытый клиентом сокет — ошибка EPIPE, а не SIGPIPE на весь сервер
+            ssize_t w = sendmsg(fd, &msg, MSG_NOSIGNAL);
+            if(w > 0){
+                consume(w);
+                continue;
+            }
+            if(w < 0 && errno == EINTR) continue;
+            if(w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+            fail();
+        }
+        return failed ? -1 : 1;
+    }
+
+    // То же с ожиданием сокета на месте — для потоков, которые сами владеют
+    // соединением (реплика); команды из пула так не ждут
+    bool flush(size_t target = 0){
+        int st;
+        while((st = sendPending(target)) == 0){
+            pollfd pfd = {fd, POLLOUT, 0};
+            int r = poll(&pfd, 1, OUT_STALL_MS);
+            if(r == 0 || (r < 0 && errno != EINTR)) fail();
+        }
+        return st > 0;
+    }
+
+    void startCapture(size_t limit){
+        captured.clear();
+        capture_limit = limit;
+        capturing = (limit > 0);
+    }
+    // false — ответ не поместился в лимит
+    bool endCapture(string& out){
+        bool ok = capturing;
+        capturing = false;
+        out.swap(captured);
+        captured.clear();
+        return ok;
+    }
+
+    // Клиент ушёл или не читает: ответ дальше отбрасывается
+    void fail(){
+        failed = true;
+        chunks.clear();
+        pending = 0;
+        head_off = 0;
+        closeSpill();
+    }
+
+protected:
+    int_type overflow(int_type ch) override {
+        if(ch != traits_type::eof()){
+            char c = (char)ch;
+            put(&c, 1);
+        }
+        return traits_type::not_eof(ch);
+    }
+    streamsize xsputn(const char* s, streamsize n) override {
+        put(s, n);
+        return n;
+    }
+
+private:
+    // Временный файл в $TMPDIR, удаляется сразу: пропадёт и при падении сервера.
+    // Не удалось создать — ответ остаётся в памяти
+    void openSpill(){
+        string tmpl = sortTempDir() + "/response_XXXXXX";
+        vector<char> path(tmpl.begin(), tmpl.end());
+        path.push_back('\0');
+        spill_fd = mkstemp(path.data());
+        if(spill_fd < 0){
+            cerr << "Failed to create response spill in " << sortTempDir() << endl;
+            return;
+        }
+        unlink(path.data());
+        spill_read = spill_size = spill_tried = 0;
+    }
+    void closeSpill(){
+        if(spill_fd >= 0) close(spill_fd);
+        spill_fd = -1;
+        spill_read = spill_size = spill_tried = 0;
+    }
+    // Следующий кусок файла — в очередь на отправку; false — файл не читается
+    bool loadSpill(){
+        if(spill_fd < 0 || spill_read >= spill_size) return false;
+        string chunk(min(OUT_CHUNK, spill_size - spill_read), '\0');
+        ssize_t r = pread(spill_fd, &chunk[0], chunk.size(), spill_read);
+        if(r <= 0) return false;
+        chunk.resize(r);
+        spill_read += r;
+        chunks.push_back(move(chunk));
+        // Файл прочитан — дальше ответ снова копится в памяти
+        if(spill_read == spill_size) closeSpill();
+        return true;
+    }
+    void consume(size_t w){
+        pending -= w;
+        while(w > 0){
+            size_t left = chunks.front().size() - head_off;
+            if(w < left){
+                head_off += w;
+                return;
+            }
+            w -= left;
+            chunks.pop_front();
+            head_off = 0;
+        }
+    }
+};
+
+
+// Шард кластера. Маршрутизатор шлёт "SHARD <команда>", ответ заканчивается
+// нулевым байтом (в данных его быть не может: команды читаются как C-строки).
+// Кроме обычных команд шард понимает:
+//   SCAN <table> [WHERE ...] [ORDER BY <column> [DESC]] [LIMIT n] — подходящие строки, по JSON в строке
+//   AGG SELECT ... [WHERE ...] [GROUP BY ...] — частичные агрегаты по группам
+
+// Части SELECT <columns> FROM <tables> [CROSS JOIN <table>] [WHERE ...] [GROUP BY ...];
+// ORDER BY и LIMIT к этому времени уже отрезаны
+struct SelectParts {
+    vector<string> columns;
+    vector<string> tables;
+    vector<string> group_cols;
+    string where;       // текст после WHERE
+    bool cross;
+    SelectParts() : cross(false) {}
+};
+
+bool splitSelect(string cmd, SelectParts& q){
+    string word;
+    istringstream giss(cutTailClause(cmd, "GROUP BY"));
+    while(giss >> word) q.group_cols.push_back(word);
+    size_t select_pos = cmd.find("SELECT");
+    size_t from_pos = cmd.find("FROM");
+    size_t where_pos = cmd.find("WHERE");
+    if(select_pos == string::npos || from_pos == string::npos || from_pos < select_pos) return false;
+    istringstream ciss(cmd.substr(select_pos + 6, from_pos - (select_pos + 6)));
+    while(ciss >> word) q.columns.push_back(word);
+    string from;
+    if(where_pos != string::npos){
+        from = cmd.substr(from_pos + 4, where_pos - (from_pos + 4));
+        q.where = cmd.substr(where_pos + 5);
+        while(!q.where.empty() && (q.where.front() == ' ' || q.where.front() == '\t')) q.where.erase(q.where.begin());
+    }
+    else{
+        from = cmd.substr(from_pos + 4);
+    }
+    size_t cj = from.find("CROSS JOIN");
+    if(cj != string::npos){
+        q.cross = true;
+        from.replace(cj, 10, " ");
+    }
+    istringstream tiss(from);
+    while(tiss >> word) q.tables.push_back(word);
+    return !q.columns.empty() && !q.tables.empty();
+}
+
+// SCAN: строки уходят в ответ сразу, по ходу обхода списка таблицы (новые
+// первыми; LIMIT без ORDER BY берёт последние вставленные). С ORDER BY — в
+// порядке сортировки: маршрутизатор сливает такие ответы шардов, не
+// досортировывая. Бюджет запроса кончился — после уже отправленных строк ошибка
+void shardScan(dbase& db, string req, ResponseWriter& conn){
+    ostream out(&conn);
+    string limit_str = cutTailClause(req, "LIMIT");
+    OrderBy order;
+    {
+        istringstream oiss(cutTailClause(req, "ORDER BY"));
+        string dir;
+        oiss >> order.column >> dir;
+        order.desc = (dir == "DESC");
+    }
+    string table;
+    istringstream(req) >> table;
+    ConditionList cond_list;
+    string logical_op;
+    size_t where_pos = req.find(" WHERE ");
+    if(where_pos != string::npos) parseWhereClause(req.substr(where_pos + 7), cond_list, logical_op);
+    RowLimit lim;
+    QueryBudget budget(db.limits.max_rows_scanned, db.limits.query_timeout_ms, db.limits.sort_memory);
+    lim.budget = &budget;
+    if(!parseRowLimit(limit_str, "", lim)){
+        out << "Error: invalid LIMIT/OFFSET value.\n";
+        return;
+    }
     Node* tbl = db.findNode(table);
     if(!tbl){
-        out << "Table not found: " << table << "\n";
+        out << "Error: Table not found: " << table << "\n";
+        return;
+    }
+    shared_lock<shared_mutex> guard(tbl->rw);
+    RowFilter rf(tbl, cond_list, logical_op);
+    RowSorter sorter(order, lim);
+    if(!bloomExcludes(tbl, cond_list, logical_op)){
+        for(TableDataNode* p = tbl->data; p && !lim.done() && lim.charge(); p = p->next){
+            if(!rf.matches(p)) continue;
+            json e = decodeRow(tbl, p);
+            if(sorter.active()) sorter.add(sortKey(e, order), e.dump());
+            else if(lim.take()) out << e.dump() << "\n";
+        }
+    }
+    if(budget.exceeded){
+        out << "Error: query stopped: " << budget.exceeded << ".\n";
+        return;
+    }
+    if(sorter.active()) sorter.finish(out);
+}
+
+// AGG: по группе строка {"k": [ключи], "s": [[count, sum, has_value, min, max, numeric, ints, int_sum_hi, int_sum_lo], ...]}
+void shardAggregate(dbase& db, const string& req, ResponseWriter& conn){
+    ostream out(&conn);
+    SelectParts q;
+    if(!splitSelect(req, q)){
+        out << "Error: Invalid SELECT syntax.\n";
+        return;
+    }
+    ConditionList cond_list;
+    string logical_op;
+    if(!q.where.empty()) parseWhereClause(q.where, cond_list, logical_op);
+    vector<AggColumn> aggs;
+    if(!parseAggColumns(q.columns.data(), q.columns.size(), q.group_cols.data(), q.group_cols.size(), aggs, out)) return;
+    RowLimit lim;
+    QueryBudget budget(db.limits.max_rows_scanned, db.limits.query_timeout_ms, db.limits.sort_memory);
+    lim.budget = &budget;
+    AggTable result;
+    if(!collectAggregates(db, aggs.data(), q.columns.size(), q.tables.data(), q.tables.size(),
+                          q.group_cols.data(), q.group_cols.size(), cond_list, logical_op, lim, result, out)){
+        if(budget.exceeded) out << "Error: query stopped: " << budget.exceeded << ".\n";
+        return;
+    }
+    for(const auto& kv : result){
+        json g;
+        g["k"] = kv.second.keys;
+        json states = json::array();
+        for(const AggState& st : kv.second.states){
+            // Точная сумма — двумя половинами по 64 бита
+            states.push_back(json::array({st.count, st.sum, st.has_value, st.min_v, st.max_v, st.numeric,
+                                          st.ints, (int64_t)(st.int_sum >> 64), (uint64_t)st.int_sum}));
+        }
+        g["s"] = states;
+        out << g.dump() << "\n";
+    }
+}
+
+
+// Обработка клиента
+
+// Версии таблиц запроса до его выполнения; false — какой-то таблицы нет
+bool tableVersions(dbase& db, const string* tables, int tab_count, vector<pair<Node*, uint64_t>>& deps){
+    deps.clear();
+    for(int i = 0; i < tab_count; i++){
+        Node* tbl = db.findNode(tables[i]);
+        if(!tbl) return false;
+        deps.push_back(make_pair(tbl, tbl->version.load(memory_order_acquire)));
+    }
+    return true;
+}
+
+// Одна команда клиента; ответ пишется в conn. Выполняется в пуле команд
+void executeCommand(dbase& db, string cmd, ResponseWriter& conn){
+    istringstream iss(cmd);
+    string action;
+    iss >> action;
+    for(size_t i = 0; i < action.size(); i++){
+        action[i] = toupper(action[i]);
+    }
+
+    // Команда маршрутизатора; конец ответа — нулевой байт
+    if(action == "SHARD"){
+        size_t p = cmd.find_first_not_of(" \t") + 5;
+        while(p < cmd.size() && (cmd[p] == ' ' || cmd[p] == '\t')) p++;
+        string req = cmd.substr(min(p, cmd.size()));
+        string sub;
+        istringstream(req) >> sub;
+        for(size_t i = 0; i < sub.size(); i++) sub[i] = toupper(sub[i]);
+        if(sub == "SCAN") shardScan(db, req.substr(4), conn);
+        else if(sub == "AGG") shardAggregate(db, req.substr(3), conn);
+        else executeCommand(db, req, conn);
+        conn.put("\0", 1);
         return;
     }
-    // Заголовок
-    for(int i = 0; i < col_count; i++){
-        if(i > 0) out << " ";
-        out << columns[i];
+    // Данные реплики меняет только журнал ведущего сервера
+    if(db.read_only && (action == "INSERT" || action == "DELETE")){
+        string e = "Error: read-only replica.\n";
+        conn.put(e);
+        return;
     }
-    out << "\n";
 
-    bool data_found = false;
-    TableDataNode* p = tbl->data;
-    while(p){
-        json e = json::parse(p->record_str);
-        if(checkAllConditions(e, cond_list, logical_op)){
-            data_found = true;
-            for(int c = 0; c < col_count; c++){
-                if(c > 0) out << " ";
-                if(columns[c] == "*"){
-                    bool first = true;
-                    for(auto it = e.begin(); it != e.end(); ++it){
-                        if(!first) out << " ";
-                        out << it.key() << "=" << it.value().get<string>();
-                        first = false;
-                    }
-                    break;
+    if(action == "INSERT"){
+        // INSERT <table> <значения колонок в порядке схемы>
+        string table;
+        iss >> table;
+        Node* tbl = db.findNode(table);
+        if(!tbl){
+            string e = "Error: Table not found: " + table + "\n";
+            conn.put(e);
+            return;
+        }
+        vector<string> args;
+        string tmp;
+        while(iss >> tmp){
+            // remove quotes
+            if(!tmp.empty() && tmp.front() == '"' && tmp.back() == '"'){
+                tmp = tmp.substr(1, tmp.size()-2);
+            }
+            args.push_back(tmp);
+        }
+        if(args.size() < min((size_t)2, tbl->cols.size())){
+            string e = "Error: Not enough args for INSERT.\n";
+            conn.put(e);
+            return;
+        }
+        if(args.size() > tbl->cols.size()){
+            string e = "Error: Too many args for INSERT (" + table + " has " + to_string(tbl->cols.size()) + " columns).\n";
+            conn.put(e);
+            return;
+        }
+        // Недостающие строковые колонки — пустые, остальные — NULL
+        json entry;
+        for(size_t c = 0; c < tbl->cols.size(); c++){
+            if(c < args.size()) entry[tbl->cols[c].name] = args[c];
+            else if(tbl->cols[c].type == COL_STRING) entry[tbl->cols[c].name] = "";
+        }
+        // Отладочное сообщение
+        cout << "INSERT command: table=" << table << ", " << entry.dump() << endl;
+        string err;
+        string reply = insertRecord(db, table, entry, err) ? "Data inserted.\n" : "Error: " + err + "\n";
+        conn.put(reply);
+    }
+    else if(action == "CREATE"){
+        // CREATE INDEX ON <table> <column> | CREATE BLOOM ON <table> <column>
+        // CREATE MATERIALIZED VIEW <name> AS SELECT ...
+        string index_word, on_word, table, col;
+        iss >> index_word >> on_word >> table >> col;
+        for(size_t i = 0; i < index_word.size(); i++) index_word[i] = toupper(index_word[i]);
+        for(size_t i = 0; i < on_word.size(); i++) on_word[i] = toupper(on_word[i]);
+        if(index_word == "MATERIALIZED"){
+            // table — имя представления, col — "AS", дальше определение
+            for(size_t i = 0; i < col.size(); i++) col[i] = toupper(col[i]);
+            size_t sel = cmd.find("SELECT");
+            string err;
+            string reply;
+            if(on_word != "VIEW" || col != "AS" || sel == string::npos){
+                reply = "Error: invalid CREATE MATERIALIZED VIEW syntax.\n";
+            }
+            else if(db.read_only){
+                // Представления реплики приходят от ведущего сервера
+                reply = "Error: read-only replica.\n";
+            }
+            else{
+                reply = defineView(db, table, cmd.substr(sel), err) ? "View created.\n" : "Error: " + err + "\n";
+            }
+            conn.put(reply);
+            return;
+        }
+        if((index_word != "INDEX" && index_word != "BLOOM") || on_word != "ON" || col.empty()){
+            string e = "Error: invalid CREATE syntax.\n";
+            conn.put(e);
+            return;
+        }
+        string err;
+        string reply;
+        if(index_word == "INDEX"){
+            reply = createIndex(db, table, col, err) ? "Index created.\n" : "Error: " + err + "\n";
+        }
+        else{
+            reply = createBloom(db, table, col, err) ? "Bloom filter created.\n" : "Error: " + err + "\n";
+        }
+        conn.put(reply);
+    }
+    else if(action == "DELETE"){
+        // DELETE FROM <table> <column> <value>
+        string from_word, table, col, val;
+        iss >> from_word >> table >> col >> val;
+        // Приводим 'FROM' к верхнему регистру
+        for(size_t i = 0; i < from_word.size(); i++){
+            from_word[i] = toupper(from_word[i]);
+        }
+        if(from_word != "FROM"){
+            string e = "Error: invalid DELETE syntax.\n";
+            conn.put(e);
+            return;
+        }
+        // Отладочное сообщение
+        cout << "DELETE command: table=" << table << ", column=" << col 
+             << ", value=" << val << endl;
+        string err;
+        string reply = deleteRow(db, col, val, table, err) ? "Row deleted.\n" : "Error: " + err + "\n";
+        conn.put(reply);
+    }
+    else if(action == "SELECT"){
+        // SELECT <columns> FROM <tables> [CROSS JOIN <table>] [WHERE ...] [GROUP BY <columns>]
+        //        [ORDER BY <column> [ASC|DESC]] [LIMIT n [OFFSET m]]
+        // Тот же запрос при неизменных таблицах — ответ из кэша, без сканирования
+        string cache_key = QueryCache::normalize(cmd);
+        string cached;
+        if(db.cache.get(cache_key, cached)){
+            conn.put(cached);
+            return;
+        }
+        vector<pair<Node*, uint64_t>> deps;
+        // Хвостовые предложения отрезаем с конца
+        string offset_str = cutTailClause(cmd, "OFFSET");
+        string limit_str = cutTailClause(cmd, "LIMIT");
+        string order_str = cutTailClause(cmd, "ORDER BY");
+        string group_str = cutTailClause(cmd, "GROUP BY");
+        OrderBy order;
+        {
+            istringstream oiss(order_str);
+            string dir;
+            oiss >> order.column >> dir;
+            for(size_t i = 0; i < dir.size(); i++) dir[i] = toupper(dir[i]);
+            order.desc = (dir == "DESC");
+        }
+        RowLimit lim;
+        QueryBudget budget(db.limits.max_rows_scanned, db.limits.query_timeout_ms, db.limits.sort_memory);
+        lim.budget = &budget;
+        if(!parseRowLimit(limit_str, offset_str, lim)){
+            string e = "Error: invalid LIMIT/OFFSET value.\n";
+            conn.put(e);
+            return;
+        }
+        // Определяем, содержит ли запрос CROSS JOIN
+        size_t cross_pos = cmd.find("CROSS JOIN");
+        bool is_cross = false;
+        string table1, table2;
+        string columns_str, tables_str, where_str;
+        ConditionList cond_list;
+        string logical_op;
+
+        if(cross_pos != string::npos){
+            is_cross = true;
+            // Разделяем строку на части
+            // SELECT <columns> FROM <table1> CROSS JOIN <table2> [WHERE ...]
+            size_t select_pos = cmd.find("SELECT");
+            size_t from_pos = cmd.find("FROM");
+            size_t where_pos = cmd.find("WHERE");
+
+            if(select_pos == string::npos || from_pos == string::npos){
+                string e = "Error: Invalid SELECT syntax.\n";
+                conn.put(e);
+                return;
+            }
+
+            columns_str = cmd.substr(select_pos + 6, from_pos - (select_pos +6));
+            // Удаляем возможные пробелы
+            size_t first = columns_str.find_first_not_of(" \t");
+            size_t last = columns_str.find_last_not_of(" \t");
+            if(first != string::npos && last != string::npos){
+                columns_str = columns_str.substr(first, last - first +1);
+            }
+
+            // Извлекаем таблицы
+            // FROM <table1> CROSS JOIN <table2> [WHERE ...]
+            size_t cross_join_pos = cmd.find("CROSS JOIN");
+            tables_str = cmd.substr(from_pos +4, cross_join_pos - (from_pos +4));
+            // Удаляем пробелы
+            first = tables_str.find_first_not_of(" \t");
+            size_t end_cross = tables_str.find_last_not_of(" \t");
+            if(first != string::npos && end_cross != string::npos){
+                tables_str = tables_str.substr(first, end_cross - first +1);
+            }
+            table1 = tables_str;
+
+            // Извлекаем table2
+            size_t table2_start = cross_join_pos + 10; // длина "CROSS JOIN"
+            size_t where_start = cmd.find("WHERE", table2_start);
+            if(where_start != string::npos){
+                table2 = cmd.substr(table2_start, where_start - table2_start);
+                where_str = cmd.substr(where_start +5);
+            }
+            else{
+                table2 = cmd.substr(table2_start);
+            }
+            // Удаляем пробелы
+            first = table2.find_first_not_of(" \t");
+            size_t l = table2.find_last_not_of(" \t");
+            if(first != string::npos && l != string::npos){
+                table2 = table2.substr(first, l - first +1);
+            }
+
+            // Парсим условия WHERE, если есть
+            if(where_pos != string::npos){
+                parseWhereClause(where_str, cond_list, logical_op);
+            }
+
+            // Парсим колонки (разделение по пробелам)
+            const int MAX_COLS = 10;
+            string columns[MAX_COLS];
+            int col_count = 0;
+            istringstream ciss(columns_str);
+            while(col_count < MAX_COLS && ciss >> columns[col_count]){
+                col_count++;
+            }
+
+            if(!group_str.empty() || hasAggregates(columns, col_count)){
+                string e = "Error: aggregates are not supported with CROSS JOIN.\n";
+                conn.put(e);
+                return;
+            }
+
+            // Выполняем CROSS JOIN
+            string join_tables[2] = {table1, table2};
+            bool cacheable = tableVersions(db, join_tables, 2, deps);
+            conn.startCapture(cacheable ? db.cache.budget : 0);
+            ostream out(&conn);
+            crossJoinTables(db, table1, table2, columns, col_count, cond_list, logical_op, order, lim, out);
+            string result;
+            if(conn.endCapture(result) && !budget.exceeded) db.cache.put(cache_key, result, deps);
+            if(budget.exceeded) conn.put(string("Error: query stopped: ") + budget.exceeded + ".\n");
+        }
+        else{
+            // Обработка обычного SELECT (одна или несколько таблиц без CROSS JOIN)
+            // SELECT <columns> FROM <tables> [WHERE ...]
+            size_t select_pos = cmd.find("SELECT");
+            size_t from_pos = cmd.find("FROM");
+            size_t where_pos = cmd.find("WHERE");
+
+            if(select_pos == string::npos || from_pos == string::npos){
+                string e = "Error: Invalid SELECT syntax.\n";
+                conn.put(e);
+                return;
+            }
+
+            columns_str = cmd.substr(select_pos +6, from_pos - (select_pos +6));
+            // Удаляем пробелы
+            size_t first = columns_str.find_first_not_of(" \t");
+            size_t last = columns_str.find_last_not_of(" \t");
+            if(first != string::npos && last != string::npos){
+                columns_str = columns_str.substr(first, last - first +1);
+            }
+
+            // Извлекаем таблицы
+            // FROM <tables> [WHERE ...]
+            string tables_and_where;
+            if(where_pos != string::npos){
+                tables_and_where = cmd.substr(from_pos +4, where_pos - (from_pos +4));
+                where_str = cmd.substr(where_pos +5);
+            }
+            else{
+                tables_and_where = cmd.substr(from_pos +4);
+            }
+            // Удаляем пробелы
+            first = tables_and_where.find_first_not_of(" \t");
+            size_t end_where = tables_and_where.find_last_not_of(" \t");
+            if(first != string::npos && end_where != string::npos){
+                tables_and_where = tables_and_where.substr(first, end_where - first +1);
+            }
+
+            // Извлекаем таблицы (разделенные пробелами)
+            const int MAX_TABLES = 5;
+            string tables[MAX_TABLES];
+            int tab_count = 0;
+            istringstream tiss(tables_and_where);
+            string tbl;
+            while(tab_count < MAX_TABLES && tiss >> tbl){
+                tables[tab_count++] = tbl;
+            }
+
+            // Парсим условия WHERE, если есть
+            if(where_pos != string::npos){
+                parseWhereClause(where_str, cond_list, logical_op);
+            }
+
+            // Парсим колонки (разделение по пробелам)
+            const int MAX_COLS = 10;
+            string columns[MAX_COLS];
+            int col_count = 0;
+            istringstream ciss(columns_str);
+            while(col_count < MAX_COLS && ciss >> columns[col_count]){
+                col_count++;
+            }
+
+            // Колонки GROUP BY
+            string group_cols[MAX_COLS];
+            int group_count = 0;
+            istringstream giss(group_str);
+            while(group_count < MAX_COLS && giss >> group_cols[group_count]){
+                group_count++;
+            }
+
+            // Чтение представления: готовый результат, без скана таблицы
+            MatView* view = (tab_count == 1) ? findView(db, tables[0]) : nullptr;
+            if(view){
+                ostream out(&conn);
+                if(where_pos != string::npos || group_count > 0){
+                    out << "Error: WHERE and GROUP BY are not supported when reading a view.\n";
                 }
                 else{
-                    if(e.contains(columns[c])){
-                        out << e[columns[c]].get<string>();
+                    selectFromView(db, view, columns, col_count, order, lim, out);
+                }
+                return;
+            }
+
+            // Выполняем SELECT
+            bool cacheable = tableVersions(db, tables, tab_count, deps);
+            conn.startCapture(cacheable ? db.cache.budget : 0);
+            ostream out(&conn);
+            if(group_count > 0 || hasAggregates(columns, col_count)){
+                aggregateTables(db, columns, col_count, tables, tab_count, group_cols, group_count, cond_list, logical_op, order, lim, out);
+            }
+            else if(tab_count == 1){
+                selectFromTable(db, tables[0], columns, col_count, cond_list, logical_op, order, lim, out);
+            }
+            else{
+                // Поддержка нескольких таблиц (UNION)
+                selectFromMultipleTables(db, columns, col_count, tables, tab_count, cond_list, logical_op, order, lim, out);
+            }
+            string result;
+            if(conn.endCapture(result) && !budget.exceeded) db.cache.put(cache_key, result, deps);
+            if(budget.exceeded) conn.put(string("Error: query stopped: ") + budget.exceeded + ".\n");
+        }
+    }
+    else{
+        string e = "Unknown command: " + cmd + "\n";
+        conn.put(e);
+    }
+}
+
+// Соединения как сопрограммы (C++20). Сокеты обслуживают несколько
+// потоков-реакторов на epoll: сопрограмма соединения ждёт готовности сокета
+// через co_await, команду отдаёт в пул и так же ждёт её выполнения.
+// Поток на клиента не нужен, пока команда выполняется — реактор занят другими
+
+// Сопрограмма соединения: стартует сразу, кадр освобождается по завершении
+struct Session {
+    struct promise_type {
+        Session get_return_object(){ return Session(); }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+};
+
+// Сопрограмма, ждущая сокет
+struct FdWaiter {
+    coroutine_handle<> h;
+    int fd;
+    bool has_deadline;
+    chrono::steady_clock::time_point deadline;
+    bool ready;         // false — вышло время
+};
+
+struct Reactor {
+    int ep;
+    int wake_fd;                        // eventfd: будит реактор, когда есть задачи из других потоков
+    mutex m;
+    vector<function<void()>> posted;
+    unordered_set<FdWaiter*> armed;     // только поток реактора
+    vector<coroutine_handle<>> deferred;    // продолжить перед следующим epoll_wait; только поток реактора
+
+    static thread_local Reactor* current;   // реактор этого потока; nullptr — не поток реактора
+
+    Reactor() : ep(-1), wake_fd(-1) {}
+
+    bool init(){
+        ep = epoll_create1(0);
+        wake_fd = eventfd(0, EFD_NONBLOCK);
+        if(ep < 0 || wake_fd < 0) return false;
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+        return epoll_ctl(ep, EPOLL_CTL_ADD, wake_fd, &ev) == 0;
+    }
+
+    // Выполнить fn в потоке реактора; можно звать из любого потока
+    void post(function<void()> fn){
+        {
+            lock_guard<mutex> guard(m);
+            posted.push_back(move(fn));
+        }
+        uint64_t one = 1;
+        if(write(wake_fd, &one, sizeof(one)) < 0){}
+    }
+
+    void arm(FdWaiter* w, uint32_t events){
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events | EPOLLONESHOT;
+        ev.data.ptr = w;
+        if(epoll_ctl(ep, EPOLL_CTL_MOD, w->fd, &ev) < 0 && errno == ENOENT){
+            epoll_ctl(ep, EPOLL_CTL_ADD, w->fd, &ev);
+        }
+        armed.insert(w);
+    }
+
+    void forget(int fd){
+        epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
+    }
+
+    // Продолжить сопрограмму из потока реактора, когда текущая вернёт управление
+    void defer(coroutine_handle<> h){
+        deferred.push_back(h);
+    }
+
+    void run(){
+        current = this;
+        epoll_event evs[64];
+        while(true){
+            while(!deferred.empty()){
+                vector<coroutine_handle<>> todo;
+                todo.swap(deferred);
+                for(size_t k = 0; k < todo.size(); k++) todo[k].resume();
+            }
+            bool timed = false;
+            for(FdWaiter* w : armed) timed = timed || w->has_deadline;
+            int n = epoll_wait(ep, evs, 64, timed ? 250 : -1);
+            for(int i = 0; i < n; i++){
+                FdWaiter* w = (FdWaiter*)evs[i].data.ptr;
+                if(!w){
+                    uint64_t cnt;
+                    if(read(wake_fd, &cnt, sizeof(cnt)) < 0){}
+                    vector<function<void()>> todo;
+                    {
+                        lock_guard<mutex> guard(m);
+                        todo.swap(posted);
+                    }
+                    for(size_t k = 0; k < todo.size(); k++) todo[k]();
+                    continue;
+                }
+                armed.erase(w);
+                w->ready = true;
+                w->h.resume();
+            }
+            if(!timed) continue;
+            // Истёкшие ожидания: снимаем с epoll и будим с ready = false
+            auto now = chrono::steady_clock::now();
+            vector<FdWaiter*> expired;
+            for(FdWaiter* w : armed){
+                if(w->has_deadline && now >= w->deadline) expired.push_back(w);
+            }
+            for(size_t k = 0; k < expired.size(); k++){
+                FdWaiter* w = expired[k];
+                armed.erase(w);
+                epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.data.ptr = w;
+                epoll_ctl(ep, EPOLL_CTL_MOD, w->fd, &ev);
+                w->ready = false;
+                w->h.resume();
+            }
+        }
+    }
+};
+
+thread_local Reactor* Reactor::current = nullptr;
+
+// co_await SocketReady(...): true — сокет готов, false — вышло время (timeout_ms <= 0 — ждать без срока)
+struct SocketReady {
+    Reactor& r;
+    FdWaiter w;
+    uint32_t events;
+
+    SocketReady(Reactor& rr, int fd, uint32_t ev, long timeout_ms) : r(rr), events(ev) {
+        w.fd = fd;
+        w.has_deadline = (timeout_ms > 0);
+        if(w.has_deadline) w.deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+        w.ready = false;
+    }
+    bool await_ready() const { return false; }
+    void await_suspend(coroutine_handle<> h){
+        w.h = h;
+        r.arm(&w, events);
+    }
+    bool await_resume() const { return w.ready; }
+};
+
+// co_await PoolRun(...): fn выполняется в пуле команд, сопрограмма
+// продолжается в своём реакторе. false — пул перегружен, команда отброшена
+struct PoolRun {
+    QueryPool& pool;
+    Reactor& r;
+    function<void()> fn;
+    bool admitted;
+
+    PoolRun(QueryPool& p, Reactor& rr, function<void()> f) : pool(p), r(rr), fn(move(f)), admitted(false) {}
+    bool await_ready() const { return false; }
+    bool await_suspend(coroutine_handle<> h){
+        PoolJob job;
+        job.run = move(fn);
+        job.done = [this, h](bool ran){
+            admitted = ran;
+            r.post([h]{ h.resume(); });
+        };
+        // Очередь полна — не засыпаем, сразу продолжаем с отказом
+        return pool.submit(move(job));
+    }
+    bool await_resume() const { return admitted; }
+};
+
+// Ждём, пока операция seq фонового ввода-вывода окажется на диске
+struct DiskSynced {
+    Reactor& r;
+    uint64_t seq;
+
+    DiskSynced(Reactor& rr, uint64_t s) : r(rr), seq(s) {}
+    bool await_ready() const { return false; }
+    bool await_suspend(coroutine_handle<> h){
+        Reactor* rp = &r;
+        return disk_io.whenSynced(seq, [rp, h]{ rp->post([h]{ h.resume(); }); });
+    }
+    void await_resume() {}
+};
+
+// Вложенная сопрограмма: стартует по co_await, ждущая продолжается после её
+// завершения. Закончилась сразу, ни разу не заснув, — ждущая и не засыпает
+// (иначе длинный цикл таких co_await рос бы по стеку реактора); заснула —
+// ждущую продолжит реактор, когда кадр вложенной уже вернёт управление
+struct Task {
+    struct promise_type {
+        coroutine_handle<> cont;
+        bool waiting;       // ждущая заснула — по завершении её нужно продолжить
+
+        promise_type() : waiting(false) {}
+        Task get_return_object(){ return Task(coroutine_handle<promise_type>::from_promise(*this)); }
+        suspend_always initial_suspend() noexcept { return {}; }
+        struct Final {
+            bool await_ready() noexcept { return false; }
+            void await_suspend(coroutine_handle<promise_type> h) noexcept {
+                if(h.promise().waiting) Reactor::current->defer(h.promise().cont);
+            }
+            void await_resume() noexcept {}
+        };
+        Final final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+
+    coroutine_handle<promise_type> h;
+
+    explicit Task(coroutine_handle<promise_type> hh) : h(hh) {}
+    Task(Task&& o) : h(o.h) { o.h = nullptr; }
+    ~Task(){ if(h) h.destroy(); }
+    bool await_ready() const { return false; }
+    // Вложенную продолжает только поток реактора, так что между resume и waiting гонки нет
+    bool await_suspend(coroutine_handle<> c){
+        h.promise().cont = c;
+        h.resume();
+        if(h.done()) return false;
+        h.promise().waiting = true;
+        return true;
+    }
+    void await_resume() {}
+};
+
+// Всё, что нужно соединениям: база (с пулом команд) и реакторы
+struct ServerRuntime {
+    dbase& db;
+    vector<Reactor*> reactors;
+    atomic<unsigned> next_reactor;
+
+    ServerRuntime(dbase& d) : db(d), next_reactor(0) {}
+};
+
+
+// Репликация. Реплика шлёт "REPLICATE <epoch> <seq>" и дальше только читает:
+//   RESET <epoch>               — очистить все таблицы, следом идёт снимок
+//   - TABLE <table> <seq>       — снимок таблицы: записи по ней до seq в нём уже есть
+//   - INSERT <table> <json>     — строка снимка
+//   - VIEW <name> <query>       — представление над таблицей снимка
+//   AT <seq>                    — снимок закончен, следующая запись — seq
+//   <seq> INSERT <table> <json> — записи журнала
+//   <seq> DELETE <table> <column> <value>
+//   <seq> VIEW <name> <query>
+//   PING                        — журнал пуст, соединение живо
+
+// Ведущий сервер: отдельный поток на каждую реплику
+void replicaFeed(dbase& db, int fd, uint64_t epoch, uint64_t from){
+    ResponseWriter out(fd);
+    ReplicationLog& log = db.repl;
+    // Снимку нужны все таблицы — читаем их с диска до блокировки журнала
+    for(Node* t = db.head; t; t = t->next) db.ensureLoaded(t);
+    unique_lock<mutex> lock(log.m);
+    while(true){
+        if(epoch != log.epoch || from < log.base || from > log.next()){
+            // Своего места в журнале у реплики нет — снимок, по таблице за раз.
+            // Таблица читается под разделяемой блокировкой, и под ней же берётся
+            // позиция журнала: все записи по таблице до неё уже в снимке, а
+            // пишущие в другие таблицы не ждут. Журнал идёт с наименьшей из
+            // позиций; записи, уже попавшие в снимок своей таблицы, реплика
+            // пропускает. Строки — в порядке вставки, чтобы у реплики таблица
+            // вышла такой же. Снимок уходит реплике по таблице, без блокировок
+            epoch = log.epoch;
+            uint64_t start = log.next();
+            lock.unlock();
+            out.put("RESET " + to_string(epoch) + "\n");
+            bool sent = true;
+            for(Node* t = db.head; t && sent; t = t->next){
+                {
+                    shared_lock<shared_mutex> guard(t->rw);
+                    uint64_t pos;
+                    {
+                        lock_guard<mutex> log_guard(log.m);
+                        pos = log.next();
+                    }
+                    start = min(start, pos);
+                    out.put("- TABLE " + t->name + " " + to_string(pos) + "\n");
+                    vector<TableDataNode*> rows;
+                    for(TableDataNode* p = t->data; p; p = p->next) rows.push_back(p);
+                    for(size_t i = rows.size(); i-- > 0;){
+                        out.put("- INSERT " + t->name + " " + decodeRow(t, rows[i]).dump() + "\n");
                     }
-                    else{
-                        out << "NULL";
+                    for(MatView* v = t->views; v; v = v->next){
+                        out.put("- VIEW " + v->name + " " + v->query + "\n");
                     }
                 }
+                sent = out.flush();
+            }
+            lock.lock();
+            if(!sent) break;
+            from = start;
+            out.put("AT " + to_string(from) + "\n");
+        }
+        else if(from < log.next()){
+            string batch;
+            for(; from < log.next() && batch.size() < OUT_CHUNK; from++){
+                batch += to_string(from) + " " + log.records[from - log.base] + "\n";
+            }
+            out.put(batch);
+        }
+        else if(!log.cv.wait_for(lock, chrono::seconds(1), [&]{ return log.next() != from || log.epoch != epoch; })){
+            // Раз в секунду без записей — PING: так замечаем ушедшую реплику
+            out.put("PING\n");
+        }
+        else continue;
+        // Отправляем без блокировки: медленная реплика не должна держать запись
+        lock.unlock();
+        bool ok = out.flush();
+        lock.lock();
+        if(!ok) break;
+    }
+    lock.unlock();
+    close(fd);
+    db.connections--;
+    cout << "Replica disconnected.\n";
+}
+
+// Реплика: после RESET ведущего все таблицы начинаются с нуля.
+// Вызывающий держит таблицу исключительно
+void clearTableRows(Node* tbl){
+    while(tbl->data){
+        TableDataNode* p = tbl->data;
+        tbl->data = p->next;
+        delete p;
+    }
+    tbl->row_count = 0;
+    while(tbl->blocks){
+        RowBlock* b = tbl->blocks;
+        tbl->blocks = b->next;
+        delete b;
+    }
+    for(OrderedIndex* ix = tbl->indexes; ix; ix = ix->next){
+        ix->destroy(ix->root);
+        ix->root = new BPTNode(true);
+        ix->size = 0;
+    }
+    for(BloomFilter* bf = tbl->blooms; bf; bf = bf->next) bf->reset(0);
+    for(MatView* v = tbl->views; v; v = v->next){
+        lock_guard<mutex> guard(v->m);
+        v->clear();
+        v->dirty = true;
+    }
+    tbl->version.fetch_add(1, memory_order_release);
+}
+
+// Одна строка потока репликации
+// table_from — позиции снимков таблиц: более ранние записи по таблице уже применены
+void applyReplicated(dbase& db, const string& line, uint64_t& epoch, uint64_t& next_seq,
+                     unordered_map<string, uint64_t>& table_from){
+    istringstream iss(line);
+    string tag, action, table;
+    iss >> tag;
+    if(tag == "PING") return;
+    if(tag == "RESET"){
+        iss >> epoch;
+        table_from.clear();
+        // Все таблицы разом и в порядке адресов, как в TableReadLock
+        vector<Node*> all;
+        for(Node* t = db.head; t; t = t->next) all.push_back(t);
+        sort(all.begin(), all.end());
+        for(Node* t : all) t->rw.lock();
+        {
+            lock_guard<mutex> guard(db.repl.m);
+            for(Node* t : all) clearTableRows(t);
+            // Наш собственный журнал тоже начинается заново (для реплик этой реплики)
+            db.repl.epoch++;
+            db.repl.records.clear();
+            db.repl.base = 1;
+            db.repl.cv.notify_all();
+        }
+        for(Node* t : all) t->rw.unlock();
+        cout << "Replica reset, loading snapshot from primary.\n";
+        return;
+    }
+    if(tag == "AT"){
+        iss >> next_seq;
+        cout << "Snapshot loaded, following primary from record " << next_seq << ".\n";
+        return;
+    }
+    iss >> action >> table;
+    if(tag == "-" && action == "TABLE"){
+        iss >> table_from[table];
+        return;
+    }
+    if(tag != "-"){
+        uint64_t seq = strtoull(tag.c_str(), nullptr, 10);
+        auto it = table_from.find(table);
+        if(it != table_from.end() && seq < it->second){
+            next_seq = seq + 1;
+            return;
+        }
+    }
+    if(action == "INSERT"){
+        string rest;
+        getline(iss, rest);
+        json entry = json::parse(rest, nullptr, false);
+        string err;
+        if(entry.is_discarded() || !insertRecord(db, table, entry, err)){
+            cerr << "Replicated INSERT failed (" << err << "): " << line << endl;
+        }
+    }
+    else if(action == "DELETE"){
+        string col, val;
+        iss >> col >> val;
+        string err;
+        if(!deleteRow(db, col, val, table, err)){
+            cerr << "Replicated DELETE failed (" << err << "): " << line << endl;
+        }
+    }
+    else if(action == "VIEW"){
+        // table — имя представления. То же определение уже может быть здесь:
+        // из schema.json, из снимка или из записи, попавшей и в снимок
+        string query;
+        getline(iss >> ws, query);
+        MatView* v = findView(db, table);
+        string err;
+        if(!(v && v->query == query) && !defineView(db, table, query, err)){
+            cerr << "Replicated VIEW failed (" << err << "): " << line << endl;
+        }
+    }
+    else{
+        cerr << "Unknown replication record: " << line << endl;
+        return;
+    }
+    if(tag != "-") next_seq = strtoull(tag.c_str(), nullptr, 10) + 1;
+}
+
+// Исходящее соединение с другим сервером; -1 — не удалось
+int connectTo(const string& host, int port){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if(inet_pton(AF_INET, host.c_str(), &addr.sin_addr) <= 0 ||
+       connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Поток реплики: подключается к ведущему серверу и применяет его журнал.
+// Связь пропала — переподключаемся и продолжаем с того же места
+void followPrimary(dbase& db, string host, int port){
+    uint64_t epoch = 0;
+    uint64_t next_seq = 0;
+    unordered_map<string, uint64_t> table_from;
+    while(true){
+        int fd = connectTo(host, port);
+        if(fd < 0){
+            this_thread::sleep_for(chrono::seconds(1));
+            continue;
+        }
+        cout << "Connected to primary " << host << ":" << port << ".\n";
+        string hello = "REPLICATE " + to_string(epoch) + " " + to_string(next_seq) + "\n";
+        send(fd, hello.data(), hello.size(), MSG_NOSIGNAL);
+
+        string pending;
+        vector<char> buf(OUT_CHUNK);
+        ssize_t n;
+        while((n = read(fd, buf.data(), buf.size())) > 0 || (n < 0 && errno == EINTR)){
+            if(n < 0) continue;
+            pending.append(buf.data(), n);
+            size_t start = 0, nl;
+            while((nl = pending.find('\n', start)) != string::npos){
+                applyReplicated(db, pending.substr(start, nl - start), epoch, next_seq, table_from);
+                start = nl + 1;
+            }
+            pending.erase(0, start);
+        }
+        close(fd);
+        cerr << "Lost connection to primary, reconnecting...\n";
+        this_thread::sleep_for(chrono::seconds(1));
+    }
+}
+
+// Маршрутизатор кластера. Каждая таблица разбита по хешу колонки-ключа
+// (раздел "sharding" схемы) между N серверами-шардами. INSERT, DELETE и
+// SELECT с равенством по ключу уходят одному шарду; агрегаты шарды считают
+// частично, здесь частичные группы сливаются; сканы шарды отдают уже
+// отобранными (и отсортированными), здесь их ответы склеиваются или сливаются
+// по ключу ORDER BY прямо в ответ клиенту. Только для CROSS JOIN строки таблиц
+// собираются со всех шардов в пустую копию схемы, и запрос выполняется на ней.
+// Команды маршрутизатора выполняет сопрограмма соединения: шардов она ждёт
+// в своём реакторе, поток пула нужен только для слияния агрегатов и соединения
+
+const int SHARD_CONNECT_MS = 5000;  // шард не принял соединение — считаем недоступным
+const int SHARD_REPLY_MS = 60000;   // ответ шарда дольше — шард считаем недоступным
+
+struct ShardRouter {
+    vector<pair<string, int>> shards;   // адрес и порт каждого шарда
+    mutex m;
+    vector<vector<int>> idle;           // свободные соединения с каждым шардом
+
+    // Свободное соединение с шардом s; -1 — нет, нужно новое
+    int takeIdle(size_t s){
+        lock_guard<mutex> guard(m);
+        while(!idle[s].empty()){
+            int fd = idle[s].back();
+            idle[s].pop_back();
+            // Шард мог закрыть простаивавшее соединение — такое не берём
+            pollfd pfd = {fd, POLLIN, 0};
+            if(poll(&pfd, 1, 0) == 0) return fd;
+            close(fd);
+        }
+        return -1;
+    }
+
+    void release(size_t s, int fd){
+        lock_guard<mutex> guard(m);
+        idle[s].push_back(fd);
+    }
+
+    string name(size_t s) const {
+        return shards[s].first + ":" + to_string(shards[s].second);
+    }
+};
+
+// Номер шарда по значению ключа (FNV-1a: раскладка не зависит от сборки)
+size_t shardOf(const string& key, size_t n){
+    uint64_t h = 14695981039346656037ULL;
+    for(size_t i = 0; i < key.size(); i++){
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h % n;
+}
+
+// Значение ключа таблицы в канонической записи, как его хранят шарды ("7",
+// а не "007"); false — не подходит по типу ключа, шард по нему не определить
+bool shardKeyValue(const Node* tbl, const string& in, string& out){
+    int k = tbl->findColumn(tbl->shard_key);
+    string err;
+    if(k < 0){
+        out = in;
+        return true;
+    }
+    return canonicalCell(tbl->cols[k], in, out, err);
+}
+
+// Ответ шарда, читаемый по мере прихода: строки, в конце нулевой байт
+struct ShardReply {
+    size_t shard;
+    int fd;
+    string buf;         // пришло, но ещё не разобрано (с позиции pos)
+    size_t pos;
+    bool done;          // нулевой байт получен — соединение можно вернуть
+    string err;         // шард недоступен, закрыл соединение или молчит
+
+    ShardReply() : shard(0), fd(-1), pos(0), done(false) {}
+};
+
+// Новое соединение с шардом; connect ждём в реакторе. -1 — шард недоступен
+Task shardConnect(Reactor& r, const string& host, int port, int& fd){
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(fd < 0) co_return;
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    bool ok = inet_pton(AF_INET, host.c_str(), &addr.sin_addr) > 0;
+    if(ok && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0){
+        ok = false;
+        bool ready = false;
+        if(errno == EINPROGRESS) ready = co_await SocketReady(r, fd, EPOLLOUT, SHARD_CONNECT_MS);
+        if(ready){
+            int so_err = 0;
+            socklen_t len = sizeof(so_err);
+            ok = getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_err, &len) == 0 && so_err == 0;
+        }
+    }
+    if(!ok){
+        close(fd);
+        fd = -1;
+    }
+}
+
+// Соединение с шардом s и запрос ему; не вышло — текст ошибки в rep.err
+Task shardStart(Reactor& r, ShardRouter& rt, size_t s, const string& req, ShardReply& rep){
+    rep.shard = s;
+    rep.fd = rt.takeIdle(s);
+    if(rep.fd < 0) co_await shardConnect(r, rt.shards[s].first, rt.shards[s].second, rep.fd);
+    string msg = "SHARD " + req;
+    if(rep.fd >= 0 && send(rep.fd, msg.data(), msg.size(), MSG_NOSIGNAL) != (ssize_t)msg.size()){
+        close(rep.fd);
+        rep.fd = -1;
+    }
+    if(rep.fd < 0) rep.err = "Error: shard " + rt.name(s) + " is unavailable.\n";
+}
+
+// Дочитать ответ шарда: что уже пришло, а если ничего — ждём сокет в реакторе
+Task shardFill(Reactor& r, ShardRouter& rt, ShardReply& rep){
+    size_t old = rep.buf.size();
+    rep.buf.resize(old + OUT_CHUNK);
+    while(true){
+        ssize_t got = read(rep.fd, &rep.buf[old], OUT_CHUNK);
+        if(got > 0){
+            rep.buf.resize(old + got);
+            co_return;
+        }
+        if(got < 0 && errno == EINTR) continue;
+        if(got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            bool ready = co_await SocketReady(r, rep.fd, EPOLLIN, SHARD_REPLY_MS);
+            if(ready) continue;
+            rep.err = "Error: shard " + rt.name(rep.shard) + " did not reply in time.\n";
+        }
+        else{
+            rep.err = "Error: shard " + rt.name(rep.shard) + " closed the connection.\n";
+        }
+        rep.buf.resize(old);
+        co_return;
+    }
+}
+
+// Следующая строка ответа (без '\n'); got = false — ответ кончился или ошибка
+Task shardLine(Reactor& r, ShardRouter& rt, ShardReply& rep, string& line, bool& got){
+    got = false;
+    size_t scanned = rep.pos;
+    while(!rep.done && rep.err.empty()){
+        size_t end = rep.buf.find_first_of(string("\n\0", 2), scanned);
+        if(end == string::npos){
+            // Разобранное начало буфера больше не нужно
+            if(rep.pos >= OUT_CHUNK){
+                rep.buf.erase(0, rep.pos);
+                rep.pos = 0;
+            }
+            scanned = rep.buf.size();
+            co_await shardFill(r, rt, rep);
+            continue;
+        }
+        if(rep.buf[end] == '\0'){
+            rep.done = true;
+            if(end == rep.pos) break;
+        }
+        line.assign(rep.buf, rep.pos, end - rep.pos);
+        rep.pos = end + 1;
+        got = true;
+        break;
+    }
+}
+
+// Соединение больше не нужно: прочитанное до конца возвращаем в запас,
+// с недочитанным ответом закрываем (иначе в нём остался бы мусор)
+void shardFinish(Reactor& r, ShardRouter& rt, ShardReply& rep){
+    if(rep.fd < 0) return;
+    r.forget(rep.fd);
+    if(rep.done && rep.err.empty()) rt.release(rep.shard, rep.fd);
+    else close(rep.fd);
+    rep.fd = -1;
+}
+
+// Запросы шардам (пустой reqs[s] — шарду s ничего не шлём) и ответы целиком.
+// Шлём всем сразу, потом читаем по очереди: пока ждём один шард, остальные
+// уже считают. Не вышло — текст ошибки в err
+Task shardExchange(Reactor& r, ShardRouter& rt, const vector<string>& reqs, vector<string>& replies, string& err){
+    size_t n = reqs.size();
+    vector<ShardReply> reps(n);
+    replies.assign(n, "");
+    for(size_t s = 0; s < n && err.empty(); s++){
+        if(reqs[s].empty()) continue;
+        co_await shardStart(r, rt, s, reqs[s], reps[s]);
+        err = reps[s].err;
+    }
+    for(size_t s = 0; s < n && err.empty(); s++){
+        ShardReply& rep = reps[s];
+        size_t scanned = 0;
+        while(rep.fd >= 0 && !rep.done && rep.err.empty()){
+            size_t z = rep.buf.find('\0', scanned);
+            if(z != string::npos){
+                rep.done = true;
+                rep.buf.resize(z);
+                break;
             }
-            out << "\n";
+            scanned = rep.buf.size();
+            co_await shardFill(r, rt, rep);
         }
-        p = p->next;
-    }
-    if(!data_found){
-        out << "No data found in " << table << ".\n";
+        err = rep.err;
+        replies[s].swap(rep.buf);
     }
+    for(size_t s = 0; s < n; s++) shardFinish(r, rt, reps[s]);
 }
 
+// Клиент читает медленнее, чем шарды отвечают, — ждём его здесь же, в
+// реакторе, вместо того чтобы копить ответ во временном файле
+Task drainClient(Reactor& r, ResponseWriter& conn){
+    while(conn.sendPending(OUT_LOW_WATER) == 0){
+        // Результат co_await — в переменную: GCC 12 неверно собирает
+        // co_await прямо в условии if внутри цикла такой сопрограммы
+        bool ready = co_await SocketReady(r, conn.fd, EPOLLOUT, OUT_STALL_MS);
+        if(!ready) conn.fail();
+    }
+}
 
-// SELECT (несколько таблиц)
+// Пустые таблицы с той же схемой; в них маршрутизатор собирает строки с шардов
+void copySchema(dbase& from, dbase& to){
+    to.schema_name = from.schema_name;
+    to.limits = from.limits;
+    to.persist = false;
+    to.cache.budget = 0;
+    vector<Node*> tables;
+    for(Node* t = from.head; t; t = t->next) tables.push_back(t);
+    for(size_t i = tables.size(); i-- > 0;){
+        to.addNode(tables[i]->name);
+        Node* nd = to.head;
+        nd->cols = tables[i]->cols;
+        for(size_t c = 0; c < nd->cols.size(); c++){
+            if(!nd->cols[c].dict) continue;
+            ColumnDict* d = new ColumnDict(nd->cols[c].name, "");
+            d->next = nd->dicts;
+            nd->dicts = d;
+            nd->cols[c].dict = d;
+        }
+        nd->layout();
+    }
+}
 
-void selectFromMultipleTables(dbase& db,
-                              const string* columns, int col_count,
-                              const string* tables, int tab_count,
-                              const ConditionList& cond_list,
-                              const string& logical_op,
-                              ostringstream& out)
+// Частичные группы шардов сливаются как частичные результаты потоков в
+// aggregateTables. Ответ шарда, который не разбирается, — его ошибка
+void mergeShardAggregates(const SelectParts& sp, const vector<AggColumn>& aggs,
+                          const vector<string>& replies, const OrderBy& order, RowLimit& lim, ostream& out)
 {
-    if(tab_count <= 0){
-        out << "No tables specified.\n";
-        return;
+    size_t col_count = sp.columns.size();
+    AggTable result;
+    for(size_t s = 0; s < replies.size(); s++){
+        istringstream lines(replies[s]);
+        string line;
+        while(getline(lines, line)){
+            json g = json::parse(line, nullptr, false);
+            if(g.is_discarded() || !g.is_object()){
+                out << replies[s];
+                return;
+            }
+            AggGroup grp;
+            string key;
+            for(const auto& k : g["k"]){
+                grp.keys.push_back(k.get<string>());
+                key += grp.keys.back();
+                key += '\x1f';
+            }
+            grp.states.resize(col_count);
+            for(size_t c = 0; c < col_count && c < g["s"].size(); c++){
+                const json& st = g["s"][c];
+                grp.states[c].count = st[0].get<long long>();
+                grp.states[c].sum = st[1].get<double>();
+                grp.states[c].has_value = st[2].get<bool>();
+                grp.states[c].min_v = st[3].get<string>();
+                grp.states[c].max_v = st[4].get<string>();
+                grp.states[c].numeric = st[5].get<long long>();
+                grp.states[c].ints = st[6].get<long long>();
+                grp.states[c].int_sum = ((__int128)st[7].get<int64_t>() << 64) | st[8].get<uint64_t>();
+            }
+            auto it = result.find(key);
+            if(it == result.end()){
+                result.emplace(key, grp);
+                continue;
+            }
+            for(size_t c = 0; c < col_count; c++) mergeAggState(it->second.states[c], grp.states[c]);
+        }
     }
-    // Заголовок
-    for(int i = 0; i < col_count; i++){
-        if(i > 0) out << " ";
-        out << columns[i];
+    if(sp.group_cols.empty() && result.empty()){
+        AggGroup grp;
+        grp.states.resize(col_count);
+        result.emplace("", grp);
     }
-    out << "\n";
+    writeAggResult(sp.columns.data(), col_count, aggs.data(), sp.group_cols.data(), sp.group_cols.size(),
+                   result, order, lim, out);
+}
 
-    bool data_found = false;
-    for(int t = 0; t < tab_count; t++){
-        Node* tbl = db.findNode(tables[t]);
-        if(!tbl){
-            out << "Table not found: " << tables[t] << "\n";
-            continue;
-        }
-        TableDataNode* p = tbl->data;
-        while(p){
-            json e = json::parse(p->record_str);
-            if(checkAllConditions(e, cond_list, logical_op)){
-                data_found = true;
-                for(int c = 0; c < col_count; c++){
-                    if(c > 0) out << " ";
-                    if(columns[c] == "*"){
-                        bool first = true;
-                        for(auto it = e.begin(); it != e.end(); ++it){
-                            if(!first) out << " ";
-                            out << it.key() << "=" << it.value().get<string>();
-                            first = false;
-                        }
-                        break;
-                    }
-                    else{
-                        if(e.contains(columns[c])){
-                            out << e[columns[c]].get<string>();
-                        }
-                        else{
-                            out << "NULL";
-                        }
-                    }
+// CROSS JOIN: строки таблиц (rows[t] — ответы шардов на SCAN таблицы t)
+// собираются в копию схемы, и запрос выполняется на ней
+void joinShardRows(dbase& db, const SelectParts& sp, const vector<vector<string>>& rows,
+                   const string& cmd, ResponseWriter& conn)
+{
+    dbase local;
+    copySchema(db, local);
+    for(size_t t = 0; t < rows.size(); t++){
+        Node* tbl = local.findNode(sp.tables[t]);
+        for(size_t s = 0; tbl && s < rows[t].size(); s++){
+            istringstream lines(rows[t][s]);
+            string line;
+            while(getline(lines, line)){
+                json e = json::parse(line, nullptr, false);
+                string row_err;
+                if(e.is_discarded() || !e.is_object()){
+                    conn.put(line + "\n");
+                    return;
                 }
-                out << "\n";
+                if(!addDataToTable(tbl, e, row_err)) cerr << "Row from shard skipped (" << row_err << ")" << endl;
             }
-            p = p->next;
         }
     }
-    if(!data_found){
-        out << "No data found in the specified tables.\n";
-    }
+    executeCommand(local, cmd, conn);
 }
 
+// Поток строк скана от одного шарда и его текущая строка
+struct ScanStream {
+    ShardReply rep;
+    json row;
+    string key;         // ключ ORDER BY текущей строки
+    bool has_row;
 
-// CROSS JOIN 
+    ScanStream() : has_row(false) {}
+};
 
-void crossJoinTables(dbase& db,
-                     const string& table1,
-                     const string& table2,
-                     const string* columns, int col_count,
-                     const ConditionList& cond_list,
-                     const string& logical_op,
-                     ostringstream& out)
-{
-    Node* t1 = db.findNode(table1);
-    Node* t2 = db.findNode(table2);
-    if(!t1){
-        out << "Table not found: " << table1 << "\n";
-        return;
+// Следующая строка потока; has_row = false — поток кончился.
+// Строка не JSON — ошибка шарда, её текст уходит в err
+Task scanNext(Reactor& r, ShardRouter& rt, ScanStream& st, const OrderBy& order, string& err){
+    string line;
+    bool got;
+    st.has_row = false;
+    co_await shardLine(r, rt, st.rep, line, got);
+    if(!got){
+        err = st.rep.err;
+        co_return;
     }
-    if(!t2){
-        out << "Table not found: " << table2 << "\n";
-        return;
+    st.row = json::parse(line, nullptr, false);
+    if(st.row.is_discarded() || !st.row.is_object()){
+        err = line + "\n";
+        co_return;
     }
+    if(!order.column.empty()) st.key = sortKey(st.row, order);
+    st.has_row = true;
+}
 
-    // Выводим «заголовок» (просто перечислим columns)
-    for(int i = 0; i < col_count; i++){
+// SELECT без CROSS JOIN и агрегатов: одна таблица или объединение нескольких.
+// Шард отдаёт не больше offset + limit подходящих строк, с ORDER BY — уже
+// отсортированными. Без ORDER BY ответы шардов склеиваются по порядку, с ним —
+// k-путевое слияние по ключу, как слияние прогонов в RowSorter. OFFSET и LIMIT
+// применяются здесь, по мере вывода; набрали нужное — остальные ответы не читаем
+Task routeScan(Reactor& r, dbase& db, ShardRouter& rt, const SelectParts& sp,
+               const OrderBy& order, RowLimit& lim, ResponseWriter& conn)
+{
+    ostream out(&conn);
+    size_t n = rt.shards.size();
+    size_t tab_count = sp.tables.size();
+    if(tab_count == 1 && !db.findNode(sp.tables[0])){
+        out << "Table not found: " << sp.tables[0] << "\n";
+        co_return;
+    }
+    string tail;
+    if(!sp.where.empty()) tail += " WHERE " + sp.where;
+    if(!order.column.empty()) tail += " ORDER BY " + order.column + (order.desc ? " DESC" : "");
+    if(lim.limit >= 0) tail += " LIMIT " + to_string(lim.end());
+
+    // Заголовок
+    for(size_t i = 0; i < sp.columns.size(); i++){
         if(i > 0) out << " ";
-        out << columns[i];
+        out << sp.columns[i];
     }
     out << "\n";
 
-    bool data_found = false;
+    // Потоки по таблицам, внутри таблицы — по шардам
+    vector<ScanStream> streams(tab_count * n);
+    vector<bool> missing(tab_count);
+    string err;
+    for(size_t t = 0; t < tab_count; t++){
+        missing[t] = !db.findNode(sp.tables[t]);
+        for(size_t s = 0; s < n && !missing[t] && err.empty(); s++){
+            co_await shardStart(r, rt, s, "SCAN " + sp.tables[t] + tail, streams[t * n + s].rep);
+            err = streams[t * n + s].rep.err;
+        }
+    }
 
-    // Для каждой пары (row1, row2) из (table1 × table2) делаем ДВА прохода:
-    // pass=1 => столбцы с чётным индексом берем из table1, с нечётным => из table2
-    // pass=2 => наоборот
-    TableDataNode* p1 = t1->data;
-    while(p1){
-        json e1 = json::parse(p1->record_str);
-        TableDataNode* p2 = t2->data;
-        while(p2){
-            json e2 = json::parse(p2->record_str);
-
-            // Проход №1
-            {
-                // Построим временный JSON comb1
-                json comb1;
-                for(int c = 0; c < col_count; c++){
-                    // если c чётный => берем e1[columns[c]], иначе e2[columns[c]]
-                    // (чётный — c%2==0)
-                    if((c % 2) == 0){
-                        // берем из e1
-                        if(e1.contains(columns[c])){
-                            comb1[ columns[c] ] = e1[ columns[c] ].get<string>();
-                        } else {
-                            comb1[ columns[c] ] = "NULL";
-                        }
-                    } else {
-                        // берем из e2
-                        if(e2.contains(columns[c])){
-                            comb1[ columns[c] ] = e2[ columns[c] ].get<string>();
-                        } else {
-                            comb1[ columns[c] ] = "NULL";
-                        }
-                    }
-                }
-                // Проверяем условия
-                if(checkAllConditions(comb1, cond_list, logical_op)){
+    bool data_found = false;
+    if(err.empty() && order.column.empty()){
+        for(size_t i = 0; i < streams.size() && err.empty() && !lim.done() && !conn.failed; i++){
+            if(missing[i / n]){
+                if(i % n == 0) out << "Table not found: " << sp.tables[i / n] << "\n";
+                continue;
+            }
+            ScanStream& st = streams[i];
+            while(err.empty() && !lim.done() && !conn.failed){
+                co_await scanNext(r, rt, st, order, err);
+                if(!st.has_row) break;
+                if(lim.take()){
                     data_found = true;
-                    // Вывод
-                    for(int c = 0; c < col_count; c++){
-                        if(c > 0) out << " ";
-                        out << comb1[ columns[c] ].get<string>();
-                    }
+                    formatRow(out, st.row, sp.columns.data(), sp.columns.size());
                     out << "\n";
                 }
+                if(conn.pending > OUT_LOW_WATER) co_await drainClient(r, conn);
             }
-
-            // Проход №2
-            {
-                json comb2;
-                for(int c = 0; c < col_count; c++){
-                    // теперь наоборот: чётный => table2, нечётный => table1
-                    if((c % 2) == 0){
-                        // берем из e2
-                        if(e2.contains(columns[c])){
-                            comb2[ columns[c] ] = e2[ columns[c] ].get<string>();
-                        } else {
-                            comb2[ columns[c] ] = "NULL";
-                        }
-                    } else {
-                        // берем из e1
-                        if(e1.contains(columns[c])){
-                            comb2[ columns[c] ] = e1[ columns[c] ].get<string>();
-                        } else {
-                            comb2[ columns[c] ] = "NULL";
-                        }
-                    }
-                }
-                if(checkAllConditions(comb2, cond_list, logical_op)){
-                    data_found = true;
-                    for(int c = 0; c < col_count; c++){
-                        if(c > 0) out << " ";
-                        out << comb2[ columns[c] ].get<string>();
-                    }
-                    out << "\n";
+        }
+    }
+    else if(err.empty()){
+        for(size_t t = 0; t < tab_count; t++){
+            if(missing[t]) out << "Table not found: " << sp.tables[t] << "\n";
+        }
+        for(size_t i = 0; i < streams.size() && err.empty(); i++){
+            if(!missing[i / n]) co_await scanNext(r, rt, streams[i], order, err);
+        }
+        while(err.empty() && !lim.done() && !conn.failed){
+            // При равных ключах раньше идёт поток с меньшим номером
+            size_t best = streams.size();
+            for(size_t i = 0; i < streams.size(); i++){
+                if(!streams[i].has_row) continue;
+                if(best == streams.size()){
+                    best = i;
+                    continue;
                 }
+                int c = compareValues(streams[i].key, streams[best].key);
+                if(order.desc) c = -c;
+                if(c < 0) best = i;
+            }
+            if(best == streams.size()) break;
+            if(lim.take()){
+                data_found = true;
+                formatRow(out, streams[best].row, sp.columns.data(), sp.columns.size());
+                out << "\n";
             }
+            co_await scanNext(r, rt, streams[best], order, err);
+            if(conn.pending > OUT_LOW_WATER) co_await drainClient(r, conn);
+        }
+    }
+    for(size_t i = 0; i < streams.size(); i++) shardFinish(r, rt, streams[i].rep);
+    if(!err.empty()) out << err;
+    else if(!data_found && tab_count == 1) out << "No data found in " << sp.tables[0] << ".\n";
+    else if(!data_found) out << "No data found in the specified tables.\n";
+}
 
-            p2 = p2->next;
+Task routeSelect(Reactor& r, dbase& db, ShardRouter& rt, const string& cmd, ResponseWriter& conn){
+    ostream out(&conn);
+    size_t n = rt.shards.size();
+    vector<string> reqs(n), replies;
+    string err;
+    string q = cmd;
+    string offset_str = cutTailClause(q, "OFFSET");
+    string limit_str = cutTailClause(q, "LIMIT");
+    string order_str = cutTailClause(q, "ORDER BY");
+    SelectParts sp;
+    if(!splitSelect(q, sp)){
+        out << "Error: Invalid SELECT syntax.\n";
+        co_return;
+    }
+    // Представление: у каждого шарда оно своё, по его части строк, поэтому
+    // читаем не его, а определение — с колонками запроса вместо своих
+    MatView* view = (sp.tables.size() == 1 && !sp.cross) ? findView(db, sp.tables[0]) : nullptr;
+    if(view){
+        if(!sp.where.empty() || !sp.group_cols.empty()){
+            out << "Error: WHERE and GROUP BY are not supported when reading a view.\n";
+            co_return;
         }
-        p1 = p1->next;
+        bool star = (sp.columns.size() == 1 && sp.columns[0] == "*");
+        string order_column;
+        istringstream(order_str) >> order_column;
+        if(!checkViewColumns(view, sp.columns.data(), sp.columns.size(), order_column, out)) co_return;
+        string def = view->query;
+        if(!star){
+            string cols;
+            for(size_t c = 0; c < sp.columns.size(); c++) cols += sp.columns[c] + " ";
+            def = "SELECT " + cols + def.substr(def.find("FROM"));
+        }
+        if(!order_str.empty()) def += " ORDER BY " + order_str;
+        if(!limit_str.empty()) def += " LIMIT " + limit_str;
+        if(!offset_str.empty()) def += " OFFSET " + offset_str;
+        co_await routeSelect(r, db, rt, def, conn);
+        co_return;
     }
 
-    if(!data_found){
-        out << "No data found after CROSS JOIN.\n";
+    bool aggregate = !sp.group_cols.empty() || hasAggregates(sp.columns.data(), sp.columns.size());
+    if(sp.cross && aggregate){
+        out << "Error: aggregates are not supported with CROSS JOIN.\n";
+        co_return;
+    }
+    RowLimit lim;
+    if(!parseRowLimit(limit_str, offset_str, lim)){
+        out << "Error: invalid LIMIT/OFFSET value.\n";
+        co_return;
+    }
+    OrderBy order;
+    {
+        istringstream oiss(order_str);
+        string dir;
+        oiss >> order.column >> dir;
+        for(size_t i = 0; i < dir.size(); i++) dir[i] = toupper(dir[i]);
+        order.desc = (dir == "DESC");
+    }
+
+    // Точечный запрос: равенство по ключу (единственное условие или через AND)
+    if(!aggregate && !sp.cross && sp.tables.size() == 1 && !sp.where.empty()){
+        Node* tbl = db.findNode(sp.tables[0]);
+        ConditionList cond_list;
+        string logical_op;
+        parseWhereClause(sp.where, cond_list, logical_op);
+        for(int i = 0; tbl && logical_op != "OR" && i < cond_list.count; i++){
+            const Condition& c = cond_list.conds[i];
+            string key;
+            if(c.column != tbl->shard_key || c.op != "=" || !shardKeyValue(tbl, c.value, key)) continue;
+            reqs[shardOf(key, n)] = cmd;
+            co_await shardExchange(r, rt, reqs, replies, err);
+            if(!err.empty()) out << err;
+            else out << replies[shardOf(key, n)];
+            co_return;
+        }
+    }
+
+    // Агрегаты: шарды возвращают частичные группы; слияние и сортировка
+    // групп — в пуле, реактор их не ждёт
+    if(aggregate){
+        vector<AggColumn> aggs;
+        if(!parseAggColumns(sp.columns.data(), sp.columns.size(), sp.group_cols.data(), sp.group_cols.size(), aggs, out)) co_return;
+        reqs.assign(n, "AGG " + q);
+        co_await shardExchange(r, rt, reqs, replies, err);
+        if(!err.empty()){
+            out << err;
+            co_return;
+        }
+        PoolRun run(db.pool, r, [&]{ mergeShardAggregates(sp, aggs, replies, order, lim, out); });
+        bool admitted = co_await run;
+        if(!admitted) out << "Error: server overloaded, try again later.\n";
+        co_return;
+    }
+
+    if(!sp.cross){
+        co_await routeScan(r, db, rt, sp, order, lim, conn);
+        co_return;
+    }
+
+    // CROSS JOIN: нужны все строки обеих таблиц, условие проверит само соединение
+    vector<vector<string>> rows(sp.tables.size());
+    for(size_t t = 0; t < sp.tables.size(); t++){
+        // Нет такой таблицы — ошибку выдаст сам запрос; одну таблицу дважды не собираем
+        if(!db.findNode(sp.tables[t]) || find(sp.tables.begin(), sp.tables.begin() + t, sp.tables[t]) != sp.tables.begin() + t) continue;
+        reqs.assign(n, "SCAN " + sp.tables[t]);
+        co_await shardExchange(r, rt, reqs, rows[t], err);
+        if(!err.empty()){
+            out << err;
+            co_return;
+        }
     }
+    PoolRun run(db.pool, r, [&]{ joinShardRows(db, sp, rows, cmd, conn); });
+    bool admitted = co_await run;
+    if(!admitted) out << "Error: server overloaded, try again later.\n";
 }
 
+Task routeCommand(Reactor& r, dbase& db, const string& cmd, ResponseWriter& conn){
+    ShardRouter& rt = *db.router;
+    ostream out(&conn);
+    istringstream iss(cmd);
+    string action;
+    iss >> action;
+    for(size_t i = 0; i < action.size(); i++) action[i] = toupper(action[i]);
+    size_t n = rt.shards.size();
+    vector<string> reqs(n), replies;
+    string err;
 
-// Обработка клиента
+    if(action == "SELECT"){
+        co_await routeSelect(r, db, rt, cmd, conn);
+        co_return;
+    }
+    if(action == "INSERT"){
+        // Ключ — в канонической записи, как его хранит таблица
+        string table;
+        iss >> table;
+        Node* tbl = db.findNode(table);
+        if(!tbl){
+            out << "Error: Table not found: " << table << "\n";
+            co_return;
+        }
+        vector<string> args;
+        string tmp;
+        while(iss >> tmp){
+            if(!tmp.empty() && tmp.front() == '"' && tmp.back() == '"'){
+                tmp = tmp.substr(1, tmp.size()-2);
+            }
+            args.push_back(tmp);
+        }
+        int k = tbl->findColumn(tbl->shard_key);
+        string key = (k >= 0 && k < (int)args.size()) ? args[k] : "";
+        string canon;
+        if(shardKeyValue(tbl, key, canon)) key = canon;
+        reqs[shardOf(key, n)] = cmd;
+    }
+    else if(action == "DELETE"){
+        // По ключу — один шард, по другой колонке — все
+        string from_word, table, col, val;
+        iss >> from_word >> table >> col >> val;
+        Node* tbl = db.findNode(table);
+        string key;
+        if(tbl && col == tbl->shard_key && shardKeyValue(tbl, val, key)) reqs[shardOf(key, n)] = cmd;
+        else reqs.assign(n, cmd);
+    }
+    else if(action == "CREATE"){
+        reqs.assign(n, cmd);
+    }
+    else{
+        out << "Unknown command: " << cmd << "\n";
+        co_return;
+    }
+    co_await shardExchange(r, rt, reqs, replies, err);
+    if(!err.empty()){
+        out << err;
+        co_return;
+    }
+    // Ответ одного шарда; при рассылке всем — первая ошибка, если она была
+    string reply;
+    for(size_t s = 0; s < n; s++){
+        if(reqs[s].empty()) continue;
+        if(reply.empty() || (replies[s].find("Error") != string::npos && reply.find("Error") == string::npos)) reply = replies[s];
+    }
+    // Определение нового представления нужно и здесь: его чтение
+    // маршрутизатор переписывает в запрос к таблице
+    string create_word, kind, view_word, name;
+    istringstream(cmd) >> create_word >> kind >> view_word >> name;
+    for(size_t i = 0; i < kind.size(); i++) kind[i] = toupper(kind[i]);
+    size_t sel = cmd.find("SELECT");
+    if(action == "CREATE" && kind == "MATERIALIZED" && sel != string::npos && reply.find("Error") == string::npos){
+        if(!defineView(db, name, cmd.substr(sel), err)) cerr << err << endl;
+    }
+    out << reply;
+}
 
-void handleClient(int client_socket, dbase& db) {
+Session clientSession(ServerRuntime& rt, Reactor& r, int client_socket){
+    dbase& db = rt.db;
     char buf[4096];
+    ResponseWriter conn(client_socket);
     while(true){
+        // Ответ на предыдущую команду дописываем до конца, прежде чем читать следующую
+        int st;
+        while((st = conn.sendPending()) == 0){
+            if(!co_await SocketReady(r, client_socket, EPOLLOUT, OUT_STALL_MS)){
+                st = -1;
+                break;
+            }
+        }
+        if(st < 0){
+            cout << "Client stopped reading, dropping connection.\n";
+            break;
+        }
         memset(buf, 0, sizeof(buf));
         int n = read(client_socket, buf, sizeof(buf)-1);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+            if(!co_await SocketReady(r, client_socket, EPOLLIN, db.limits.idle_timeout_ms)){
+                cout << "Idle connection closed.\n";
+                break;
+            }
+            continue;
+        }
         if(n <= 0){
             cout << "Client disconnected.\n";
             break;
@@ -668,281 +6393,264 @@ void handleClient(int client_socket, dbase& db) {
         while(!cmd.empty() && (cmd.back() == '\n' || cmd.back() == '\r')){
             cmd.pop_back();
         }
-        istringstream iss(cmd);
         string action;
-        iss >> action;
+        istringstream(cmd) >> action;
         for(size_t i = 0; i < action.size(); i++){
             action[i] = toupper(action[i]);
         }
-
         if(action == "EXIT"){
             cout << "Client requested EXIT.\n";
             break;
         }
-        else if(action == "INSERT"){
-            // INSERT <table> <name> <age> <adress> <number>
-            string table;
-            iss >> table;
-            const int MAX_ARGS = 10;
-            string args[MAX_ARGS];
-            int arg_count = 0;
-            string tmp;
-            while(iss >> tmp && arg_count < MAX_ARGS){
-                // remove quotes
-                if(!tmp.empty() && tmp.front() == '"' && tmp.back() == '"'){
-                    tmp = tmp.substr(1, tmp.size()-2);
-                }
-                args[arg_count++] = tmp;
-            }
-            if(arg_count < 2){
-                string e = "Error: Not enough args for INSERT.\n";
-                send(client_socket, e.c_str(), e.size(), 0);
-                continue;
-            }
-            json entry;
-            entry["name"] = args[0];
-            entry["age"] = args[1];
-            if(arg_count > 2) entry["adress"] = args[2]; else entry["adress"] = "";
-            if(arg_count > 3) entry["number"] = args[3]; else entry["number"] = "";
-            // Отладочное сообщение
-            cout << "INSERT command: table=" << table << ", name=" << entry["name"] 
-                 << ", age=" << entry["age"] << ", adress=" << entry["adress"] 
-                 << ", number=" << entry["number"] << endl;
-            insertRecord(db, table, entry);
-            string ok = "Data inserted.\n";
-            send(client_socket, ok.c_str(), ok.size(), 0);
-        }
-        else if(action == "DELETE"){
-            // DELETE FROM <table> <column> <value>
-            string from_word, table, col, val;
-            iss >> from_word >> table >> col >> val;
-            // Приводим 'FROM' к верхнему регистру
-            for(size_t i = 0; i < from_word.size(); i++){
-                from_word[i] = toupper(from_word[i]);
-            }
-            if(from_word != "FROM"){
-                string e = "Error: invalid DELETE syntax.\n";
-                send(client_socket, e.c_str(), e.size(), 0);
-                continue;
-            }
-            // Отладочное сообщение
-            cout << "DELETE command: table=" << table << ", column=" << col 
-                 << ", value=" << val << endl;
-            deleteRow(db, col, val, table);
-            string ok = "Row deleted.\n";
-            send(client_socket, ok.c_str(), ok.size(), 0);
-        }
-        else if(action == "SELECT"){
-            // SELECT <columns> FROM <tables> [CROSS JOIN <table>] [WHERE ...]
-            // Определяем, содержит ли запрос CROSS JOIN
-            size_t cross_pos = cmd.find("CROSS JOIN");
-            bool is_cross = false;
-            string table1, table2;
-            string columns_str, tables_str, where_str;
-            ConditionList cond_list;
-            string logical_op;
-
-            if(cross_pos != string::npos){
-                is_cross = true;
-                // Разделяем строку на части
-                // SELECT <columns> FROM <table1> CROSS JOIN <table2> [WHERE ...]
-                size_t select_pos = cmd.find("SELECT");
-                size_t from_pos = cmd.find("FROM");
-                size_t where_pos = cmd.find("WHERE");
-
-                if(select_pos == string::npos || from_pos == string::npos){
-                    string e = "Error: Invalid SELECT syntax.\n";
-                    send(client_socket, e.c_str(), e.size(), 0);
-                    continue;
-                }
-
-                columns_str = cmd.substr(select_pos + 6, from_pos - (select_pos +6));
-                // Удаляем возможные пробелы
-                size_t first = columns_str.find_first_not_of(" \t");
-                size_t last = columns_str.find_last_not_of(" \t");
-                if(first != string::npos && last != string::npos){
-                    columns_str = columns_str.substr(first, last - first +1);
-                }
-
-                // Извлекаем таблицы
-                // FROM <table1> CROSS JOIN <table2> [WHERE ...]
-                size_t cross_join_pos = cmd.find("CROSS JOIN");
-                tables_str = cmd.substr(from_pos +4, cross_join_pos - (from_pos +4));
-                // Удаляем пробелы
-                first = tables_str.find_first_not_of(" \t");
-                size_t end_cross = tables_str.find_last_not_of(" \t");
-                if(first != string::npos && end_cross != string::npos){
-                    tables_str = tables_str.substr(first, end_cross - first +1);
-                }
-                table1 = tables_str;
-
-                // Извлекаем table2
-                size_t table2_start = cross_join_pos + 10; // длина "CROSS JOIN"
-                size_t where_start = cmd.find("WHERE", table2_start);
-                if(where_start != string::npos){
-                    table2 = cmd.substr(table2_start, where_start - table2_start);
-                    where_str = cmd.substr(where_start +5);
-                }
-                else{
-                    table2 = cmd.substr(table2_start);
-                }
-                // Удаляем пробелы
-                first = table2.find_first_not_of(" \t");
-                size_t l = table2.find_last_not_of(" \t");
-                if(first != string::npos && l != string::npos){
-                    table2 = table2.substr(first, l - first +1);
-                }
-
-                // Парсим условия WHERE, если есть
-                if(where_pos != string::npos){
-                    parseWhereClause(where_str, cond_list, logical_op);
-                }
-
-                // Парсим колонки (разделение по пробелам)
-                const int MAX_COLS = 10;
-                string columns[MAX_COLS];
-                int col_count = 0;
-                istringstream ciss(columns_str);
-                while(col_count < MAX_COLS && ciss >> columns[col_count]){
-                    col_count++;
-                }
-
-                // Выполняем CROSS JOIN
-                ostringstream out;
-                crossJoinTables(db, table1, table2, columns, col_count, cond_list, logical_op, out);
-                string result = out.str();
-                send(client_socket, result.c_str(), result.size(), 0);
-            }
-            else{
-                // Обработка обычного SELECT (одна или несколько таблиц без CROSS JOIN)
-                // SELECT <columns> FROM <tables> [WHERE ...]
-                size_t select_pos = cmd.find("SELECT");
-                size_t from_pos = cmd.find("FROM");
-                size_t where_pos = cmd.find("WHERE");
-
-                if(select_pos == string::npos || from_pos == string::npos){
-                    string e = "Error: Invalid SELECT syntax.\n";
-                    send(client_socket, e.c_str(), e.size(), 0);
-                    continue;
-                }
-
-                columns_str = cmd.substr(select_pos +6, from_pos - (select_pos +6));
-                // Удаляем пробелы
-                size_t first = columns_str.find_first_not_of(" \t");
-                size_t last = columns_str.find_last_not_of(" \t");
-                if(first != string::npos && last != string::npos){
-                    columns_str = columns_str.substr(first, last - first +1);
-                }
-
-                // Извлекаем таблицы
-                // FROM <tables> [WHERE ...]
-                string tables_and_where;
-                if(where_pos != string::npos){
-                    tables_and_where = cmd.substr(from_pos +4, where_pos - (from_pos +4));
-                    where_str = cmd.substr(where_pos +5);
-                }
-                else{
-                    tables_and_where = cmd.substr(from_pos +4);
-                }
-                // Удаляем пробелы
-                first = tables_and_where.find_first_not_of(" \t");
-                size_t end_where = tables_and_where.find_last_not_of(" \t");
-                if(first != string::npos && end_where != string::npos){
-                    tables_and_where = tables_and_where.substr(first, end_where - first +1);
-                }
-
-                // Извлекаем таблицы (разделенные пробелами)
-                const int MAX_TABLES = 5;
-                string tables[MAX_TABLES];
-                int tab_count = 0;
-                istringstream tiss(tables_and_where);
-                string tbl;
-                while(tab_count < MAX_TABLES && tiss >> tbl){
-                    tables[tab_count++] = tbl;
-                }
-
-                // Парсим условия WHERE, если есть
-                if(where_pos != string::npos){
-                    parseWhereClause(where_str, cond_list, logical_op);
-                }
-
-                // Парсим колонки (разделение по пробелам)
-                const int MAX_COLS = 10;
-                string columns[MAX_COLS];
-                int col_count = 0;
-                istringstream ciss(columns_str);
-                while(col_count < MAX_COLS && ciss >> columns[col_count]){
-                    col_count++;
-                }
-
-                // Выполняем SELECT
-                ostringstream out;
-                if(tab_count == 1){
-                    selectFromTable(db, tables[0], columns, col_count, cond_list, logical_op, out);
-                }
-                else{
-                    // Поддержка нескольких таблиц (UNION)
-                    selectFromMultipleTables(db, columns, col_count, tables, tab_count, cond_list, logical_op, out);
-                }
-                string result = out.str();
-                send(client_socket, result.c_str(), result.size(), 0);
-            }
+        // Реплика: соединение уходит своему потоку, который шлёт ей журнал
+        if(action == "REPLICATE"){
+            string word;
+            uint64_t epoch = 0, from = 0;
+            istringstream(cmd) >> word >> epoch >> from;
+            cout << "Replica connected.\n";
+            r.forget(client_socket);
+            thread t(replicaFeed, ref(db), client_socket, epoch, from);
+            t.detach();
+            co_return;
         }
-        else{
-            string e = "Unknown command: " + cmd + "\n";
-            send(client_socket, e.c_str(), e.size(), 0);
+        // Маршрутизатор сам данных не хранит — команда уходит шардам
+        if(db.router){
+            co_await routeCommand(r, db, cmd, conn);
+            continue;
+        }
+        // Перегрузка: лучше сразу отказать, чем держать клиента в очереди без конца
+        uint64_t ticket = 0;
+        PoolRun run(db.pool, r, [&db, cmd, &conn, &ticket]{
+            uint64_t before = disk_ticket;
+            executeCommand(db, cmd, conn);
+            if(disk_ticket != before) ticket = disk_ticket;
+        });
+        bool admitted = co_await run;
+        if(!admitted){
+            string e = "Error: server overloaded, try again later.\n";
+            conn.put(e);
+        }
+        // Ответ на запись ещё в буфере соединения: отправим, когда она на диске
+        if(ticket){
+            co_await DiskSynced(r, ticket);
         }
     }
-
+    r.forget(client_socket);
     close(client_socket);
+    db.connections--;
     cout << "Connection closed.\n";
 }
 
+// Новое соединение — в очередной реактор по кругу
+void startSession(ServerRuntime& rt, int client_socket){
+    fcntl(client_socket, F_SETFL, fcntl(client_socket, F_GETFL) | O_NONBLOCK);
+    Reactor* r = rt.reactors[rt.next_reactor++ % rt.reactors.size()];
+    r->post([&rt, r, client_socket]{ clientSession(rt, *r, client_socket); });
+}
 
-// main()
-
-int main(){
-    dbase db;
-    loadSchema(db, "schema.json");
-    loadData(db);
 
+// Слушающий сокет (по умолчанию порт 7432). С SO_REUSEPORT таких сокетов
+// несколько, и ядро само раскладывает новые соединения между ними
+int openListener(int port, bool reuse_port, int backlog){
     int srv = socket(AF_INET, SOCK_STREAM, 0);
     if(srv < 0){
         cerr << "Can't create socket.\n";
-        return 1;
+        return -1;
     }
 
     int opt = 1;
     if (setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
         cerr << "setsockopt(SO_REUSEADDR) failed.\n";
         close(srv);
-        return 1;
+        return -1;
+    }
+    if (reuse_port && setsockopt(srv, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        cerr << "setsockopt(SO_REUSEPORT) failed.\n";
+        close(srv);
+        return -1;
     }
 
     sockaddr_in addr;
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(7432);
+    addr.sin_port = htons(port);
 
     if(bind(srv, (struct sockaddr*)&addr, sizeof(addr)) < 0){
         cerr << "Bind error. Port might be in use.\n";
         close(srv);
-        return 1;
+        return -1;
     }
-    listen(srv, 5);
-    cout << "Server listening on port 7432...\n";
+    listen(srv, backlog);
+    return srv;
+}
 
+// Сервер останавливается по SIGTERM/SIGINT: новые соединения больше не принимаются
+atomic<bool> server_stopping(false);
+
+// Цикл приёма соединений одного слушающего сокета
+void acceptLoop(int srv, ServerRuntime& rt){
+    dbase& db = rt.db;
     while(true){
         int client_sock = accept(srv, nullptr, nullptr);
         if(client_sock < 0){
+            if(server_stopping) return;
             cerr << "Accept error.\n";
             continue;
         }
+        // Сверх лимита соединений — короткий отказ вместо ещё одной сессии
+        if(db.connections.fetch_add(1) >= db.limits.max_connections){
+            db.connections--;
+            const char* busy = "Error: too many connections.\n";
+            send(client_sock, busy, strlen(busy), MSG_NOSIGNAL | MSG_DONTWAIT);
+            close(client_sock);
+            continue;
+        }
         cout << "Client connected.\n";
-        thread t(handleClient, client_sock, ref(db));
+        startSession(rt, client_sock);
+    }
+}
+
+
+// main()
+
+// Адрес "[HOST:]PORT"; без хоста — этот же компьютер
+bool parseHostPort(const string& target, string& host, int& port){
+    size_t colon = target.rfind(':');
+    host = (colon == string::npos) ? "127.0.0.1" : target.substr(0, colon);
+    if(host == "localhost") host = "127.0.0.1";
+    port = atoi(target.c_str() + (colon == string::npos ? 0 : colon + 1));
+    return port > 0 && port <= 65535;
+}
+
+// server [--listeners N] [--port P] [--follow [HOST:]PORT] [--shards [HOST:]PORT,...]
+//   --listeners — N сокетов с SO_REUSEPORT, у каждого свой поток приёма
+//   --follow    — реплика только для чтения: данные приходят журналом
+//                 ведущего сервера, свои файлы таблиц не читаются и не пишутся
+//   --shards    — маршрутизатор кластера: таблицы разложены по перечисленным
+//                 серверам, здесь только схема
+int main(int argc, char* argv[]){
+    int listeners = 1;
+    int port = 7432;
+    string follow_host;
+    int follow_port = 0;
+    ShardRouter* router = nullptr;
+    for(int i = 1; i < argc; i++){
+        string arg = argv[i];
+        if(arg == "--listeners" && i + 1 < argc){
+            listeners = atoi(argv[++i]);
+        }
+        else if(arg == "--port" && i + 1 < argc){
+            port = atoi(argv[++i]);
+        }
+        else if(arg == "--follow" && i + 1 < argc){
+            if(!parseHostPort(argv[++i], follow_host, follow_port)){
+                cerr << "Invalid port.\n";
+                return 1;
+            }
+        }
+        else if(arg == "--shards" && i + 1 < argc){
+            if(!router) router = new ShardRouter();
+            istringstream list(argv[++i]);
+            string target;
+            while(getline(list, target, ',')){
+                pair<string, int> shard;
+                if(!parseHostPort(target, shard.first, shard.second)){
+                    cerr << "Invalid shard address: " << target << "\n";
+                    return 1;
+                }
+                router->shards.push_back(shard);
+            }
+        }
+        else{
+            cerr << "Usage: " << argv[0] << " [--listeners N] [--port P] [--follow [HOST:]PORT] [--shards [HOST:]PORT,...]\n";
+            return 1;
+        }
+    }
+    if(listeners < 1){
+        cerr << "--listeners must be at least 1.\n";
+        return 1;
+    }
+    if(port <= 0 || port > 65535){
+        cerr << "Invalid port.\n";
+        return 1;
+    }
+    if(router && (router->shards.empty() || !follow_host.empty())){
+        cerr << "--shards needs at least one shard and can't be combined with --follow.\n";
+        return 1;
+    }
+
+    // SIGTERM/SIGINT ждёт main: маска наследуется всеми потоками, созданными ниже
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+
+    dbase db;
+    loadSchema(db, "schema.json");
+    if(router){
+        router->idle.resize(router->shards.size());
+        db.router = router;
+        db.persist = false;
+    }
+    else if(follow_host.empty()){
+        // Таблицы читаются при первом обращении к ним
+        db.loader = loadTableData;
+    }
+    else{
+        db.persist = false;
+        db.read_only = true;
+    }
+
+    // Пул команд и реакторы соединений
+    ServerRuntime rt(db);
+    db.pool.start(db.limits);
+    for(int i = 0; i < db.limits.io_threads; i++){
+        Reactor* r = new Reactor();
+        if(!r->init()){
+            cerr << "Can't create epoll reactor.\n";
+            return 1;
+        }
+        rt.reactors.push_back(r);
+        thread t(&Reactor::run, r);
+        t.detach();
+    }
+
+    vector<int> socks;
+    for(int i = 0; i < listeners; i++){
+        int srv = openListener(port, listeners > 1, db.limits.backlog);
+        if(srv < 0){
+            for(size_t k = 0; k < socks.size(); k++) close(socks[k]);
+            return 1;
+        }
+        socks.push_back(srv);
+    }
+    cout << "Server listening on port " << port;
+    if(listeners > 1) cout << " (" << listeners << " listeners)";
+    if(!follow_host.empty()) cout << ", read-only replica of " << follow_host << ":" << follow_port;
+    if(router) cout << ", routing to " << router->shards.size() << " shards";
+    cout << "...\n";
+
+    if(!follow_host.empty()){
+        thread t(followPrimary, ref(db), follow_host, follow_port);
+        t.detach();
+    }
+
+    for(int i = 0; i < listeners; i++){
+        thread t(acceptLoop, socks[i], ref(rt));
         t.detach();
     }
 
-    close(srv);
-    return 0;
+    // Остановка: прекращаем приём и дописываем очередь ввода-вывода — всё,
+    // что команды уже поставили, оказывается на диске
+    int sig = 0;
+    sigwait(&stop_signals, &sig);
+    cout << "Stopping server (signal " << sig << ")...\n";
+    server_stopping = true;
+    for(size_t k = 0; k < socks.size(); k++) shutdown(socks[k], SHUT_RDWR);
+    disk_io.drain();
+    cout << "Server stopped.\n";
+    cout.flush();
+    // Потоки сессий и пула ещё живы — без деструкторов глобальных объектов
+    _exit(0);
 }
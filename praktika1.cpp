@@ -3,6 +3,19 @@
 #include <sys/stat.h> // Для mkdir
 #include "json.hpp" // Библиотека для работы с JSON
 #include <sstream> // Для istringstream
+#include <string_view>
+#include <charconv> // Для to_chars
+#include <atomic> // Для счётчика первичных ключей
+#include <mutex>
+#include <thread> // Поток на клиента демона
+#include <sys/file.h> // Для flock
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <sys/socket.h> // Для режима демона
+#include <sys/un.h>
 
 using namespace std;
 using json = nlohmann::json;
@@ -13,7 +26,7 @@ struct Pars {
     T2 second;
 
     Pars() : first(T1()), second(T2()) {} // Конструктор по умолчанию
-    Pars(const T1& f, const T2& s) : first(f), second(s) {}
+    Pars(T1 f, T2 s) : first(move(f)), second(move(s)) {} // Временные значения переносятся без копии
 };
 
 struct Array {
@@ -25,46 +38,85 @@ struct Array {
         arr = new string[capacity];
     }
 
+    Array(const Array& other) : capacity(other.capacity), size(other.size) {
+        arr = new string[capacity];
+        for (size_t i = 0; i < size; ++i) {
+            arr[i] = other.arr[i];
+        }
+    }
+
+    // Перенос забирает буфер целиком, other остаётся пустым
+    Array(Array&& other) noexcept : arr(other.arr), capacity(other.capacity), size(other.size) {
+        other.arr = nullptr;
+        other.capacity = 0;
+        other.size = 0;
+    }
+
+    Array& operator=(Array other) noexcept { // Копия или перенос — в зависимости от аргумента
+        swap(other);
+        return *this;
+    }
+
     ~Array() {
         delete[] arr;
     }
 
+    void swap(Array& other) noexcept {
+        std::swap(arr, other.arr);
+        std::swap(capacity, other.capacity);
+        std::swap(size, other.size);
+    }
+
+    // Рост в два раза; элементы переносятся, а не копируются
+    void grow() {
+        size_t new_capacity = capacity ? capacity * 2 : 10;
+        string* new_arr = new string[new_capacity];
+        for (size_t i = 0; i < size; ++i) {
+            new_arr[i] = move(arr[i]);
+        }
+        delete[] arr;
+        arr = new_arr;
+        capacity = new_capacity;
+    }
+
     void addEnd(const string& value) {
         if (size >= capacity) {
-            capacity *= 2;
-            string* new_arr = new string[capacity];
-            for (size_t i = 0; i < size; ++i) {
-                new_arr[i] = arr[i];
-            }
-            delete[] arr;
-            arr = new_arr;
+            grow();
         }
         arr[size++] = value;
     }
 
-    string get(size_t index) const {
+    void addEnd(string&& value) {
+        if (size >= capacity) {
+            grow();
+        }
+        arr[size++] = move(value);
+    }
+
+    const string& get(size_t index) const {
         if (index >= size) throw out_of_range("Index out of range");
         return arr[index];
     }
 
+    string_view view(size_t index) const {
+        return get(index);
+    }
+
     size_t getSize() const {
         return size;
     }
-};
 
-struct Node {
-    string name;
-    Array data;
-    Node* next;
-
-    Node(const string& name) : name(name), next(nullptr) {}
+    void clear() {
+        size = 0;
+    }
 };
+
 template <typename T>
 struct NodeS {
     T data;
     NodeS* next;
 
-    NodeS(T data) : data(data), next(nullptr) {}
+    NodeS(T data) : data(move(data)), next(nullptr) {}
 };
 
 template <typename T>
@@ -75,30 +127,47 @@ struct Spisok {
 
     Spisok() : head(nullptr), tail(nullptr), size(0) {}
 
+    // Копировать узлы незачем, переносим; копия по значению приводила к двойному delete
+    Spisok(const Spisok&) = delete;
+    Spisok& operator=(const Spisok&) = delete;
+
+    Spisok(Spisok&& other) noexcept : head(other.head), tail(other.tail), size(other.size) {
+        other.head = nullptr;
+        other.tail = nullptr;
+        other.size = 0;
+    }
+
+    Spisok& operator=(Spisok&& other) noexcept {
+        if (this != &other) {
+            clear();
+            std::swap(head, other.head);
+            std::swap(tail, other.tail);
+            std::swap(size, other.size);
+        }
+        return *this;
+    }
+
     ~Spisok() {
+        clear();
+    }
+
+    void clear() {
         while (head) {
             NodeS<T>* temp = head;
             head = head->next;
             delete temp;
         }
+        tail = nullptr;
+        size = 0;
     }
     bool isEmpty() const {
         return head == nullptr; // Если голова равна nullptr, список пуст
     }
-    void append(const T& data) {
-        NodeS<T>* newNode = new NodeS<T>(data);
-        if (isEmpty()) {
-            head = newNode;
-        } else {
-            NodeS<T>* current = head;
-            while (current->next != nullptr) {
-                current = current->next;
-            }
-            current->next = newNode;
-        }
+    void append(T data) { // O(1): вставка за хвостом
+        addEnd(move(data));
     }
-    void addEnd(const T& value) {
-        NodeS<T>* newNode = new NodeS<T>(value);
+    void addEnd(T value) {
+        NodeS<T>* newNode = new NodeS<T>(move(value));
         if (!head) {
             head = newNode;
             tail = newNode;
@@ -113,6 +182,62 @@ struct Spisok {
         return size;
     }
 };
+
+struct Node {
+    string name;
+    Spisok<Array> data; // строки: значения в порядке колонок схемы, числа — в каноническом виде
+    Array columns; // имена колонок из схемы
+    Array types;   // их типы: string, int64, double или char(N)
+    Node* next;
+
+    // Первичные ключи выдаются из зарезервированного диапазона [next_pk..reserved_pk];
+    // на диске хранится только верхняя граница диапазона
+    atomic<long long> next_pk;
+    atomic<long long> reserved_pk; // -1 — диапазон ещё не зарезервирован
+    mutex pk_mutex;
+
+    atomic<bool> loaded; // CSV таблицы прочитан (загрузка — при первом обращении)
+    mutex load_mutex;
+
+    Node(const string& name) : name(name), next(nullptr), next_pk(0), reserved_pk(-1), loaded(false) {}
+};
+
+// Межпроцессная блокировка на время критической секции (flock на файл-замок).
+// Замки у каждой таблицы свои: параллельные процессы мешают друг другу
+// только на одной и той же таблице
+struct FileLock {
+    int fd;
+
+    FileLock(const string& path, bool shared = false) {
+        fd = open(path.c_str(), O_RDWR | O_CREAT, 0666);
+        if (fd < 0) {
+            throw runtime_error("Failed to open lock file: " + path);
+        }
+        while (flock(fd, shared ? LOCK_SH : LOCK_EX) != 0) {
+            if (errno != EINTR) {
+                close(fd);
+                throw runtime_error("Failed to lock: " + path);
+            }
+        }
+    }
+
+    ~FileLock() {
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+};
+
+// Замок данных таблицы (дозапись и перезапись CSV) и замок её счётчика ключей
+string tableLockPath(const string& schema_name, const string& table) {
+    return schema_name + "/" + table + "/data.lock";
+}
+
+string pkLockPath(const string& schema_name, const string& table) {
+    return schema_name + "/" + table + "/pk_sequence.lock";
+}
+
+string canonicalValue(const string& type, const string& value);
+
 struct dbase {
     string filename; 
     string schema_name;
@@ -129,7 +254,8 @@ struct dbase {
         }
     }
 
-    Node* findNode(const string& table_name) {
+    // Таблица без чтения её данных: для схемы, дозаписи и счётчика ключей
+    Node* findSchemaNode(const string& table_name) {
         Node* current = head;
         while (current) {
             if (current->name == table_name) {
@@ -140,6 +266,28 @@ struct dbase {
         return nullptr;
     }
 
+    // Таблица с данными: CSV читается при первом обращении, поэтому запуск
+    // платит только за те таблицы, которые нужны запросу
+    Node* findNode(const string& table_name) {
+        Node* current = findSchemaNode(table_name);
+        if (current) {
+            ensureLoaded(current);
+        }
+        return current;
+    }
+
+    // Одновременные первые обращения ждут одну загрузку
+    void ensureLoaded(Node* current) {
+        if (current->loaded) {
+            return;
+        }
+        lock_guard<mutex> guard(current->load_mutex);
+        if (!current->loaded) {
+            loadTable(current);
+            current->loaded = true;
+        }
+    }
+
     void addNode(const string& table_name) {
         Node* new_node = new Node(table_name);
         new_node->next = head;
@@ -147,27 +295,28 @@ struct dbase {
     }
 
     size_t getColumnCount(const string& table) {
-        Node* table_node = findNode(table);
+        Node* table_node = findSchemaNode(table);
         if (table_node) {
-            // Формируем путь к файлу CSV
-            string filename = schema_name + "/" + table + "/1.csv"; // Изменено на '/'
-            ifstream file(filename);
-            if (file) {
-                string header;
-                if (getline(file, header)) {
-                    // Считаем количество запятых в заголовке
-                    size_t comma_count = std::count(header.begin(), header.end(), ',');
-                    return comma_count + 1; // Количество колонок = количество запятых + 1
-                }
-            }
+            return table_node->columns.getSize(); // Колонки берём из схемы
         }
         return 0; 
     }
 
-    void load() {
-        Node* current = head;
-        while (current) {
+    // Чтение CSV одной таблицы под разделяемым замком: файл не читается
+    // посреди его перезаписи другим процессом
+    void loadTable(Node* current) {
+        try {
+            FileLock lock(tableLockPath(schema_name, current->name), true);
+            readTable(current);
+        } catch (const exception& e) {
+            cout << "Error: " << e.what() << endl;
+        }
+    }
+
+    // Чтение CSV таблицы; замок должен держать вызывающий
+    void readTable(Node* current) {
             try {
+                current->data.clear();
                 filename = schema_name + "/" + current->name + "/1.csv"; 
                 ifstream file(filename);
                 if (file) {
@@ -181,27 +330,32 @@ struct dbase {
                             is_header = false;
                             continue;
                         }
+                        if (line.empty()) {
+                            continue;
+                        }
 
-                        istringstream iss(line);
+                        // Пустое поле — значение строковой колонки, его не пропускаем;
+                        // запятая в конце строки тоже даёт пустое последнее поле
                         Array fields;
-                        string field;
-
-                        while (getline(iss, field, ',')) {
+                        size_t start = 0;
+                        while (true) {
+                            size_t comma = line.find(',', start);
+                            string field = line.substr(start, comma == string::npos ? string::npos : comma - start);
                             field.erase(0, field.find_first_not_of(" \t"));
                             field.erase(field.find_last_not_of(" \t") + 1);
-                            if (!field.empty()) {
-                                fields.addEnd(field);
+                            fields.addEnd(move(field));
+                            if (comma == string::npos) {
+                                break;
                             }
+                            start = comma + 1;
                         }
 
-                        if (fields.getSize() == 4) {
-                            json entry;
-                            entry["name"] = fields.get(0);
-                            entry["age"] = fields.get(1);
-                            entry["adress"] = fields.get(2);
-                            entry["number"] = fields.get(3);
-
-                            current->data.addEnd(entry.dump());
+                        // Строка с другим числом полей — не из этой схемы
+                        if (fields.getSize() == current->columns.getSize()) {
+                            for (size_t i = 0; i < fields.getSize(); ++i) {
+                                fields.arr[i] = canonicalValue(current->types.get(i), fields.arr[i]);
+                            }
+                            current->data.addEnd(move(fields));
                         } 
                     }
                 } else {
@@ -210,38 +364,96 @@ struct dbase {
             } catch (const exception& e) {
                 cout << "Error: " << e.what() << endl;
             }
-            current = current->next;
-        }
     }
 };
 
 void createDirectories(dbase& db, const json& structure);
-void lockPrimaryKey(dbase& db) {
-    try {
-        string pk_filename = db.schema_name + "/table_pk_sequence.txt";
-        ofstream pk_file(pk_filename);
-        if (pk_file) {
-            pk_file << db.current_pk << "\nlocked";
-        } else {
-            throw runtime_error("Failed to lock primary key file: " + pk_filename);
+
+// Тип колонки из схемы ("age:int64"); без типа — string
+string columnType(const Node* table_node, const string& column) {
+    for (size_t i = 0; i < table_node->columns.getSize(); ++i) {
+        if (table_node->columns.arr[i] == column) {
+            return table_node->types.arr[i];
         }
-    } catch (const exception& e) {
-        cout << "Error: " << e.what() << endl;
     }
+    return "string";
 }
 
-void unlockPrimaryKey(dbase& db) {
-    try {
-        string pk_filename = db.schema_name + "/table_pk_sequence.txt";
-        ofstream pk_file(pk_filename);
-        if (pk_file) {
-            pk_file << db.current_pk << "\nunlocked";
-        } else {
-            throw runtime_error("Failed to unlock primary key file: " + pk_filename);
+// Проверка значения по типу колонки
+bool checkValueType(const string& type, const string& value) {
+    if (type == "int64" || type == "double") {
+        if (value.empty()) return false;
+        char* end = nullptr;
+        errno = 0;
+        if (type == "int64") strtoll(value.c_str(), &end, 10);
+        else strtod(value.c_str(), &end);
+        return errno == 0 && *end == '\0';
+    }
+    if (type.compare(0, 5, "char(") == 0) {
+        return value.size() <= stoul(type.substr(5));
+    }
+    return true;
+}
+
+// Каноническая запись числа: "007" и "+7" хранятся как "7", "1e1" — как "10".
+// Равные значения после этого совпадают побайтно. Не проходящее проверку
+// типа значение остаётся как есть
+string canonicalValue(const string& type, const string& value) {
+    if (!checkValueType(type, value)) {
+        return value;
+    }
+    if (type == "int64") {
+        return to_string(strtoll(value.c_str(), nullptr, 10));
+    }
+    if (type == "double") {
+        char buf[32];
+        auto res = to_chars(buf, buf + sizeof(buf), strtod(value.c_str(), nullptr)); // Кратчайшая запись того же числа
+        return string(buf, res.ptr);
+    }
+    return value;
+}
+
+// Номер колонки в схеме; -1 — нет такой
+int columnIndex(const Node* table_node, const string& column) {
+    for (size_t i = 0; i < table_node->columns.getSize(); ++i) {
+        if (table_node->columns.arr[i] == column) {
+            return (int)i;
         }
-    } catch (const exception& e) {
-        cout << "Error: " << e.what() << endl;
     }
+    return -1;
+}
+
+// Условие "колонка = значение", разобранное один раз на запрос: номер колонки
+// и значение в канонической записи. Строка проверяется сравнением строк без
+// разбора чисел. Значение не того типа не совпадает ни с одной строкой
+struct ColumnMatch {
+    int col;
+    string value;
+
+    ColumnMatch() : col(-1) {}
+    ColumnMatch(const Node* table_node, const string& column, const string& raw) : col(columnIndex(table_node, column)) {
+        if (col >= 0) {
+            const string& type = table_node->types.get(col);
+            if ((type == "int64" || type == "double") && !checkValueType(type, raw)) {
+                col = -1;
+            } else {
+                value = canonicalValue(type, raw);
+            }
+        }
+    }
+
+    bool matches(const Array& row) const {
+        return col >= 0 && (size_t)col < row.getSize() && row.arr[col] == value;
+    }
+};
+
+// Строка как JSON-объект — для сообщений
+json rowToJson(const Node* table_node, const Array& row) {
+    json entry;
+    for (size_t c = 0; c < table_node->columns.getSize() && c < row.getSize(); ++c) {
+        entry[table_node->columns.arr[c]] = row.arr[c];
+    }
+    return entry;
 }
 
 void loadSchema(dbase& db, const string& schema_file) {
@@ -254,6 +466,13 @@ void loadSchema(dbase& db, const string& schema_file) {
             createDirectories(db, schema["structure"]);
             for (const auto& table : schema["structure"].items()) {
                 db.addNode(table.key());
+                Node* table_node = db.findSchemaNode(table.key());
+                for (const auto& column : table.value()) {
+                    string spec = column.get<string>();
+                    size_t colon = spec.find(':');
+                    table_node->columns.addEnd(spec.substr(0, colon));
+                    table_node->types.addEnd(colon == string::npos ? "string" : spec.substr(colon + 1));
+                }
             }
         } else {
             throw runtime_error("Failed to open schema file.");
@@ -284,28 +503,63 @@ void initializePrimaryKey(dbase& db) {
     }
 }
 
-void updatePrimaryKey(dbase& db) {
-    try {
-        string pk_filename = db.schema_name + "/table_pk_sequence.txt";
+const long long PK_RESERVE_BLOCK = 1000; // Сколько ID резервируется одной записью на диск
 
-        ifstream pk_file(pk_filename);
-        if (pk_file) {
-            pk_file >> db.current_pk;
-        } else {
-            db.current_pk = 0;
-        }
-        pk_file.close();
+string pkSequencePath(dbase& db, const string& table) {
+    return db.schema_name + "/" + table + "/pk_sequence.txt";
+}
 
-        db.current_pk++;
+// Запись новой верхней границы: через временный файл, чтобы не оставить его пустым
+void writePrimaryKeyMark(dbase& db, Node* table_node, long long mark) {
+    string pk_filename = pkSequencePath(db, table_node->name);
+    string tmp_filename = pk_filename + ".tmp";
+    ofstream pk_file(tmp_filename);
+    if (!pk_file) {
+        throw runtime_error("Failed to open file for updating: " + tmp_filename);
+    }
+    pk_file << mark << "\n";
+    pk_file.close();
+    if (rename(tmp_filename.c_str(), pk_filename.c_str()) != 0) {
+        throw runtime_error("Failed to update file: " + pk_filename);
+    }
+}
 
-        ofstream pk_file_out(pk_filename);
-        if (pk_file_out) {
-            pk_file_out << db.current_pk << "\nlocked";
-        } else {
-            throw runtime_error("Failed to open file for updating: " + pk_filename);
+// Резервирование следующего диапазона. Граница читается с диска под замком:
+// другой процесс мог уже забрать диапазоны за нашим. Если так, счётчик
+// перескакивает в новый диапазон, а всё зарезервированное раньше и не выданное
+// (в том числе до падения прошлого процесса) пропускается
+void reservePrimaryKeys(dbase& db, Node* table_node) {
+    FileLock lock(pkLockPath(db.schema_name, table_node->name));
+    long long mark = db.current_pk; // Без своего файла продолжаем старый общий счётчик
+    ifstream pk_file(pkSequencePath(db, table_node->name));
+    if (pk_file) {
+        pk_file >> mark;
+    }
+    pk_file.close();
+    writePrimaryKeyMark(db, table_node, mark + PK_RESERVE_BLOCK);
+    if (mark != table_node->reserved_pk) {
+        table_node->next_pk = mark + 1;
+    }
+    table_node->reserved_pk = mark + PK_RESERVE_BLOCK;
+}
+
+// Следующий ID таблицы: атомарный счётчик, на диск — раз в PK_RESERVE_BLOCK вставок.
+// ID выдаётся сравнением с обменом: значение, прочитанное до перескока
+// счётчика в новый диапазон, выдано не будет
+long long allocatePrimaryKey(dbase& db, Node* table_node) {
+    long long id = table_node->next_pk;
+    while (true) {
+        if (id > table_node->reserved_pk) {
+            lock_guard<mutex> guard(table_node->pk_mutex);
+            if (table_node->next_pk > table_node->reserved_pk) {
+                reservePrimaryKeys(db, table_node);
+            }
+            id = table_node->next_pk;
+            continue;
+        }
+        if (table_node->next_pk.compare_exchange_weak(id, id + 1)) {
+            return id;
         }
-    } catch (const exception& e) {
-        cout << "Error: " << e.what() << endl;
     }
 }
 
@@ -334,7 +588,8 @@ void createDirectories(dbase& db, const json& structure) {
                 if (file.is_open()) {
                     auto& columns = table.value();
                     for (size_t i = 0; i < columns.size(); ++i) {
-                        file << setw(10) << left << columns[i].get<string>() << (i < columns.size() - 1 ? ", " : "");
+                        string spec = columns[i].get<string>();
+                        file << setw(10) << left << spec.substr(0, spec.find(':')) << (i < columns.size() - 1 ? ", " : "");
                     }
                     file << "\n";
                     file.close();
@@ -348,52 +603,29 @@ void createDirectories(dbase& db, const json& structure) {
     }
 }
 
-bool applyFilters(const string& table, const json& entry, const Spisok<Pars<string, string>>& filters) {
-    
+// Условие строки таблицы в запросе с двумя фильтрами: table1 проверяется
+// по первому фильтру, остальные таблицы — по второму
+ColumnMatch tableFilter(const Node* table_node, const Spisok<Pars<string, string>>& filters) {
     if (filters.head == nullptr) {
-        return false; // Если список пуст, возвращаем false
+        return ColumnMatch(); // Пустой список — не совпадает ничего
     }
-    if (table == "table1"){
-        const string& filter_column = filters.head->data.first; // Получаем ключ фильтра
-        const string& filter_value = filters.head->data.second; // Получаем значение фильтра
-
-        // Проверяем, есть ли колонка в записи и совпадает ли значение
-        if (!entry.contains(filter_column) || entry[filter_column].get<string>() != filter_value) {
-            return false; // Если не совпадает, возвращаем false
-        }
-    }   
-    else{
-
-        NodeS<Pars<string, string>>* current = filters.head;
-        current = current->next;
-        const string& filter_column = current->data.first; // Получаем ключ фильтра
-        const string& filter_value = current->data.second; // Получаем значение фильтра
-        if (!entry.contains(filter_column) || entry[filter_column].get<string>() != filter_value) {
-            return false; // Если не совпадает, возвращаем false
-        }
+    if (table_node->name == "table1" || filters.head->next == nullptr) {
+        return ColumnMatch(table_node, filters.head->data.first, filters.head->data.second);
     }
-    return true; // Если фильтр прошёл, возвращаем true
+    return ColumnMatch(table_node, filters.head->next->data.first, filters.head->next->data.second);
 }
 
-bool applyFilter(const json& entry, const Spisok<Pars<string, string>>& filters) {
-    
+// Условие по первому фильтру
+ColumnMatch firstFilter(const Node* table_node, const Spisok<Pars<string, string>>& filters) {
     if (filters.head == nullptr) {
-        return false; // Если список пуст, возвращаем false
+        return ColumnMatch();
     }
-        const string& filter_column = filters.head->data.first; // Получаем ключ фильтра
-        const string& filter_value = filters.head->data.second; // Получаем значение фильтра
-
-        // Проверяем, есть ли колонка в записи и совпадает ли значение
-        if (!entry.contains(filter_column) || entry[filter_column].get<string>() != filter_value) {
-            return false; // Если не совпадает, возвращаем false
-        } 
-
-    return true; // Если фильтр прошёл, возвращаем true
+    return ColumnMatch(table_node, filters.head->data.first, filters.head->data.second);
 }
 
 
 
-void selectFromMultipleTables(dbase& db, const string& column,const string& column2, const string& table1,const string& table2, Spisok<Pars<string, string>> filters, int filter_count,const string& WHERE ,const string& filter_type,const string& tablef) {
+void selectFromMultipleTables(dbase& db, const string& column,const string& column2, const string& table1,const string& table2, const Spisok<Pars<string, string>>& filters, int filter_count,const string& WHERE ,const string& filter_type,const string& tablef) {
 
     string column1 = column; 
 
@@ -405,63 +637,37 @@ void selectFromMultipleTables(dbase& db, const string& column,const string& colu
             cout << "One or both tables not found: " << table1 << ", " << table2 << endl;
             return;
         }
-        if (WHERE == "WHERE"){
-            if( filter_type != ""){
-                for (size_t i = 0; i < table_node1->data.getSize(); ++i) {
-                    json entry1 = json::parse(table_node1->data.get(i));
-
-                    for (size_t j = 0; j < table_node2->data.getSize(); ++j) {
-                        json entry2 = json::parse(table_node2->data.get(j));
-
-                        if ((filter_type == "AND" && applyFilters(table1, entry1, filters) && applyFilters(table2, entry2, filters)) ||
-                        (filter_type == "OR" && (applyFilters(table1, entry1, filters) || applyFilters(table2, entry2, filters)))) {
-                    
-                            if (entry1.contains(column1) && entry2.contains(column2)) {
-                                cout << entry1[column1].get<string>() << ", " << entry2[column2].get<string>() << endl;
-                                data_found = true;
-                            }
-                        }
-                    }
-                }
-            }
-            else{
-                for (size_t i = 0; i < table_node1->data.getSize(); ++i) {
-                    json entry1 = json::parse(table_node1->data.get(i));
-
-                    for (size_t j = 0; j < table_node2->data.getSize(); ++j) {
-                        json entry2 = json::parse(table_node2->data.get(j));
-                        if(tablef=="table1"){
-                            if (applyFilter(entry1, filters)) {
-                               
-                                if (entry1.contains(column1) && entry2.contains(column2)) {
-                                    cout << entry1[column1].get<string>() << ", " << entry2[column2].get<string>() << endl;
-                                    data_found = true;
-                                }   
-                            }
-                        } else{
-                            if (applyFilter(entry2, filters)) {
-                               
-                                if (entry1.contains(column1) && entry2.contains(column2)) {
-                                    cout << entry1[column1].get<string>() << ", " << entry2[column2].get<string>() << endl;
-                                    data_found = true;
-                                }   
-                            }
-                        }
+        int col1 = columnIndex(table_node1, column1);
+        int col2 = columnIndex(table_node2, column2);
+        if (col1 < 0 || col2 < 0) {
+            cout << "No data found in the cross join of " << table1 << " and " << table2 << endl;
+            return;
+        }
+        bool filtered = WHERE == "WHERE";
+        bool both = filter_type != ""; // AND/OR по обеим таблицам или фильтр одной таблицы tablef
+        ColumnMatch match1 = both ? tableFilter(table_node1, filters) : firstFilter(table_node1, filters);
+        ColumnMatch match2 = both ? tableFilter(table_node2, filters) : firstFilter(table_node2, filters);
+
+        for (NodeS<Array>* r1 = table_node1->data.head; r1; r1 = r1->next) {
+            const Array& row1 = r1->data;
+            bool pass1 = filtered && match1.matches(row1);
+
+            for (NodeS<Array>* r2 = table_node2->data.head; r2; r2 = r2->next) {
+                const Array& row2 = r2->data;
+                if (filtered) {
+                    bool pass;
+                    if (both) {
+                        pass = (filter_type == "AND" && pass1 && match2.matches(row2)) ||
+                               (filter_type == "OR" && (pass1 || match2.matches(row2)));
+                    } else {
+                        pass = tablef == "table1" ? pass1 : match2.matches(row2);
                     }
-                }
-            }
-        } else{
-            for (size_t i = 0; i < table_node1->data.getSize(); ++i) {
-                json entry1 = json::parse(table_node1->data.get(i));
-
-                for (size_t j = 0; j < table_node2->data.getSize(); ++j) {
-                    json entry2 = json::parse(table_node2->data.get(j));
-
-                    if (entry1.contains(column1) && entry2.contains(column2)) {
-                        cout << entry1[column1].get<string>() << ", " << entry2[column2].get<string>() << endl;
-                        data_found = true;
+                    if (!pass) {
+                        continue;
                     }
                 }
+                cout << row1.arr[col1] << ", " << row2.arr[col2] << endl;
+                data_found = true;
             }
         }
     } else {
@@ -475,7 +681,7 @@ void selectFromMultipleTables(dbase& db, const string& column,const string& colu
     }
 }
 
-void selectFromTable(dbase& db, const string& table, Spisok<Pars<string, string>> filters, int filter_count, const string& filter_type) {
+void selectFromTable(dbase& db, const string& table, const Spisok<Pars<string, string>>& filters, int filter_count, const string& filter_type) {
     Node* table_node = db.findNode(table);
     
     if (!table_node) {
@@ -484,15 +690,16 @@ void selectFromTable(dbase& db, const string& table, Spisok<Pars<string, string>
     }
 
     bool data_found = false;
-    for (size_t i = 0; i < table_node->data.getSize(); ++i) {
-        json entry = json::parse(table_node->data.get(i));
+    for (NodeS<Array>* r = table_node->data.head; r; r = r->next) {
+        const Array& row = r->data;
         data_found = true; // We found at least one entry
 
         // Print the entry in the desired format
-        cout << "name: \"" << entry["name"].get<string>() << "\", "
-             << "age: \"" << entry["age"].get<string>() << "\", "
-             << "adress: \"" << entry["adress"].get<string>() << "\", "
-             << "number: \"" << entry["number"].get<string>() << "\";" << endl;
+        for (size_t c = 0; c < table_node->columns.getSize(); ++c) {
+            cout << table_node->columns.get(c) << ": \"" << (c < row.getSize() ? row.arr[c] : "") << "\""
+                 << (c + 1 < table_node->columns.getSize() ? ", " : ";");
+        }
+        cout << endl;
     }
 
     if (!data_found) {
@@ -500,23 +707,25 @@ void selectFromTable(dbase& db, const string& table, Spisok<Pars<string, string>
     }
 }
 
-void saveSingleEntryToCSV(dbase& db, const string& table, const json& entry) {
+void saveSingleEntryToCSV(dbase& db, const string& table, const Array& row, long long id) {
     try {
         string filename = db.schema_name + "/" + table + "/1.csv"; 
+        FileLock lock(tableLockPath(db.schema_name, table)); // Строки разных процессов не перемешиваются
         ofstream file(filename, ios::app);
-        if (file) {
-            // Проверяем, сколько полей есть в JSON-объекте
-            if (entry.contains("name") && entry.contains("age")) {
-                file << setw(10) << left << entry["name"].get<string>() << ", "
-                     << setw(10) << left << entry["age"]
-                     << ", " << setw(10) << left << entry["adress"].get<string>() << ", "
-                    << setw(10) << left << entry["number"].get<string>();
-
-                file << "\n"; 
-                cout << "Data successfully saved for: " << entry.dump() << endl;
-            } else {
-                throw runtime_error("Entry must contain 'name' and 'age'.");
+        Node* table_node = db.findSchemaNode(table);
+        if (file && table_node) {
+            // Колонки и их порядок — из схемы
+            const Array& columns = table_node->columns;
+            if (row.getSize() != columns.getSize()) {
+                throw runtime_error("Entry must contain all " + to_string(columns.getSize()) + " columns.");
+            }
+            for (size_t i = 0; i < columns.getSize(); ++i) {
+                file << setw(10) << left << row.arr[i] << (i + 1 < columns.getSize() ? ", " : "");
             }
+            file << "\n"; 
+            json entry = rowToJson(table_node, row);
+            entry["id"] = id;
+            cout << "Data successfully saved for: " << entry.dump() << endl;
         } else {
             throw runtime_error("Failed to open data file for saving: " + filename);
         }
@@ -525,39 +734,53 @@ void saveSingleEntryToCSV(dbase& db, const string& table, const json& entry) {
     }
 }
 
-void insert(dbase& db, const string& table, json entry) {
-    Node* table_node = db.findNode(table);
+// Вставка строки: значения уже проверены по типам и записаны канонически.
+// Колонка id схемы, если она есть, получает выданный первичный ключ
+void insert(dbase& db, const string& table, Array row) {
+    Node* table_node = db.findSchemaNode(table);
     if (table_node) {
-        // Если количество аргументов совпадает с количеством колонок, продолжаем
-        updatePrimaryKey(db); 
-        entry["id"] = db.current_pk; 
+        long long id = allocatePrimaryKey(db, table_node);
+        int id_col = columnIndex(table_node, "id");
+        if (id_col >= 0) {
+            row.arr[id_col] = to_string(id);
+        }
 
-        table_node->data.addEnd(entry.dump());
+        // Незагруженную таблицу не читаем: строка и так будет в CSV
+        if (table_node->loaded) {
+            table_node->data.addEnd(row);
+        }
 
-        saveSingleEntryToCSV(db, table, entry);
+        saveSingleEntryToCSV(db, table, row, id);
     } else {
         cout << "Table not found: " << table << endl;
     }
 }
 
 void deleteRow(dbase& db, const string& column, const string& value, const string& table) {
-    Node* table_node = db.findNode(table);
+    Node* table_node = db.findSchemaNode(table); // Данные читаются ниже, под замком
     if (table_node) {
-        Array new_data;
+        // Под замком перечитываем таблицу: с момента загрузки другие процессы
+        // могли дописать строки, и перезапись CSV не должна их потерять
+        FileLock lock(tableLockPath(db.schema_name, table));
+        lock_guard<mutex> guard(table_node->load_mutex);
+        db.readTable(table_node);
+        table_node->loaded = true;
+
+        Spisok<Array> new_data;
         bool found = false;
 
-        for (size_t i = 0; i < table_node->data.getSize(); ++i) {
-            json entry = json::parse(table_node->data.get(i));
-            if (entry.contains(column) && entry[column].get<string>() == value) {
+        ColumnMatch match(table_node, column, value);
+        for (NodeS<Array>* r = table_node->data.head; r; r = r->next) {
+            if (match.matches(r->data)) {
                 found = true;
-                cout << "Deleted row: " << entry.dump() << endl;
+                cout << "Deleted row: " << rowToJson(table_node, r->data).dump() << endl;
             } else {
-                new_data.addEnd(table_node->data.get(i));
+                new_data.addEnd(move(r->data)); // Строку переносим, не копируем
             }
         }
 
+        table_node->data = move(new_data); // Без совпадений в new_data все строки
         if (found) {
-            table_node->data = new_data;
             rewriteCSV(db, table);
         } else {
             cout << "Row with " << column << " = " << value << " not found in " << table << endl;
@@ -573,19 +796,18 @@ void rewriteCSV(dbase& db, const string& table) {
         ofstream file(db.filename); 
 
         if (file) {
-            Node* table_node = db.findNode(table);
+            Node* table_node = db.findSchemaNode(table);
             if (table_node) {
-                json columns = {"name", "age", "adress", "number"};
+                const Array& columns = table_node->columns;
 
-                for (const auto& column : columns) {
-                    file << setw(10) << left << column.get<string>() << (column != columns.back() ? ", " : "");
+                for (size_t c = 0; c < columns.getSize(); ++c) {
+                    file << setw(10) << left << columns.arr[c] << (c + 1 < columns.getSize() ? ", " : "");
                 }
                 file << "\n"; 
 
-                for (size_t i = 0; i < table_node->data.getSize(); ++i) {
-                    json entry = json::parse(table_node->data.get(i));
-                    for (const auto& column : columns) {
-                        file << setw(10) << left << entry[column.get<string>()].get<string>() << (column != columns.back() ? ", " : "");
+                for (NodeS<Array>* r = table_node->data.head; r; r = r->next) {
+                    for (size_t c = 0; c < columns.getSize() && c < r->data.getSize(); ++c) {
+                        file << setw(10) << left << r->data.arr[c] << (c + 1 < columns.getSize() ? ", " : "");
                     }
                     file << "\n"; 
                 }
@@ -599,94 +821,202 @@ void rewriteCSV(dbase& db, const string& table) {
     }
 }
 
-int main(int argc, char* argv[]) {
-    dbase db;
+// Выполнение одного запроса; 0 — успех
+int executeQuery(dbase& db, const string& query) {
+    istringstream iss(query);
+    string action;
+    iss >> action;
+
     try {
-        loadSchema(db, "schema.json");
-        db.load();
+        if (action == "INSERT") {
+            string table;
+            iss >> table;
 
-        if (argc > 2 && string(argv[1]) == "--query") {
-            string query = argv[2];
-            istringstream iss(query);
-            string action;
-            iss >> action;
+            Array args; // Используем новый массив
+            string arg;
 
-            try {
-                if (action == "INSERT") {
-                    string table;
-                    iss >> table;
+            // Чтение всех оставшихся аргументов
+            while (iss >> arg) {
+                args.addEnd(arg);
+            }
 
-                    Array args; // Используем новый массив
-                    string arg;
+            // Получаем ожидаемое количество аргументов
+            size_t expected_arg_count = db.getColumnCount(table);
+            if (args.getSize() > expected_arg_count) {
+                cout << "Error: Too many arguments (" << args.getSize() << ") for INSERT command." << endl;
+                return 1;
+            } else if (args.getSize() < 2) { 
+                cout << "Error: Not enough arguments (" << args.getSize() << ") for INSERT command." << endl;
+                return 1;
+            }
 
-                    // Чтение всех оставшихся аргументов
-                    while (iss >> arg) {
-                        args.addEnd(arg);
-                    }
+            // Строка из аргументов: колонки и типы — из схемы. Проверяются все
+            // колонки: пропущенная числовая колонка — ошибка, а не пустая строка.
+            // Колонку id заполняет insert
+            Node* table_node = db.findSchemaNode(table);
+            int id_col = columnIndex(table_node, "id");
+            Array row;
+            for (size_t i = 0; i < table_node->columns.getSize(); ++i) {
+                string value = i < args.getSize() ? args.get(i) : ""; // Значение по умолчанию
+                string type = table_node->types.get(i);
+                if ((int)i != id_col && !checkValueType(type, value)) {
+                    cout << "Error: Column " << table_node->columns.get(i) << " expects " << type << ", got \"" << value << "\"." << endl;
+                    return 1;
+                }
+                row.addEnd(canonicalValue(type, value));
+            }
+            insert(db, table, move(row));
+        } else if (action == "SELECT") {
+            string column,column2, from, tables;
+            iss >> from >> tables;
+
+            if (tables == "tables:") {
+                string table1, and_word, table2, WHERE,filter_column1,filter_value1,filter_value2, OPER, filter_column2,tablef;
+                iss >> table1 >> column >> and_word >> table2>> column2 >>WHERE >> tablef >> filter_column1>> filter_value1>> OPER>> table2>>filter_column2>>filter_value2 ;
+                Spisok<Pars<string, string>> filters;
+                int filter_count = 0;
+                filters.addEnd(Pars<string, string>(filter_column1, filter_value1));
+                filters.addEnd(Pars<string, string>(filter_column2, filter_value2));
+
+                selectFromMultipleTables(db, column,column2, table1, table2, filters, 0,WHERE,OPER,tablef);
+
+            } else if (tables != "tables:"){
+                string table;
+                table = tables;
+                selectFromTable(db, table, {}, 0, "AND");
 
-                    // Получаем ожидаемое количество аргументов
-                    size_t expected_arg_count = db.getColumnCount(table);
-                    if (args.getSize() > expected_arg_count) {
-                        cout << "Error: Too many arguments (" << args.getSize() << ") for INSERT command." << endl;
-                        return 1;
-                    } else if (args.getSize() < 2) { 
-                        cout << "Error: Not enough arguments (" << args.getSize() << ") for INSERT command." << endl;
-                        return 1;
-                    }
+            } else {
+                throw runtime_error("Invalid query format.");
+            }
+        } else if (action == "DELETE") {
+            string column, from, value, table;
+            iss >> from >> table >> column >> value;
+            deleteRow(db, column, value, table);
+        } else {
+            throw runtime_error("Unknown command: " + query);
+        }
+    } catch (const exception& e) {
+        cout << "Error: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Пакетный режим: по запросу на строку, схема и данные загружены один раз.
+// Пустые строки и строки с # пропускаются
+int runBatch(dbase& db, istream& in) {
+    string line;
+    size_t total = 0, failed = 0;
+    while (getline(in, line)) {
+        line.erase(0, line.find_first_not_of(" \t\r"));
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        total++;
+        if (executeQuery(db, line) != 0) {
+            failed++;
+        }
+    }
+    cerr << "Executed " << total << " statements, " << failed << " failed." << endl;
+    return failed == 0 ? 0 : 1;
+}
 
-                    // Создание JSON-объекта из аргументов
-                    json entry = {
-                        {"name", args.get(0)},
-                        {"age", stoi(args.get(1))}
-                    };
+// Запросы демона выполняются по одному: вывод идёт через общий cout, а таблицы
+// в памяти не рассчитаны на параллельные изменения. Чтение запросов и отправка
+// ответов — вне замка, поэтому медленный клиент не задерживает остальных
+mutex query_mutex;
+
+// Сессия одного клиента: запросы построчно, вывод каждого — в ответ
+void serveClient(dbase& db, int client) {
+    string pending;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(client, buf, sizeof(buf))) > 0) {
+        pending.append(buf, n);
+        size_t eol;
+        while ((eol = pending.find('\n')) != string::npos) {
+            string line = pending.substr(0, eol);
+            pending.erase(0, eol + 1);
+            line.erase(0, line.find_first_not_of(" \t\r"));
+            line.erase(line.find_last_not_of(" \t\r") + 1);
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            // Вывод запроса уходит клиенту, а не в stdout демона
+            ostringstream reply;
+            {
+                lock_guard<mutex> guard(query_mutex);
+                streambuf* old = cout.rdbuf(reply.rdbuf());
+                executeQuery(db, line);
+                cout.rdbuf(old);
+            }
+            string text = reply.str();
+            for (size_t sent = 0; sent < text.size(); ) {
+                ssize_t w = write(client, text.data() + sent, text.size() - sent);
+                if (w <= 0) break;
+                sent += w;
+            }
+        }
+    }
+    close(client);
+}
 
-                    // Добавляем дополнительные поля, если они есть
-                    if (args.getSize() > 2) {
-                        entry["adress"] = args.get(2);
-                    } else {
-                        entry["adress"] = ""; // Значение по умолчанию
-                    }
+// Локальный демон на Unix-сокете: клиент пишет запросы построчно и получает
+// вывод каждого (например, nc -U -N <socket> < script.sql). Каждый клиент
+// обслуживается своим потоком, подключения принимаются сразу
+int serveUnixSocket(dbase& db, const string& path) {
+    int srv = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (srv < 0) {
+        throw runtime_error("Failed to create socket.");
+    }
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw runtime_error("Socket path is too long: " + path);
+    }
+    strcpy(addr.sun_path, path.c_str());
+    unlink(path.c_str()); // Сокет от прошлого запуска
+    if (::bind(srv, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(srv, 16) < 0) {
+        close(srv);
+        throw runtime_error("Failed to listen on " + path);
+    }
+    cerr << "Listening on " << path << endl;
+    signal(SIGPIPE, SIG_IGN);
+    while (true) {
+        int client = accept(srv, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        thread(serveClient, ref(db), client).detach();
+    }
+    close(srv);
+    return 1;
+}
 
-                    if (args.getSize() > 3) {
-                        entry["number"] = args.get(3);
-                    } else {
-                        entry["number"] = ""; // Значение по умолчанию
-                    }
-                    insert(db, table, entry);
-                } else if (action == "SELECT") {
-                    string column,column2, from, tables;
-                    iss >> from >> tables;
-
-                    if (tables == "tables:") {
-                        string table1, and_word, table2, WHERE,filter_column1,filter_value1,filter_value2, OPER, filter_column2,tablef;
-                        iss >> table1 >> column >> and_word >> table2>> column2 >>WHERE >> tablef >> filter_column1>> filter_value1>> OPER>> table2>>filter_column2>>filter_value2 ;
-                        Spisok<Pars<string, string>> filters;
-                        int filter_count = 0;
-                        filters.addEnd(Pars<string, string>(filter_column1, filter_value1));
-                        filters.addEnd(Pars<string, string>(filter_column2, filter_value2));
-
-                        selectFromMultipleTables(db, column,column2, table1, table2, filters, 0,WHERE,OPER,tablef);
-
-                    } else if (tables != "tables:"){
-                        string table;
-                        table = tables;
-                        selectFromTable(db, table, {}, 0, "AND");
+int main(int argc, char* argv[]) {
+    dbase db;
+    try {
+        loadSchema(db, "schema.json"); // Данные таблиц читаются при первом обращении
 
-                    } else {
-                        throw runtime_error("Invalid query format.");
-                    }
-                } else if (action == "DELETE") {
-                    string column, from, value, table;
-                    iss >> from >> table >> column >> value;
-                    deleteRow(db, column, value, table);
-                } else {
-                    throw runtime_error("Unknown command: " + query);
+        if (argc > 2 && string(argv[1]) == "--query") {
+            return executeQuery(db, argv[2]);
+        } else if (argc > 1 && string(argv[1]) == "--batch") {
+            if (argc > 2 && string(argv[2]) != "-") {
+                ifstream script(argv[2]);
+                if (!script) {
+                    throw runtime_error("Failed to open script: " + string(argv[2]));
                 }
-            } catch (const exception& e) {
-                cout << "Error: " << e.what() << endl;
+                return runBatch(db, script);
             }
+            return runBatch(db, cin);
+        } else if (argc > 2 && string(argv[1]) == "--serve") {
+            return serveUnixSocket(db, argv[2]);
         } else {
             cout << "Usage: " << argv[0] << " --query '<your query>'" << endl;
+            cout << "       " << argv[0] << " --batch [script|-]" << endl;
+            cout << "       " << argv[0] << " --serve <socket path>" << endl;
         }
     } catch (const exception& e) {
         cout << "Error: " << e.what() << endl;
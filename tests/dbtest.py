@@ -0,0 +1,212 @@
+# Общие помощники тестов: запуск сервера в своём каталоге, запросы по TCP,
+# прокси для обрыва соединения. Путь к собранному серверу — в DB_BIN (см. run.sh)
+
+import json
+import os
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+BIN = os.environ.get("DB_BIN", "")
+_next_port = int(os.environ.get("DB_TEST_PORT", "7700"))
+
+
+def free_port():
+    global _next_port
+    while True:
+        port = _next_port
+        _next_port += 1
+        s = socket.socket()
+        try:
+            s.bind(("127.0.0.1", port))
+            return port
+        except OSError:
+            continue
+        finally:
+            s.close()
+
+
+def wait_port(port, timeout=10):
+    end = time.time() + timeout
+    while time.time() < end:
+        try:
+            socket.create_connection(("127.0.0.1", port), timeout=0.5).close()
+            return
+        except OSError:
+            time.sleep(0.05)
+    raise RuntimeError("server on port %d did not start" % port)
+
+
+class Server:
+    """Сервер в собственном временном каталоге со своей schema.json"""
+
+    def __init__(self, schema, args=(), workdir=None, env=None):
+        self.workdir = workdir or tempfile.mkdtemp(prefix="dbtest_")
+        with open(os.path.join(self.workdir, "schema.json"), "w") as f:
+            json.dump(schema, f)
+        self.port = free_port()
+        self.args = list(args)
+        self.env = dict(os.environ, **(env or {}))
+        self.proc = None
+        self.start()
+
+    def start(self):
+        self.log = open(os.path.join(self.workdir, "server.log"), "a")
+        # stdbuf: построчный вывод, чтобы журнал сервера можно было читать на ходу
+        self.proc = subprocess.Popen(["stdbuf", "-oL", BIN, "--port", str(self.port)] + self.args,
+                                     cwd=self.workdir, env=self.env, stdout=self.log, stderr=subprocess.STDOUT)
+        wait_port(self.port)
+
+    def stop(self):
+        if self.proc and self.proc.poll() is None:
+            self.proc.terminate()
+            self.proc.wait(10)
+        self.proc = None
+        self.log.close()
+
+    def restart(self):
+        self.stop()
+        self.start()
+
+    def log_text(self):
+        with open(os.path.join(self.workdir, "server.log")) as f:
+            return f.read()
+
+    def client(self):
+        return Client(self.port)
+
+    def query(self, q):
+        c = self.client()
+        try:
+            return c.query(q)
+        finally:
+            c.close()
+
+    def cleanup(self):
+        self.stop()
+        shutil.rmtree(self.workdir, ignore_errors=True)
+
+
+class Client:
+    """Соединение с сервером: запрос — и ответ до паузы в данных"""
+
+    def __init__(self, port):
+        self.sock = socket.create_connection(("127.0.0.1", port))
+
+    def query(self, q, quiet=0.05):
+        self.sock.sendall(q.encode())
+        self.sock.settimeout(10)
+        data = b""
+        try:
+            while True:
+                chunk = self.sock.recv(1 << 16)
+                if not chunk:
+                    break
+                data += chunk
+                self.sock.settimeout(quiet)
+        except socket.timeout:
+            pass
+        return data.decode(errors="replace")
+
+    def execute(self, q):
+        """Команда с ответом в одну строку (INSERT, DELETE, CREATE): без паузы в конце"""
+        self.sock.sendall(q.encode())
+        self.sock.settimeout(10)
+        data = b""
+        while not data.endswith(b"\n"):
+            chunk = self.sock.recv(4096)
+            if not chunk:
+                break
+            data += chunk
+        return data.decode(errors="replace")
+
+    def close(self):
+        try:
+            self.sock.sendall(b"EXIT")
+        except OSError:
+            pass
+        self.sock.close()
+
+
+class Proxy:
+    """TCP-прокси: kill() рвёт все соединения через него, start() снова пускает"""
+
+    def __init__(self, target_port):
+        self.target = target_port
+        self.port = free_port()
+        self.start()
+
+    def start(self):
+        self.conns = []
+        self.lsock = socket.socket()
+        self.lsock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.lsock.bind(("127.0.0.1", self.port))
+        self.lsock.listen(8)
+        threading.Thread(target=self._accept, args=(self.lsock,), daemon=True).start()
+
+    def _accept(self, lsock):
+        while True:
+            try:
+                a, _ = lsock.accept()
+            except OSError:
+                return
+            b = socket.create_connection(("127.0.0.1", self.target))
+            self.conns += [a, b]
+            threading.Thread(target=self._pipe, args=(a, b), daemon=True).start()
+            threading.Thread(target=self._pipe, args=(b, a), daemon=True).start()
+
+    @staticmethod
+    def _pipe(src, dst):
+        try:
+            while True:
+                d = src.recv(1 << 16)
+                if not d:
+                    break
+                dst.sendall(d)
+        except OSError:
+            pass
+        for s in (src, dst):
+            try:
+                s.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+
+    def kill(self):
+        self.lsock.close()
+        for s in self.conns:
+            try:
+                s.shutdown(socket.SHUT_RDWR)
+                s.close()
+            except OSError:
+                pass
+
+
+def eventually(check, timeout=10):
+    """Ждём, пока check() не вернёт истину (реплики догоняют не сразу)"""
+    end = time.time() + timeout
+    while True:
+        if check():
+            return True
+        if time.time() > end:
+            return False
+        time.sleep(0.2)
+
+
+failures = []
+
+
+def expect(cond, what):
+    if not cond:
+        failures.append(what)
+        print("FAIL:", what)
+
+
+def finish(name):
+    if failures:
+        print("%s: %d failed" % (name, len(failures)))
+        sys.exit(1)
+    print("%s: ok" % name)
@@ -0,0 +1,17 @@
+#!/bin/sh
+# Собирает сервер и praktika1, прогоняет tests/test_*.py против них.
+# Путь к nlohmann/json можно передать через CXXFLAGS, например
+#   CXXFLAGS="-I/usr/local/include" sh tests/run.sh
+set -e
+DIR=$(cd "$(dirname "$0")" && pwd)
+BUILD=$(mktemp -d)
+trap 'rm -rf "$BUILD"' EXIT
+${CXX:-g++} -std=c++20 -O2 $CXXFLAGS "$DIR/../main.cpp" -o "$BUILD/server" -lpthread
+${CXX:-g++} -std=c++20 -O2 $CXXFLAGS "$DIR/../praktika1.cpp" -o "$BUILD/praktika1" -lpthread
+export DB_BIN="$BUILD/server"
+export CLI_BIN="$BUILD/praktika1"
+failed=0
+for t in "$DIR"/test_*.py; do
+    python3 "$t" || failed=1
+done
+exit $failed
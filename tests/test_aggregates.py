@@ -0,0 +1,54 @@
+# Агрегаты: суммы целых печатаются точно, дробные — кратчайшей записью без
+# потерь; SUM/AVG без чисел — NULL. То же для представления, которое
+# пересчитывается при вставке и удалении строк
+
+from dbtest import Server, expect, finish
+
+SCHEMA = {
+    "name": "sch",
+    "structure": {"b": ["name", "grp", "n:int64", "x:double"]},
+    "views": {"sums": "SELECT grp SUM(n) AVG(n) SUM(x) FROM b GROUP BY grp"},
+}
+
+
+def rows(srv, q):
+    return [l for l in srv.query(q).split("\n")[1:] if l]
+
+
+srv = Server(SCHEMA)
+try:
+    c = srv.client()
+    for name, grp, n, x in [("a", "small", 1234567, 0.1), ("b", "small", 1, 0.2), ("c", "small", 2, 1.5),
+                            ("d", "big", 9007199254740993, 1e300), ("e", "big", 1, 1e300),
+                            ("f", "max", 9223372036854775807, 1), ("g", "max", 1, 2)]:
+        c.execute("INSERT b %s %s %d %r" % (name, grp, n, x))
+    c.close()
+
+    expect(rows(srv, "SELECT SUM(n) AVG(n) FROM b WHERE grp = small") == ["1234570 411523.33333333331"],
+           "SUM of int64 values is exact and AVG keeps its fraction")
+    expect(rows(srv, "SELECT SUM(x) FROM b WHERE grp = small") == ["1.8"],
+           "SUM of doubles is printed without rounding to 6 digits")
+    expect(rows(srv, "SELECT SUM(x) FROM b WHERE name = a OR name = b") == ["0.30000000000000004"],
+           "SUM of doubles round-trips")
+    expect(rows(srv, "SELECT SUM(n) FROM b WHERE grp = big") == ["9007199254740994"],
+           "SUM of integers above 2^53 is exact")
+    expect(rows(srv, "SELECT SUM(n) AVG(n) FROM b WHERE grp = max") == ["9.2233720368547758e+18 4.6116860184273879e+18"],
+           "SUM beyond int64 is printed as double, AVG too")
+    expect(rows(srv, "SELECT SUM(name) AVG(name) COUNT(name) FROM b") == ["NULL NULL 7"],
+           "SUM and AVG over strings are NULL")
+    expect(rows(srv, "SELECT grp COUNT(*) MIN(n) MAX(name) FROM b GROUP BY grp ORDER BY grp") ==
+           ["big 2 1 e", "max 2 1 g", "small 3 1 c"], "GROUP BY with ORDER BY")
+
+    view = "SELECT * FROM sums ORDER BY grp"
+    expect(rows(srv, view) == ["big 9007199254740994 4503599627370497 2e+300",
+                               "max 9.2233720368547758e+18 4.6116860184273879e+18 3",
+                               "small 1234570 411523.33333333331 1.8"], "view sums are exact")
+    srv.query("DELETE FROM b name a")
+    srv.query("DELETE FROM b name f")
+    expect(rows(srv, view) == ["big 9007199254740994 4503599627370497 2e+300",
+                               "max 1 1 2",
+                               "small 3 1.5 1.7"], "view sums follow deletes")
+finally:
+    srv.cleanup()
+
+finish("aggregates")
@@ -0,0 +1,39 @@
+# praktika1: каждая команда — отдельный запуск, таблица читается из 1.csv
+# заново. Строка с пропущенной строковой колонкой переживает перечитывание
+# и перезапись файла при DELETE
+
+import json
+import os
+import shutil
+import subprocess
+import tempfile
+
+from dbtest import expect, finish
+
+CLI = os.environ.get("CLI_BIN", "")
+SCHEMA = {"name": "sch", "structure": {"table1": ["id:int64", "name", "city"]}}
+
+workdir = tempfile.mkdtemp(prefix="clitest_")
+
+
+def run(q):
+    return subprocess.run([CLI, "--query", q], cwd=workdir, capture_output=True, text=True, timeout=10).stdout
+
+
+try:
+    with open(os.path.join(workdir, "schema.json"), "w") as f:
+        json.dump(SCHEMA, f)
+    expect("saved" in run("INSERT table1 0 bob"), "INSERT without the last column is accepted")
+    run("INSERT table1 0 amy x")
+    run("INSERT table1 0 eve")
+    rows = run("SELECT FROM table1")
+    expect('name: "bob", city: ""' in rows and 'name: "eve", city: ""' in rows,
+           "rows with an empty column are read back")
+    expect("Deleted row" in run("DELETE FROM table1 name amy"), "DELETE finds its row")
+    rows = run("SELECT FROM table1")
+    expect('name: "bob"' in rows and 'name: "eve"' in rows and "amy" not in rows,
+           "DELETE rewrites the file without losing rows with empty columns")
+finally:
+    shutil.rmtree(workdir, ignore_errors=True)
+
+finish("cli")
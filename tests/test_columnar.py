@@ -0,0 +1,95 @@
+# Колоночное хранение: блок с испорченной контрольной суммой пропускается при
+# загрузке, остальные строки читаются. Перезапись файла (DELETE) переносит
+# байты блока как есть — после починки файла строка возвращается. Под другим
+# набором колонок такой блок перенести нельзя, и DELETE отказывается — клиент,
+# маршрутизатор и реплики видят отказ
+
+import json
+import os
+
+from dbtest import Server, eventually, expect, finish
+
+SCHEMA = {
+    "name": "sch",
+    "structure": {"t": ["name", "n:int64"]},
+    "storage": {"t": "columnar"},
+}
+
+
+def names(srv):
+    reply = srv.query("SELECT name FROM t")
+    return sorted(l for l in reply.split("\n")[1:] if l and not l.startswith("No data"))
+
+
+def data_file(srv):
+    path = os.path.join(srv.workdir, "sch", "t", "data.col")
+    try:
+        with open(path, "rb") as f:
+            return f.read()
+    except OSError:
+        return b""
+
+
+def patch(srv, old, new):
+    path = os.path.join(srv.workdir, "sch", "t", "data.col")
+    data = data_file(srv)
+    found = data.count(old) == 1
+    with open(path, "wb") as f:
+        f.write(data.replace(old, new))
+    return found
+
+
+srv = Server(SCHEMA)
+try:
+    c = srv.client()
+    for i, name in enumerate(["alpha", "victim", "gamma", "delta"]):
+        c.execute("INSERT t %s %d" % (name, i))
+    c.close()
+    srv.stop()
+
+    # каждая вставка — свой блок; портим данные блока со строкой victim
+    expect(patch(srv, b"victim", b"victiX"), "row bytes found in data.col")
+    srv.start()
+    expect(names(srv) == ["alpha", "delta", "gamma"], "damaged block is skipped, other blocks load")
+    expect("Checksum mismatch, block 2 kept as is" in srv.log_text(), "damaged block is reported")
+
+    # DELETE переписывает файл: испорченный блок остаётся в нём байт в байт
+    srv.query("DELETE FROM t name gamma")
+    srv.query("INSERT t omega 9")
+    srv.restart()
+    expect(names(srv) == ["alpha", "delta", "omega"], "rewrite keeps rows and drops deleted ones")
+    expect(srv.log_text().count("Checksum mismatch, block") == 2, "damaged block survives the rewrite")
+
+    srv.stop()
+    expect(patch(srv, b"victiX", b"victim"), "damaged bytes are carried over unchanged")
+    srv.start()
+    expect(names(srv) == ["alpha", "delta", "omega", "victim"], "repaired block loads again")
+    expect("n=1" in srv.query("SELECT * FROM t WHERE name = victim"), "repaired row keeps its values")
+
+    # новая колонка в схеме: повреждённый блок старого формата не перенести
+    srv.stop()
+    patch(srv, b"victim", b"victiX")
+    schema = dict(SCHEMA, structure={"t": ["name", "n:int64", "city"]})
+    with open(os.path.join(srv.workdir, "schema.json"), "w") as f:
+        json.dump(schema, f)
+    srv.start()
+    expect(names(srv) == ["alpha", "delta", "omega"], "old layout rows load under the new schema")
+    refused = "Error: table t has damaged blocks, DELETE refused."
+    expect(refused in srv.query("DELETE FROM t name alpha") and "alpha" in names(srv),
+           "DELETE is refused while an old-layout block is damaged")
+
+    # Отказ видят и маршрутизатор кластера, и реплика: в журнал он не попадает
+    replica = Server(schema, ["--follow", "127.0.0.1:%d" % srv.port])
+    router = Server(schema, ["--shards", "127.0.0.1:%d" % srv.port])
+    try:
+        expect(refused in router.query("DELETE FROM t name alpha"), "router passes the refusal on")
+        srv.query("INSERT t sigma 5 x")
+        expect(eventually(lambda: names(replica) == ["alpha", "delta", "omega", "sigma"]),
+               "refused DELETE is not replicated")
+    finally:
+        router.cleanup()
+        replica.cleanup()
+finally:
+    srv.cleanup()
+
+finish("columnar")
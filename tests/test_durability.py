@@ -0,0 +1,60 @@
+# Подтверждённая запись не теряется при остановке: клиент получает ответ,
+# когда строка уже на диске, а SIGTERM дописывает очередь ввода-вывода.
+# Несколько клиентов пишут параллельно — их записи уходят на диск пачками.
+# DELETE переписывает файл таблицы целиком — это тоже ждёт ответ
+
+import threading
+
+from dbtest import Server, expect, finish
+
+SCHEMA = {
+    "name": "sch",
+    "structure": {"plain": ["name", "number:int64"],
+                  "packed": ["name", "number:int64"]},
+    "storage": {"packed": "columnar"},
+}
+CLIENTS = 4
+ROWS = 500
+PAD = "x" * 1000     # файл в несколько мегабайт: перезапись заметно дольше ответа
+
+
+def count(srv, table):
+    reply = srv.query("SELECT COUNT(*) FROM " + table)
+    return reply.split("\n")[1] if reply.count("\n") > 1 else reply
+
+
+def writer(srv, k, acked):
+    c = srv.client()
+    for i in range(ROWS):
+        for t in ("plain", "packed"):
+            if "inserted" in c.execute("INSERT %s w%d_%d%s %d" % (t, k, i, PAD, i)):
+                acked[t] += 1
+    c.close()
+
+
+srv = Server(SCHEMA)
+try:
+    acked = [{"plain": 0, "packed": 0} for _ in range(CLIENTS)]
+    threads = [threading.Thread(target=writer, args=(srv, k, acked[k])) for k in range(CLIENTS)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    # сразу после последнего ответа — SIGTERM, без паузы на фоновую запись
+    srv.restart()
+    for t in ("plain", "packed"):
+        total = sum(a[t] for a in acked)
+        expect(total == CLIENTS * ROWS, "every INSERT into %s is acknowledged" % t)
+        expect(count(srv, t) == str(total), "acknowledged rows of %s survive a restart" % t)
+    expect("Server stopped." in srv.log_text(), "SIGTERM stops the server cleanly")
+
+    c = srv.client()
+    for t in ("plain", "packed"):
+        expect("deleted" in c.execute("DELETE FROM %s number 7" % t), "DELETE from %s is acknowledged" % t)
+    srv.restart()
+    for t in ("plain", "packed"):
+        expect(count(srv, t) == str(CLIENTS * (ROWS - 1)), "acknowledged DELETE from %s survives a restart" % t)
+finally:
+    srv.cleanup()
+
+finish("durability")
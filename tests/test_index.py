@@ -0,0 +1,75 @@
+# B+-дерево: диапазонные условия и ORDER BY по индексу дают те же строки, что
+# полный скан такой же таблицы без индекса. Строк хватает на три уровня
+# дерева; проверяем после удалений и после перезапуска (индекс строится заново)
+
+from dbtest import Server, expect, finish
+
+COLUMNS = ["name", "age:int64", "adress", "number:int64"]
+SCHEMA = {
+    "name": "sch",
+    "structure": {"indexed": COLUMNS, "plain": COLUMNS},
+    "indexes": {"indexed": ["number", "age"]},
+}
+ROWS = 5000
+
+
+def lines(reply):
+    return [l for l in reply.split("\n") if l]
+
+
+def check(srv, where, ordered):
+    a = srv.query("SELECT * FROM indexed " + where)
+    # пустой ответ называет таблицу
+    b = srv.query("SELECT * FROM plain " + where).replace("plain", "indexed")
+    same = a == b if ordered else sorted(lines(a)) == sorted(lines(b))
+    expect(same, "index matches full scan: " + where)
+    return lines(a)[1:]
+
+
+def run_checks(srv):
+    # без ORDER BY порядок строк не задан; с ним ключи number различны и
+    # порядок однозначен
+    check(srv, "WHERE number > 4990", False)
+    check(srv, "WHERE number >= 100 AND number < 164 ORDER BY number", True)
+    check(srv, "WHERE number > 2000 AND number <= 2500 ORDER BY number DESC", True)
+    check(srv, "WHERE number >= 0064 AND number <= 70", False)
+    check(srv, "WHERE number < 10 ORDER BY number DESC LIMIT 4 OFFSET 2", True)
+    check(srv, "WHERE number > 100 AND number > 4000 AND number < 4100 AND number <= 4090", False)
+    check(srv, "WHERE number > 3000 AND number < 2000", False)
+    check(srv, "WHERE number = 1234", False)
+    check(srv, "WHERE number > 4000 AND adress = a3 ORDER BY number", True)
+    check(srv, "ORDER BY number DESC LIMIT 20", True)
+    check(srv, "ORDER BY number LIMIT 5 OFFSET 4995", True)
+    # у равных age порядок в индексе другой, сравниваем множества строк
+    check(srv, "WHERE age >= 30 AND age < 33", False)
+    check(srv, "WHERE age > 40 OR number < 20", False)
+    rows = check(srv, "WHERE age < 22 ORDER BY age DESC", False)
+    ages = [int(r.split()[1].split("=")[1]) for r in rows]
+    expect(ages == sorted(ages, reverse=True), "index ORDER BY DESC returns keys in order")
+
+
+srv = Server(SCHEMA)
+try:
+    c = srv.client()
+    for i in range(ROWS):
+        # ключи вставляются вразброс, чтобы листья делились в разных местах
+        k = (i * 2654435761) % ROWS
+        for t in ("indexed", "plain"):
+            c.execute("INSERT %s n%d %d a%d %d" % (t, k, 20 + k % 31, k % 7, k))
+    c.close()
+    rows = check(srv, "ORDER BY number", True)
+    expect([r.split()[-1] for r in rows] == ["number=%d" % i for i in range(ROWS)],
+           "index ORDER BY returns every row in order")
+    run_checks(srv)
+
+    for q in ("DELETE FROM %s adress a3", "DELETE FROM %s number 1234", "DELETE FROM %s age 30"):
+        for t in ("indexed", "plain"):
+            srv.query(q % t)
+    run_checks(srv)
+
+    srv.restart()
+    run_checks(srv)
+finally:
+    srv.cleanup()
+
+finish("index")
@@ -0,0 +1,99 @@
+# Реплика: снимок при подключении, живой поток записей, догон после обрыва
+# соединения (та же эпоха ведущего — без нового снимка) и RESET после
+# перезапуска ведущего. Представление, созданное командой, реплика получает
+# из журнала и из снимка, а ведущий сохраняет его в schema.json
+
+from dbtest import Server, Proxy, expect, eventually, finish
+
+SCHEMA = {
+    "name": "sch",
+    "structure": {"table1": ["name", "age", "adress", "number"],
+                  "table2": ["name", "age", "adress", "number"]},
+    "storage": {"table1": "columnar"},
+    "indexes": {"table1": ["number"]},
+}
+
+CHECK = ["SELECT * FROM table1 ORDER BY number",
+         "SELECT * FROM table2 ORDER BY number",
+         "SELECT adress COUNT(*) SUM(number) FROM table2 GROUP BY adress ORDER BY adress",
+         "SELECT * FROM towns ORDER BY adress"]
+VIEW = "CREATE MATERIALIZED VIEW towns AS SELECT adress COUNT(*) SUM(number) FROM table2 GROUP BY adress"
+
+
+def dump(srv):
+    c = srv.client()
+    try:
+        return [c.query(q) for q in CHECK]
+    finally:
+        c.close()
+
+
+def same(primary, replica):
+    return eventually(lambda: dump(primary) == dump(replica))
+
+
+def insert(srv, first, last):
+    c = srv.client()
+    for i in range(first, last):
+        c.query("INSERT table1 n%d %d city%d %d" % (i, 20 + i % 50, i % 7, 1000 + i))
+        c.query("INSERT table2 m%d %d town%d %d" % (i, i % 30, i % 5, i))
+    c.close()
+
+
+primary = Server(SCHEMA)
+proxy = Proxy(primary.port)
+replica = None
+late = None
+try:
+    # снимок: строки есть у ведущего до подключения реплики
+    insert(primary, 0, 80)
+    primary.query("DELETE FROM table2 name m10")
+    replica = Server(SCHEMA, ["--follow", "127.0.0.1:%d" % proxy.port])
+    expect(same(primary, replica), "replica matches primary after snapshot")
+    expect("n79" in replica.query("SELECT name FROM table1 WHERE number = 1079"),
+           "snapshot rows are readable on the replica")
+
+    # живой поток: записи идут сразу после снимка
+    expect("View created" in primary.query(VIEW), "view is created on the primary")
+    insert(primary, 80, 120)
+    primary.query("DELETE FROM table1 name n5")
+    expect(same(primary, replica), "replica follows live writes")
+
+    # реплика не принимает записи от клиентов
+    replica.query("INSERT table1 local 1 here 1")
+    expect("local" not in replica.query("SELECT name FROM table1 WHERE name = local"),
+           "writes on the replica are refused")
+    expect("read-only replica" in replica.query(VIEW.replace("towns", "local")),
+           "views can't be created on the replica")
+
+    # обрыв: пишем, пока реплика отключена, потом она догоняет по журналу
+    proxy.kill()
+    insert(primary, 120, 160)
+    primary.query("DELETE FROM table2 adress town3")
+    proxy.start()
+    expect(same(primary, replica), "replica catches up after reconnect")
+    expect(replica.log_text().count("Replica reset") == 1,
+           "reconnect within one epoch does not take a new snapshot")
+
+    # перезапуск ведущего: новая эпоха, реплика берёт новый снимок
+    primary.restart()
+    insert(primary, 160, 170)
+    expect(same(primary, replica), "replica resynchronises after primary restart")
+    expect(replica.log_text().count("Replica reset") == 2,
+           "primary restart makes the replica reset")
+    expect(dump(primary)[3].startswith("adress COUNT(*) SUM(number)\ntown0 "),
+           "view survives the primary restart")
+
+    # новая реплика со схемой без представления получает его в снимке
+    late = Server(SCHEMA, ["--follow", "127.0.0.1:%d" % primary.port])
+    expect(same(primary, late), "snapshot carries the view")
+    expect("failed" not in replica.log_text() + late.log_text(), "view records apply cleanly")
+finally:
+    proxy.kill()
+    if late:
+        late.cleanup()
+    if replica:
+        replica.cleanup()
+    primary.cleanup()
+
+finish("replication")
@@ -0,0 +1,148 @@
+# Кластер: маршрутизатор и три шарда против одиночного сервера с теми же
+# данными. Раскладка строк по хешу ключа, точечные запросы, сканы со слиянием
+# ответов (ORDER BY, LIMIT/OFFSET, объединение таблиц), слияние частичных
+# агрегатов, большой ответ; шард, который молчит, не занимает пул маршрутизатора
+
+import json
+import socket
+import threading
+import time
+
+from dbtest import Server, expect, finish
+
+SCHEMA = {
+    "name": "sch",
+    "structure": {"table1": ["name", "age:int64", "adress", "number:int64"],
+                  "table2": ["name", "age", "adress", "number:double"],
+                  "big": ["name", "number:int64"]},
+    "sharding": {"table1": "number"},
+}
+
+
+def shard_of(key, n):
+    # FNV-1a, как shardOf на сервере
+    h = 14695981039346656037
+    for b in key.encode():
+        h ^= b
+        h = (h * 1099511628211) & 0xFFFFFFFFFFFFFFFF
+    return h % n
+
+
+def lines(reply):
+    return [l for l in reply.split("\n") if l]
+
+
+def same_rows(a, b):
+    return sorted(lines(a)) == sorted(lines(b))
+
+
+shards = [Server(SCHEMA) for _ in range(3)]
+router = Server(SCHEMA, ["--shards", ",".join("127.0.0.1:%d" % s.port for s in shards)])
+ref = Server(SCHEMA)
+servers = shards + [router, ref]
+try:
+    rc, fc = router.client(), ref.client()
+    for i in range(300):
+        for c in (rc, fc):
+            c.execute("INSERT table1 p%d %d a%d %d" % (i % 40, 20 + i % 11, i % 6, 1000 + i))
+            if i < 120:
+                c.execute("INSERT table2 q%d %d t%d %d.5" % (i, i % 9, i % 4, 5000 + i))
+    # длинные строки: ответ больше буфера соединения, шарды отдают его частями
+    pad = "x" * 300
+    for i in range(4000):
+        for c in (rc, fc):
+            c.execute("INSERT big %s%d %d" % (pad, i, i))
+    rc.close()
+    fc.close()
+
+    # Раскладка: каждая строка на том шарде, куда указывает хеш её ключа
+    placed = 0
+    for k, s in enumerate(shards):
+        rows = lines(s.query("SELECT number FROM table1"))[1:]
+        placed += len(rows)
+        expect(all(shard_of(r, 3) == k for r in rows), "table1 rows follow the hash of number on shard %d" % k)
+        rows = lines(s.query("SELECT name FROM table2"))[1:]
+        expect(all(shard_of(r, 3) == k for r in rows), "table2 rows follow the hash of name on shard %d" % k)
+    expect(placed == 300, "every table1 row is stored exactly once")
+
+    # SCAN на шарде: строки идут по ходу обхода таблицы, новые первыми
+    mine = [str(1000 + i) for i in range(300) if shard_of(str(1000 + i), 3) == 0]
+    reply = shards[0].query("SHARD SCAN table1 WHERE age > 0 LIMIT 3")
+    got = [json.loads(l)["number"] for l in reply.rstrip("\0").split("\n") if l]
+    expect(got == mine[::-1][:3], "shard SCAN with LIMIT streams the newest rows")
+
+    def check(q, ordered):
+        a, b = router.query(q), ref.query(q)
+        expect(a == b if ordered else same_rows(a, b), "router matches single server: " + q)
+
+    # Точечные запросы и сканы
+    check("SELECT name age FROM table1 WHERE number = 1005", False)
+    check("SELECT name age FROM table1 WHERE number = 01005 AND age = 25", False)
+    check("SELECT name age FROM table1 WHERE number = 42", False)
+    check("SELECT * FROM table1 WHERE name = p3", False)
+    check("SELECT name number FROM table1 WHERE age > 25 OR adress = a1", False)
+    check("SELECT name number FROM table1 ORDER BY number", True)
+    check("SELECT name number FROM table1 ORDER BY number DESC LIMIT 5 OFFSET 3", True)
+    check("SELECT name number FROM table1 WHERE age < 24 ORDER BY number LIMIT 7", True)
+    check("SELECT name number FROM table1 ORDER BY number LIMIT 0", True)
+    check("SELECT name number FROM table1 table2 WHERE age > 3 ORDER BY number", True)
+    check("SELECT name number FROM table1 table2 ORDER BY number DESC LIMIT 10 OFFSET 290", True)
+    check("SELECT name FROM table1 WHERE age > 1000", True)
+    check("SELECT * FROM nosuch", True)
+    check("SELECT name FROM table1 nosuch table2 WHERE number > 5100 ORDER BY number", True)
+    check("SELECT * FROM big ORDER BY number DESC", True)
+    check("SELECT number FROM big", False)
+    a = lines(router.query("SELECT name FROM table1 LIMIT 12 OFFSET 4"))
+    expect(len(a) == 13, "LIMIT without ORDER BY is applied at the router")
+    check("SELECT table1.name table2.name FROM table1 CROSS JOIN table2 WHERE table1.name = p1", False)
+
+    # Агрегаты: частичные группы шардов сливаются
+    check("SELECT adress COUNT(*) SUM(number) MIN(age) MAX(name) AVG(number) FROM table1 GROUP BY adress ORDER BY adress", True)
+    check("SELECT adress COUNT(*) AVG(number) FROM table2 GROUP BY adress ORDER BY adress", True)
+    check("SELECT COUNT(*) SUM(number) FROM table1 table2", True)
+    check("SELECT COUNT(*) SUM(name) FROM table1", True)
+    check("SELECT COUNT(*) FROM table1 WHERE age > 100", True)
+    check("SELECT adress COUNT(*) FROM table1 WHERE age > 100 GROUP BY adress", True)
+
+    # Запись через маршрутизатор
+    for c in (router, ref):
+        c.query("DELETE FROM table1 number 1010")
+        c.query("DELETE FROM table1 name p2")
+    check("SELECT name number FROM table1 ORDER BY number", True)
+    check("SELECT age COUNT(*) FROM table1 GROUP BY age ORDER BY age", True)
+finally:
+    for s in servers:
+        s.cleanup()
+
+# Шард принимает соединение, но не отвечает: маршрутизатор ждёт его в
+# реакторе, и единственный поток пула свободен для других команд
+mute = socket.socket()
+mute.bind(("127.0.0.1", 0))
+mute.listen(8)
+held = []
+threading.Thread(target=lambda: [held.append(mute.accept()) for _ in range(8)], daemon=True).start()
+slow = dict(SCHEMA, limits={"max_running": 1})
+router = Server(slow, ["--shards", "127.0.0.1:%d" % mute.getsockname()[1]])
+try:
+    stuck = [router.client() for _ in range(2)]
+    for c in stuck:
+        c.sock.sendall(b"SELECT * FROM table1")
+    time.sleep(0.3)
+    start = time.time()
+    reply = router.query("SELECT * FROM nosuch")
+    expect("Table not found" in reply and time.time() - start < 1,
+           "router answers while shards are slow")
+    for c in stuck:
+        c.sock.close()
+finally:
+    router.cleanup()
+    mute.close()
+
+# Недоступный шард — ошибка, а не зависание
+router = Server(SCHEMA, ["--shards", "127.0.0.1:1"])
+try:
+    expect("is unavailable" in router.query("SELECT * FROM table1"), "unavailable shard is reported")
+finally:
+    router.cleanup()
+
+finish("sharding")
@@ -0,0 +1,93 @@
+# ORDER BY с маленьким бюджетом памяти (limits.sort_memory): прогоны уходят на
+# диск и сливаются, ответ тот же, что у сервера, сортирующего в памяти.
+# Top-k при LIMIT, переполнение кучи top-k, прогоны удаляются после запроса;
+# без каталога для прогонов сортировка остаётся в памяти. "nan", "inf" и
+# шестнадцатеричные значения — строки, они идут после всех чисел
+
+import os
+import shutil
+import tempfile
+
+from dbtest import Server, expect, finish
+
+SCHEMA = {
+    "name": "sch",
+    "structure": {"table1": ["name", "age:int64", "adress", "number:int64"],
+                  "table2": ["name", "age:int64", "adress", "number:int64"],
+                  "vals": ["v"], "ivals": ["v"]},
+    "indexes": {"ivals": ["v"]},
+}
+ODD = ["5", "nan", "3", "9", "1", "NaN", "7", "inf", "2", "0x10", "8", "-inf", "1e999", "-4.5"]
+ODD_SORTED = ["-4.5", "1", "2", "3", "5", "7", "8", "9", "-inf", "0x10", "1e999", "NaN", "inf", "nan"]
+SMALL = dict(SCHEMA, limits={"sort_memory": 16384})
+
+QUERIES = [
+    "SELECT * FROM table1 ORDER BY age",
+    "SELECT name age FROM table1 ORDER BY age DESC",
+    "SELECT name number FROM table1 ORDER BY name",
+    "SELECT name number FROM table1 WHERE age > 30 ORDER BY number DESC",
+    "SELECT name number FROM table1 table2 ORDER BY number",
+    "SELECT name age FROM table1 ORDER BY age LIMIT 10 OFFSET 5",
+    "SELECT name age FROM table1 ORDER BY age DESC LIMIT 900 OFFSET 100",
+    "SELECT adress COUNT(*) SUM(number) FROM table1 GROUP BY adress ORDER BY adress",
+]
+
+
+def lines(reply):
+    return [l for l in reply.split("\n") if l]
+
+
+def fill(srv):
+    c = srv.client()
+    for i in range(1500):
+        # много одинаковых age: при равных ключах порядок вставки сохраняется
+        c.execute("INSERT table1 n%04d %d city%d %d" % ((i * 7919) % 1500, 20 + i % 23, i % 9, (i * 337) % 1500))
+        if i < 400:
+            c.execute("INSERT table2 m%d %d town%d %d" % (i, i % 5, i % 3, 3000 - i))
+    c.close()
+
+
+runs_dir = tempfile.mkdtemp(prefix="dbtest_runs_")
+small = Server(SMALL, env={"TMPDIR": runs_dir})
+large = Server(SCHEMA)
+nodir = Server(SMALL, env={"TMPDIR": os.path.join(runs_dir, "missing")})
+try:
+    for s in (small, large, nodir):
+        fill(s)
+
+    for q in QUERIES:
+        want = large.query(q)
+        expect(small.query(q) == want, "spilled sort matches in-memory sort: " + q)
+        expect(nodir.query(q) == want, "sort without a run directory stays in memory: " + q)
+    expect(os.listdir(runs_dir) == [], "sort runs are removed after the query")
+    expect("Failed to create sort run" in nodir.log_text(),
+           "small sort budget makes the server spill runs")
+
+    # NaN не равен каждому числу: порядок полный — в куче top-k, при
+    # слиянии прогонов и в B+-дереве
+    c = small.client()
+    for v in ODD:
+        c.execute("INSERT vals " + v)
+        c.execute("INSERT ivals " + v)
+    c.close()
+    for t in ("vals", "ivals"):
+        rows = lines(small.query("SELECT v FROM %s ORDER BY v" % t))[1:]
+        expect(rows == ODD_SORTED, "numbers sort before nan/inf/hex strings in " + t)
+        rows = lines(small.query("SELECT v FROM %s ORDER BY v DESC LIMIT 4" % t))[1:]
+        expect(rows == ODD_SORTED[::-1][:4], "top-k over nan/inf in " + t)
+        rows = lines(small.query("SELECT v FROM %s WHERE v > 4 ORDER BY v" % t))[1:]
+        expect(rows == ODD_SORTED[4:], "range condition keeps the same order in " + t)
+
+    # top-k: сверяем с ожидаемым, а не только между серверами
+    rows = lines(small.query("SELECT number FROM table1 ORDER BY number LIMIT 5"))[1:]
+    expect(rows == ["0", "1", "2", "3", "4"], "top-k returns the smallest keys")
+    rows = lines(small.query("SELECT number FROM table1 ORDER BY number DESC LIMIT 3 OFFSET 1"))[1:]
+    expect(rows == ["1498", "1497", "1496"], "top-k with OFFSET skips the first rows")
+    rows = lines(small.query("SELECT number FROM table1 ORDER BY number"))[1:]
+    expect(rows == [str(i) for i in range(1500)], "full external sort returns every row in order")
+finally:
+    for s in (small, large, nodir):
+        s.cleanup()
+    shutil.rmtree(runs_dir, ignore_errors=True)
+
+finish("sort")